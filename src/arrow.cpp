@@ -0,0 +1,505 @@
+#include "tdscpp.h"
+#include "tdscpp-private.h"
+#include <bit>
+
+using namespace std;
+
+static const int64_t jan1970 = 719162; // days from 0001-01-01 to 1970-01-01
+static const int64_t jan1900_1970 = 25567; // days from 1900-01-01 to 1970-01-01
+
+static const int64_t pow10_table[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+namespace tds {
+    struct arrow_schema_data {
+        string format;
+        string name;
+        vector<ArrowSchema> children;
+        vector<ArrowSchema*> child_ptrs;
+    };
+
+    struct arrow_array_data {
+        vector<uint8_t> validity;
+        vector<uint8_t> values;
+        vector<int64_t> ints;
+        vector<double> floats;
+        vector<int64_t> offsets;
+        vector<uint8_t> data;
+        array<const void*, 3> buffers;
+        vector<ArrowArray> children;
+        vector<ArrowArray*> child_ptrs;
+    };
+
+    static void release_schema(ArrowSchema* schema) {
+        auto d = (arrow_schema_data*)schema->private_data;
+
+        for (auto& c : d->children) {
+            if (c.release)
+                c.release(&c);
+        }
+
+        delete d;
+
+        schema->release = nullptr;
+    }
+
+    static void release_array(ArrowArray* array) {
+        auto d = (arrow_array_data*)array->private_data;
+
+        for (auto& c : d->children) {
+            if (c.release)
+                c.release(&c);
+        }
+
+        delete d;
+
+        array->release = nullptr;
+    }
+
+    static string arrow_format(const column& col) {
+        switch (col.type) {
+            case sql_type::TINYINT:
+                return "C";
+
+            case sql_type::SMALLINT:
+                return "s";
+
+            case sql_type::INT:
+                return "i";
+
+            case sql_type::BIGINT:
+                return "l";
+
+            case sql_type::INTN:
+                switch (col.max_length) {
+                    case 1:
+                        return "C";
+
+                    case 2:
+                        return "s";
+
+                    case 4:
+                        return "i";
+
+                    default:
+                        return "l";
+                }
+
+            case sql_type::BIT:
+            case sql_type::BITN:
+                return "b";
+
+            case sql_type::REAL:
+                return "f";
+
+            case sql_type::FLOAT:
+                return "g";
+
+            case sql_type::FLTN:
+                return col.max_length == sizeof(float) ? "f" : "g";
+
+            case sql_type::DATE:
+                return "tdD";
+
+            case sql_type::TIME:
+                return "ttn";
+
+            case sql_type::DATETIME:
+            case sql_type::DATETIM4:
+            case sql_type::DATETIMN:
+            case sql_type::DATETIME2:
+                return "tsu:";
+
+            case sql_type::DATETIMEOFFSET:
+                return "tsu:UTC";
+
+            case sql_type::DECIMAL:
+            case sql_type::NUMERIC:
+                return fmt::format("d:{},{}", col.precision, col.scale);
+
+            case sql_type::MONEY:
+            case sql_type::MONEYN:
+                return "d:19,4";
+
+            case sql_type::SMALLMONEY:
+                return "d:10,4";
+
+            case sql_type::VARBINARY:
+            case sql_type::BINARY:
+            case sql_type::IMAGE:
+                return "Z";
+
+            case sql_type::UNIQUEIDENTIFIER:
+                return "w:16";
+
+            default:
+                return "U";
+        }
+    }
+
+    template<typename T>
+    static void narrow_ints(arrow_array_data& d, const vector<int64_t>& ints) {
+        d.values.resize(ints.size() * sizeof(T));
+
+        auto ptr = (T*)d.values.data();
+
+        for (auto i : ints) {
+            *ptr = (T)i;
+            ptr++;
+        }
+    }
+
+    static void pack_bits(arrow_array_data& d, const vector<int64_t>& ints) {
+        d.values.resize((ints.size() + 7) / 8);
+
+        for (size_t i = 0; i < ints.size(); i++) {
+            if (ints[i])
+                d.values[i / 8] |= (uint8_t)(1 << (i % 8));
+        }
+    }
+
+    // convert time and date parts of TIME, DATETIME2, and DATETIMEOFFSET, which are in UTC for the latter
+
+    static int64_t time_ticks(span<const uint8_t> sp, unsigned int scale) {
+        uint64_t ticks = 0;
+
+        memcpy(&ticks, sp.data(), min(sizeof(uint64_t), sp.size()));
+
+        return (int64_t)ticks * pow10_table[7 - min(scale, 7u)];
+    }
+
+    static int64_t date_days(span<const uint8_t> sp) {
+        uint32_t n = 0;
+
+        memcpy(&n, sp.data(), 3);
+
+        return (int64_t)n - jan1970;
+    }
+
+    static int64_t to_timestamp(span<const uint8_t> sp, const column& col) {
+        switch (col.type) {
+            case sql_type::DATETIME2:
+                return (date_days(sp.subspan(sp.size() - 3)) * 86400000000) +
+                       (time_ticks(sp.subspan(0, sp.size() - 3), col.max_length) / 10);
+
+            case sql_type::DATETIMEOFFSET:
+                return (date_days(sp.subspan(sp.size() - 5)) * 86400000000) +
+                       (time_ticks(sp.subspan(0, sp.size() - 5), col.max_length) / 10);
+
+            default:
+                if (sp.size() == 4) {
+                    auto days = *(uint16_t*)sp.data();
+                    auto mins = *(uint16_t*)(sp.data() + sizeof(uint16_t));
+
+                    return (((int64_t)days - jan1900_1970) * 86400000000) + ((int64_t)mins * 60000000);
+                } else {
+                    auto days = *(int32_t*)sp.data();
+                    auto t = *(uint32_t*)(sp.data() + sizeof(int32_t));
+
+                    return (((int64_t)days - jan1900_1970) * 86400000000) + ((int64_t)t * 10000 / 3);
+                }
+        }
+    }
+
+    static void append_utf8(arrow_array_data& d, u16string_view sv) {
+        auto start = d.data.size();
+
+        d.data.resize(start + utf16_to_utf8_len(sv));
+
+        span<char> dest((char*)d.data.data() + start, d.data.size() - start);
+
+        utf16_to_utf8_range(sv, dest);
+    }
+
+    static void to_arrow_column(column_vector& cv, ArrowSchema& schema, ArrowArray& array) {
+        auto sd = new arrow_schema_data;
+
+        sd->format = arrow_format(cv.col);
+        sd->name = utf16_to_utf8(cv.col.name);
+
+        schema.format = sd->format.c_str();
+        schema.name = sd->name.c_str();
+        schema.metadata = nullptr;
+        schema.flags = cv.col.nullable ? ARROW_FLAG_NULLABLE : 0;
+        schema.n_children = 0;
+        schema.children = nullptr;
+        schema.dictionary = nullptr;
+        schema.release = release_schema;
+        schema.private_data = sd;
+
+        auto ad = new arrow_array_data;
+        int64_t null_count = 0;
+
+        for (auto b : cv.validity) {
+            null_count += popcount(b);
+        }
+
+        null_count = (int64_t)cv.length - null_count;
+
+        ad->buffers[0] = nullptr;
+        ad->buffers[1] = nullptr;
+        ad->buffers[2] = nullptr;
+
+        array.length = (int64_t)cv.length;
+        array.null_count = null_count;
+        array.offset = 0;
+        array.n_buffers = 2;
+        array.n_children = 0;
+        array.buffers = ad->buffers.data();
+        array.children = nullptr;
+        array.dictionary = nullptr;
+        array.release = release_array;
+        array.private_data = ad;
+
+        switch (sd->format[0]) {
+            case 'C':
+                narrow_ints<uint8_t>(*ad, cv.ints);
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 's':
+                narrow_ints<int16_t>(*ad, cv.ints);
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'i':
+                narrow_ints<int32_t>(*ad, cv.ints);
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'l':
+                ad->ints.swap(cv.ints);
+                ad->buffers[1] = ad->ints.data();
+                break;
+
+            case 'b':
+                pack_bits(*ad, cv.ints);
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'f':
+                ad->values.resize(cv.floats.size() * sizeof(float));
+
+                for (size_t i = 0; i < cv.floats.size(); i++) {
+                    ((float*)ad->values.data())[i] = (float)cv.floats[i];
+                }
+
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'g':
+                ad->floats.swap(cv.floats);
+                ad->buffers[1] = ad->floats.data();
+                break;
+
+            case 't': {
+                auto width = cv.col.type == sql_type::DATE ? sizeof(int32_t) : sizeof(int64_t);
+
+                ad->values.resize(cv.length * width);
+
+                for (size_t i = 0; i < cv.length; i++) {
+                    if (cv.is_null(i))
+                        continue;
+
+                    auto sp = cv.bytes(i);
+
+                    switch (cv.col.type) {
+                        case sql_type::DATE:
+                            ((int32_t*)ad->values.data())[i] = (int32_t)date_days(sp);
+                            break;
+
+                        case sql_type::TIME:
+                            ((int64_t*)ad->values.data())[i] = time_ticks(sp, cv.col.max_length) * 100;
+                            break;
+
+                        default:
+                            ((int64_t*)ad->values.data())[i] = to_timestamp(sp, cv.col);
+                            break;
+                    }
+                }
+
+                ad->buffers[1] = ad->values.data();
+                break;
+            }
+
+            case 'd':
+                ad->values.resize(cv.length * 16);
+
+                for (size_t i = 0; i < cv.length; i++) {
+                    if (cv.is_null(i))
+                        continue;
+
+                    auto out = span<uint8_t, 16>(ad->values.data() + (i * 16), 16);
+
+                    if (cv.col.type == sql_type::DECIMAL || cv.col.type == sql_type::NUMERIC)
+                        write_decimal128(out, cv.bytes(i));
+                    else
+                        write_money128(out, cv.bytes(i));
+                }
+
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'w':
+                ad->values.resize(cv.length * 16);
+
+                for (size_t i = 0; i < cv.length; i++) {
+                    if (cv.is_null(i))
+                        continue;
+
+                    write_uuid(span<uint8_t, 16>(ad->values.data() + (i * 16), 16), cv.bytes(i));
+                }
+
+                ad->buffers[1] = ad->values.data();
+                break;
+
+            case 'Z':
+                ad->offsets.swap(cv.offsets);
+                ad->data.swap(cv.data);
+                ad->buffers[1] = ad->offsets.data();
+                ad->buffers[2] = ad->data.data();
+                array.n_buffers = 3;
+                break;
+
+            case 'U':
+                switch (cv.col.type) {
+                    case sql_type::VARCHAR:
+                    case sql_type::CHAR:
+                    case sql_type::TEXT:
+                        if (cv.col.coll.utf8 || (cv.col.coll.lcid == 0 && cv.col.coll.sort_id == 0)) {
+                            ad->offsets.swap(cv.offsets);
+                            ad->data.swap(cv.data);
+                            break;
+                        }
+                        [[fallthrough]];
+
+                    default:
+                        ad->offsets.reserve(cv.length + 1);
+                        ad->offsets.push_back(0);
+
+                        for (size_t i = 0; i < cv.length; i++) {
+                            if (!cv.is_null(i)) {
+                                switch (cv.col.type) {
+                                    case sql_type::NVARCHAR:
+                                    case sql_type::NCHAR:
+                                    case sql_type::NTEXT:
+                                    case sql_type::XML: {
+                                        auto sp = cv.bytes(i);
+
+                                        append_utf8(*ad, u16string_view((char16_t*)sp.data(), sp.size() / sizeof(char16_t)));
+                                        break;
+                                    }
+
+                                    default: {
+                                        value_view v(cv.col);
+
+                                        v.val = cv.bytes(i);
+                                        v.is_null = false;
+
+                                        auto s = (string)v;
+
+                                        ad->data.insert(ad->data.end(), s.begin(), s.end());
+                                        break;
+                                    }
+                                }
+                            }
+
+                            ad->offsets.push_back((int64_t)ad->data.size());
+                        }
+                        break;
+                }
+
+                ad->buffers[1] = ad->offsets.data();
+                ad->buffers[2] = ad->data.data();
+                array.n_buffers = 3;
+                break;
+        }
+
+        ad->validity.swap(cv.validity);
+        ad->buffers[0] = ad->validity.data();
+    }
+
+    void to_arrow(vector<column_vector>&& v, ArrowSchema* schema, ArrowArray* array) {
+        auto sd = new arrow_schema_data;
+        auto ad = new arrow_array_data;
+
+        sd->format = "+s";
+        sd->children.resize(v.size());
+        ad->children.resize(v.size());
+
+        try {
+            for (size_t i = 0; i < v.size(); i++) {
+                to_arrow_column(v[i], sd->children[i], ad->children[i]);
+                sd->child_ptrs.push_back(&sd->children[i]);
+                ad->child_ptrs.push_back(&ad->children[i]);
+            }
+        } catch (...) {
+            for (auto& c : sd->children) {
+                if (c.release)
+                    c.release(&c);
+            }
+
+            for (auto& c : ad->children) {
+                if (c.release)
+                    c.release(&c);
+            }
+
+            delete sd;
+            delete ad;
+
+            throw;
+        }
+
+        schema->format = sd->format.c_str();
+        schema->name = sd->name.c_str();
+        schema->metadata = nullptr;
+        schema->flags = 0;
+        schema->n_children = (int64_t)v.size();
+        schema->children = sd->child_ptrs.data();
+        schema->dictionary = nullptr;
+        schema->release = release_schema;
+        schema->private_data = sd;
+
+        ad->buffers[0] = nullptr;
+
+        array->length = v.empty() ? 0 : (int64_t)v[0].length;
+        array->null_count = 0;
+        array->offset = 0;
+        array->n_buffers = 1;
+        array->n_children = (int64_t)v.size();
+        array->buffers = ad->buffers.data();
+        array->children = ad->child_ptrs.data();
+        array->dictionary = nullptr;
+        array->release = release_array;
+        array->private_data = ad;
+    }
+
+    size_t fetch_arrow(rpc& r, size_t n, ArrowSchema* schema, ArrowArray* array) {
+        vector<column_vector> v;
+
+        auto ret = r.fetch_rows(n, v);
+
+        to_arrow(move(v), schema, array);
+
+        return ret;
+    }
+
+    size_t fetch_arrow(query& q, size_t n, ArrowSchema* schema, ArrowArray* array) {
+        vector<column_vector> v;
+
+        auto ret = q.fetch_rows(n, v);
+
+        to_arrow(move(v), schema, array);
+
+        return ret;
+    }
+
+    size_t fetch_arrow(batch& b, size_t n, ArrowSchema* schema, ArrowArray* array) {
+        vector<column_vector> v;
+
+        auto ret = b.fetch_rows(n, v);
+
+        to_arrow(move(v), schema, array);
+
+        return ret;
+    }
+};
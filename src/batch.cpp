@@ -4,19 +4,19 @@
 using namespace std;
 
 namespace tds {
-    void batch::do_batch(tds& conn, u16string_view q) {
-        impl = new batch_impl(conn, q);
+    void batch::do_batch(tds& conn, u16string_view q, bool wait) {
+        impl = new batch_impl(conn, q, wait);
     }
 
-    void batch::do_batch(session& sess, u16string_view q) {
-        impl = new batch_impl(sess, q);
+    void batch::do_batch(session& sess, u16string_view q, bool wait) {
+        impl = new batch_impl(sess, q, wait);
     }
 
     batch::~batch() {
         delete impl;
     }
 
-    batch_impl::batch_impl(tds& conn, u16string_view q) : conn(conn) {
+    batch_impl::batch_impl(tds& conn, u16string_view q, bool wait) : conn(conn) {
         size_t bufsize;
 
         bufsize = sizeof(tds_all_headers) + (q.length() * sizeof(uint16_t));
@@ -40,10 +40,13 @@ namespace tds {
         else
             conn.impl->sess.send_msg(tds_msg::sql_batch, buf);
 
-        wait_for_packet();
+        if (wait)
+            wait_for_packet();
+        else
+            started = false;
     }
 
-    batch_impl::batch_impl(session& sess, u16string_view q) : conn(sess.conn) {
+    batch_impl::batch_impl(session& sess, u16string_view q, bool wait) : conn(sess.conn) {
         size_t bufsize;
 
         this->sess.emplace(*sess.impl.get());
@@ -66,13 +69,18 @@ namespace tds {
 
         sess.impl->send_msg(tds_msg::sql_batch, buf);
 
-        wait_for_packet();
+        if (wait)
+            wait_for_packet();
+        else
+            started = false;
     }
 
     batch_impl::~batch_impl() {
         if (finished)
             return;
 
+        plp_cb = nullptr;
+
         try {
             received_attn = false;
 
@@ -107,14 +115,11 @@ namespace tds {
                 if (type != tds_msg::tabular_result)
                     continue;
 
-                parse_tokens(payload, tokens, buf_columns);
-
-                vector<uint8_t> t;
+                tokens.clear();
 
-                while (!tokens.empty()) {
-                    t.swap(tokens.front());
-                    tokens.pop_front();
+                parse_tokens(payload, tokens, buf_columns);
 
+                for (auto t : tokens) {
                     auto type = (token)t[0];
 
                     switch (type) {
@@ -144,6 +149,8 @@ namespace tds {
         vector<uint8_t> payload;
         bool last_packet;
 
+        started = true;
+
         if (sess)
             sess.value().get().wait_for_msg(type, payload, &last_packet);
         else if (conn.impl->mars_sess)
@@ -156,28 +163,49 @@ namespace tds {
         if (type != tds_msg::tabular_result)
             throw formatted_error("Received message type {}, expected tabular_result", (int)type);
 
-        buf.insert(buf.end(), payload.begin(), payload.end());
+        // tokens are parsed in place - only one split across packets gets carried over
+
+        if (!buf.empty()) {
+            buf.insert(buf.end(), payload.begin(), payload.end());
+            payload.swap(buf);
+        }
+
+        tokens.clear();
+
+        // rows belong to the last result set to have arrived, which is only the
+        // current one if the caller has caught up with next_result
+
+        auto in_cols = [&]() -> vector<column>& {
+            return results.empty() ? cols : results.back().cols;
+        };
+
+        auto in_rows = [&]() -> row_arena& {
+            return results.empty() ? rows : results.back().rows;
+        };
 
         {
-            auto sp = parse_tokens(buf, tokens, buf_columns);
+            span<const uint8_t> sp = payload;
 
-            if (sp.size() != buf.size()) {
-                vector<uint8_t> newbuf{sp.begin(), sp.end()};
-                buf.swap(newbuf);
-            }
-        }
+            // finish off a row whose large columns are being streamed
+
+            if (plp.active && plp.feed(sp, in_cols(), plp_cb))
+                handle_plp_row(plp, in_cols(), in_rows());
 
-        if (last_packet && !buf.empty())
-            throw formatted_error("Data remaining in buffer");
+            sp = parse_tokens(sp, tokens, buf_columns);
 
-        vector<uint8_t> t;
+            if (last_packet && (!sp.empty() || plp.active))
+                throw formatted_error("Data remaining in buffer");
 
-        while (!tokens.empty()) {
-            t.swap(tokens.front());
-            tokens.pop_front();
+            // If nothing was consumed, we're part-way through a large token, so keep
+            // appending to the same buffer rather than copying it all again.
 
-            span<const uint8_t> sp = t;
+            if (sp.size() == payload.size())
+                buf.swap(payload);
+            else
+                buf.assign(sp.begin(), sp.end());
+        }
 
+        for (auto sp : tokens) {
             auto type = (token)sp[0];
             sp = sp.subspan(1);
 
@@ -191,8 +219,21 @@ namespace tds {
                     if (msg.status & 0x20) // attention
                         received_attn = true;
 
-                    if (conn.impl->count_handler && msg.status & 0x10) // row count valid
-                        conn.impl->count_handler(msg.rowcount, msg.curcmd);
+                    if (msg.status & 0x10) { // row count valid
+                        auto& rc = results.empty() ? row_count : results.back().row_count;
+
+                        // A result set gets the count of the statement which produced it. Otherwise
+                        // it's the last statement's, so that rows changed by triggers aren't included.
+
+                        if (!in_cols().empty()) {
+                            if (!rc.has_value())
+                                rc = msg.rowcount;
+                        } else if (type != token::DONEPROC)
+                            rc = msg.rowcount;
+
+                        if (conn.impl->count_handler)
+                            conn.impl->count_handler(msg.rowcount, msg.curcmd);
+                    }
 
                     break;
                 }
@@ -232,8 +273,14 @@ namespace tds {
 
                     auto num_columns = *(uint16_t*)&sp[0];
 
-                    cols.clear();
-                    cols.reserve(num_columns);
+                    // another result set - it's queued until next_result is called
+                    if (!cols.empty() || !results.empty())
+                        results.emplace_back();
+
+                    auto& rs_cols = in_cols();
+
+                    rs_cols.clear();
+                    rs_cols.reserve(num_columns);
 
                     if (num_columns == 0)
                         break;
@@ -252,9 +299,9 @@ namespace tds {
                         len += sizeof(tds_colmetadata_col);
                         sp2 = sp2.subspan(sizeof(tds_colmetadata_col));
 
-                        cols.emplace_back();
+                        rs_cols.emplace_back();
 
-                        auto& col = cols.back();
+                        auto& col = rs_cols.back();
 
                         col.type = c.type;
 
@@ -488,23 +535,15 @@ namespace tds {
                 }
 
                 case token::ROW:
-                {
-                    rows.emplace_back();
-                    auto& row = rows.back();
-
-                    row.resize(cols.size());
-
-                    for (unsigned int i = 0; i < row.size(); i++) {
-                        auto& col = row[i];
-
-                        handle_row_col(get<0>(col), get<1>(col), cols[i].type, cols[i].max_length, sp);
-                    }
-
-                    break;
-                }
-
                 case token::NBCROW:
-                    handle_nbcrow(sp, cols, rows);
+                    if (plp_cb) {
+                        plp.start(type == token::NBCROW);
+                        plp.feed(sp, in_cols(), plp_cb);
+                        handle_plp_row(plp, in_cols(), in_rows());
+                    } else if (type == token::ROW)
+                        handle_row(sp, in_cols(), in_rows());
+                    else
+                        handle_nbcrow(sp, in_cols(), in_rows());
                     break;
 
                 case token::ORDER:
@@ -534,28 +573,89 @@ namespace tds {
             }
         }
 
+        // start streaming a row which didn't fit, rather than waiting for all of it
+
+        if (plp_cb && !buf.empty() && !in_cols().empty() && ((token)buf[0] == token::ROW || (token)buf[0] == token::NBCROW)) {
+            auto sp = span<const uint8_t>(buf).subspan(1);
+
+            plp.start((token)buf[0] == token::NBCROW);
+
+            if (plp.feed(sp, in_cols(), plp_cb))
+                handle_plp_row(plp, in_cols(), in_rows());
+
+            buf.erase(buf.begin(), buf.end() - (ptrdiff_t)sp.size());
+        }
+
+        tokens.clear();
+        conn.impl->pool.put(move(payload));
+
         if (last_packet)
             finished = true;
     }
 
-    bool batch_impl::fetch_row() {
-        while (!rows.empty() || !finished) {
-            if (!rows.empty()) {
-                auto& r = rows.front();
+    bool batch_impl::fetch_row_no_wait() {
+        if (rows.empty())
+            return false;
 
-                for (unsigned int i = 0; i < r.size(); i++) {
-                    cols[i].is_null = get<1>(r[i]);
+        auto r = rows.pop();
 
-                    if (!cols[i].is_null)
-                        cols[i].val.swap(get<0>(r[i]));
-                }
+        for (unsigned int i = 0; i < rows.num_columns(r); i++) {
+            cols[i].is_null = rows.is_null(r, i);
 
-                rows.pop_front();
+            if (!cols[i].is_null) {
+                auto v = rows.value(r, i);
 
-                return true;
+                cols[i].val.assign(v.begin(), v.end());
             }
+        }
 
-            if (finished)
+        return true;
+    }
+
+    optional<row_view> batch_impl::fetch_row_view() {
+        while (rows.empty()) {
+            if (finished || !results.empty())
+                return nullopt;
+
+            wait_for_packet();
+        }
+
+        return row_view(rows, cols, rows.pop());
+    }
+
+    size_t batch_impl::fetch_rows(size_t n, vector<column_vector>& v) {
+        size_t count = 0;
+
+        init_column_vectors(v, cols);
+
+        while (count < n) {
+            while (rows.empty()) {
+                if (finished || !results.empty())
+                    return count;
+
+                wait_for_packet();
+            }
+
+            // the metadata may only have arrived while we were waiting, e.g. after PRINT output
+            if (count == 0)
+                init_column_vectors(v, cols);
+
+            auto num = min(n - count, rows.available());
+
+            append_column_vectors(v, rows, rows.next, num);
+            rows.next += num;
+            count += num;
+        }
+
+        return count;
+    }
+
+    bool batch_impl::fetch_row() {
+        while (!rows.empty() || (!finished && results.empty())) {
+            if (fetch_row_no_wait())
+                return true;
+
+            if (finished || !results.empty())
                 return false;
 
             wait_for_packet();
@@ -564,10 +664,106 @@ namespace tds {
         return false;
     }
 
+    task<void> batch_impl::wait_for_packet_async() {
+        if (sess)
+            co_await msg_awaiter(sess.value().get());
+        else if (conn.impl->mars_sess)
+            co_await msg_awaiter(*conn.impl->mars_sess);
+        else
+            co_await msg_awaiter(conn.impl->sess);
+
+        wait_for_packet();
+    }
+
+    task<bool> batch_impl::next_row() {
+        while (!rows.empty() || (!finished && results.empty())) {
+            if (fetch_row_no_wait())
+                co_return true;
+
+            if (finished || !results.empty())
+                co_return false;
+
+            co_await wait_for_packet_async();
+        }
+
+        co_return false;
+    }
+
+    bool batch_impl::next_result() {
+        while (results.empty()) {
+            if (finished)
+                return false;
+
+            wait_for_packet();
+        }
+
+        auto& rs = results.front();
+
+        cols = move(rs.cols);
+        rows = move(rs.rows);
+        row_count = rs.row_count;
+
+        results.pop_front();
+
+        return true;
+    }
+
+    task<bool> batch_impl::next_result_async() {
+        while (results.empty()) {
+            if (finished)
+                co_return false;
+
+            co_await wait_for_packet_async();
+        }
+
+        co_return next_result();
+    }
+
     bool batch::fetch_row() {
         return impl->fetch_row();
     }
 
+    optional<row_view> batch::fetch_row_view() {
+        return impl->fetch_row_view();
+    }
+
+    size_t batch::fetch_rows(size_t n, vector<column_vector>& v) {
+        return impl->fetch_rows(n, v);
+    }
+
+    void batch::set_plp_handler(const plp_chunk_handler& handler) {
+        impl->plp_cb = handler;
+    }
+
+    vector<column_vector> batch::fetch_rows(size_t n) {
+        vector<column_vector> v;
+
+        impl->fetch_rows(n, v);
+
+        return v;
+    }
+
+    task<void> batch::start() {
+        if (!impl->started)
+            co_await impl->wait_for_packet_async();
+    }
+
+    task<bool> batch::next_row() {
+        return impl->next_row();
+    }
+
+    bool batch::next_result() {
+        return impl->next_result();
+    }
+
+    task<bool> batch::next_result_async() {
+        return impl->next_result_async();
+    }
+
+    optional<uint64_t> batch::row_count() const {
+        return impl->row_count;
+    }
+
     uint16_t batch::num_columns() const {
         return (uint16_t)impl->cols.size();
     }
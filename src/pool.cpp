@@ -0,0 +1,164 @@
+#include "tdscpp.h"
+#include "tdscpp-private.h"
+
+using namespace std;
+
+namespace tds {
+    pool_impl::pool_impl(const options& opts, size_t min_size, size_t max_size,
+                         chrono::seconds idle_timeout, chrono::seconds check_after) :
+                         opts(opts), min_size(min_size), max_size(max_size),
+                         idle_timeout(idle_timeout), check_after(check_after) {
+        if (max_size == 0)
+            throw formatted_error("Pool max_size cannot be 0.");
+
+        if (min_size > max_size)
+            throw formatted_error("Pool min_size ({}) is greater than max_size ({}).", min_size, max_size);
+
+        auto now = chrono::steady_clock::now();
+
+        for (size_t i = 0; i < min_size; i++) {
+            idle.push_back({make_unique<tds>(opts), now});
+            open++;
+        }
+
+        reaper = jthread([this](stop_token stop) {
+            reap(stop);
+        });
+    }
+
+    // closes connections idle for longer than idle_timeout, but keeps min_size open -
+    // they're destroyed by the caller once it's released the lock
+    void pool_impl::evict(list<unique_ptr<tds>>& closing) {
+        auto now = chrono::steady_clock::now();
+
+        while (!idle.empty() && open > min_size && now - idle.back().since >= idle_timeout) {
+            closing.emplace_back(move(idle.back().conn));
+            idle.pop_back();
+            open--;
+        }
+    }
+
+    // Closes idle connections as they time out, so that a pool which has gone quiet
+    // doesn't keep them, and their sessions on the server, open for good.
+    void pool_impl::reap(stop_token stop) {
+        unique_lock ul(lock);
+
+        while (true) {
+            list<unique_ptr<tds>> closing;
+
+            evict(closing);
+
+            if (!closing.empty()) {
+                ul.unlock();
+                closing.clear();
+                ul.lock();
+            }
+
+            if (!reap_cv.wait(ul, stop, [&]() { return !idle.empty() && open > min_size; }))
+                return;
+
+            // the oldest connection is the next to go - anything returned since is newer
+
+            reap_cv.wait_until(ul, stop, idle.back().since + idle_timeout, []() { return false; });
+
+            if (stop.stop_requested())
+                return;
+        }
+    }
+
+    unique_ptr<tds> pool_impl::get() {
+        list<unique_ptr<tds>> closing;
+        unique_lock ul(lock);
+
+        while (true) {
+            evict(closing);
+
+            if (!idle.empty()) {
+                auto ic = move(idle.front());
+
+                idle.pop_front();
+                ul.unlock();
+
+                if (ic.conn->impl->connected) {
+                    if (chrono::steady_clock::now() - ic.since < check_after)
+                        return move(ic.conn);
+
+                    // this carries the reset, so isn't an extra round-trip
+
+                    try {
+                        ic.conn->run("SELECT 1");
+
+                        return move(ic.conn);
+                    } catch (...) {
+                        // try another
+                    }
+                }
+
+                closing.emplace_back(move(ic.conn));
+
+                ul.lock();
+                open--;
+
+                continue;
+            }
+
+            if (open < max_size) {
+                open++;
+                ul.unlock();
+
+                try {
+                    return make_unique<tds>(opts);
+                } catch (...) {
+                    ul.lock();
+                    open--;
+                    cv.notify_one();
+                    throw;
+                }
+            }
+
+            cv.wait(ul);
+        }
+    }
+
+    void pool_impl::put(unique_ptr<tds>&& conn) {
+        list<unique_ptr<tds>> closing;
+        lock_guard lg(lock);
+
+        if (conn->impl->connected) {
+            conn->impl->reset_pending = true;
+            // the reset goes out with the next request, which mustn't be an sp_execute
+            // of a handle that the reset is about to drop
+            conn->impl->prepared.clear();
+            idle.push_front({move(conn), chrono::steady_clock::now()});
+        } else {
+            closing.emplace_back(move(conn));
+            open--;
+        }
+
+        evict(closing);
+        cv.notify_one();
+        reap_cv.notify_one();
+    }
+
+    pool::pool(const options& opts, size_t min_size, size_t max_size, chrono::seconds idle_timeout,
+               chrono::seconds check_after) {
+        impl = make_unique<pool_impl>(opts, min_size, max_size, idle_timeout, check_after);
+    }
+
+    pool::~pool() = default;
+
+    pool::connection pool::get() {
+        return connection(*impl, impl->get());
+    }
+
+    pool::connection::~connection() {
+        if (!conn)
+            return;
+
+        try {
+            p->put(move(conn));
+        } catch (...) {
+            // can't throw in destructor
+        }
+    }
+};
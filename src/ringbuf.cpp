@@ -56,6 +56,23 @@ void ringbuf::write(span<const uint8_t> sp) {
     used += sp.size();
 }
 
+// Returns the free part of the buffer as up to two writable spans, so that
+// the caller can fill it directly (e.g. with readv) and then call commit.
+array<span<uint8_t>, 2> ringbuf::free_spans() {
+    if (offset + used < length)
+        return { span(data + offset + used, length - offset - used), span(data, offset) };
+    else
+        return { span(data + offset + used - length, length - used), span<uint8_t>() };
+}
+
+void ringbuf::commit(size_t bytes) {
+    used += bytes;
+}
+
+span<uint8_t> ringbuf::storage() {
+    return span(data, length);
+}
+
 size_t ringbuf::size() const {
     return used;
 }
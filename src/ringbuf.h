@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <span>
+#include <array>
 
 class ringbuf {
 public:
@@ -11,6 +12,9 @@ public:
     void read(std::span<uint8_t> sp);
     void peek(std::span<uint8_t> sp);
     void write(std::span<const uint8_t> sp);
+    std::array<std::span<uint8_t>, 2> free_spans();
+    void commit(size_t bytes);
+    std::span<uint8_t> storage();
     void discard(size_t bytes);
     size_t size() const;
     size_t available() const;
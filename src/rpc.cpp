@@ -1,21 +1,434 @@
 #include "tdscpp.h"
 #include "tdscpp-private.h"
+#include <istream>
+#include <variant>
 
 using namespace std;
 
 namespace tds {
-    void rpc::do_rpc(tds& conn, string_view name) {
-        do_rpc(conn, utf8_to_utf16(name));
+    plp_source::plp_source(istream& is, sql_type type, optional<uint64_t> length, collation coll) :
+                           type(type), length(length), coll(coll) {
+        this->read = [&is](span<uint8_t> sp) -> size_t {
+            is.read((char*)sp.data(), (streamsize)sp.size());
+
+            // a short read sets failbit as well as eofbit, which is fine - anything else
+            // mustn't look like the end of the data, or we'd send a truncated value
+            if (is.bad() || (is.fail() && !is.eof()))
+                throw runtime_error("Error reading PLP parameter from stream.");
+
+            return (size_t)is.gcount();
+        };
     }
 
-    void rpc::do_rpc(tds& conn, u16string_view name) {
-        size_t bufsize;
+    static void send_plp_param(msg_writer& w, plp_source& src, span<uint8_t> chunk) {
+        uint64_t total = 0;
 
-        this->name = name;
+        while (true) {
+            auto len = src.read(chunk.subspan(sizeof(uint32_t)));
+
+            if (len == 0)
+                break;
+
+            if (len > chunk.size() - sizeof(uint32_t))
+                throw formatted_error("PLP source returned {} bytes, more than the {} requested.", len, chunk.size() - sizeof(uint32_t));
+
+            *(uint32_t*)chunk.data() = (uint32_t)len;
+            w.write(chunk.subspan(0, sizeof(uint32_t) + len));
+
+            total += len;
+        }
+
+        if (src.length.has_value() && total != *src.length)
+            throw formatted_error("PLP source returned {} bytes, expected {}.", total, *src.length);
+
+        uint32_t terminator = 0; // last chunk
+
+        w.write(span((uint8_t*)&terminator, sizeof(terminator)));
+    }
+
+    static void send_tvp_rows(msg_writer& w, tvp& t) {
+        vector<value> row;
+        vector<uint8_t> buf;
+
+        while (true) {
+            row.clear();
+
+            if (!t.next_row(row))
+                break;
+
+            if (row.size() != t.cols.size())
+                throw formatted_error("TVP row has {} values, expected {}.", row.size(), t.cols.size());
+
+            size_t bufsize = sizeof(uint8_t);
+
+            for (size_t i = 0; i < row.size(); i++) {
+                bufsize += bcp_row_size(t.cols[i], row[i]);
+            }
+
+            buf.resize(bufsize);
+
+            auto ptr = buf.data();
+
+            *ptr = 0x01; // TVP_ROW_TOKEN
+            ptr++;
+
+            for (size_t i = 0; i < row.size(); i++) {
+                bcp_row_data(ptr, t.cols[i], row[i], u"");
+            }
+
+            w.write(buf);
+        }
+
+        uint8_t end = 0x00; // TVP_END_TOKEN
+
+        w.write(span(&end, sizeof(end)));
+    }
+
+    // the offset in a request where data is streamed, and where it comes from
+    using stream_split = pair<size_t, variant<plp_source*, tvp*>>;
+
+    static void parse_colmetadata(span<const uint8_t> sp, vector<column>& cols) {
+        if (sp.size() < 4)
+            throw formatted_error("Short COLMETADATA message ({} bytes, expected at least 4).", sp.size());
+
+        auto num_columns = *(uint16_t*)&sp[0];
+
+        if (num_columns == 0)
+            return;
+
+        cols.clear();
+        cols.reserve(num_columns);
+
+        size_t len = sizeof(uint16_t);
+        auto sp2 = sp;
+
+        sp2 = sp2.subspan(sizeof(uint16_t));
+
+        for (unsigned int i = 0; i < num_columns; i++) {
+            if (sp2.size() < sizeof(tds_colmetadata_col))
+                throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(tds_colmetadata_col));
+
+            auto& c = *(tds_colmetadata_col*)&sp2[0];
+
+            len += sizeof(tds_colmetadata_col);
+            sp2 = sp2.subspan(sizeof(tds_colmetadata_col));
+
+            cols.emplace_back();
+
+            auto& col = cols.back();
+
+            col.nullable = c.flags & 1;
+
+            col.type = c.type;
+
+            switch (c.type) {
+                case sql_type::SQL_NULL:
+                case sql_type::TINYINT:
+                case sql_type::BIT:
+                case sql_type::SMALLINT:
+                case sql_type::INT:
+                case sql_type::DATETIM4:
+                case sql_type::REAL:
+                case sql_type::MONEY:
+                case sql_type::DATETIME:
+                case sql_type::FLOAT:
+                case sql_type::SMALLMONEY:
+                case sql_type::BIGINT:
+                case sql_type::DATE:
+                    // nop
+                    break;
+
+                case sql_type::INTN:
+                case sql_type::FLTN:
+                case sql_type::TIME:
+                case sql_type::DATETIME2:
+                case sql_type::DATETIMN:
+                case sql_type::DATETIMEOFFSET:
+                case sql_type::BITN:
+                case sql_type::MONEYN:
+                case sql_type::UNIQUEIDENTIFIER:
+                    if (sp2.size() < sizeof(uint8_t))
+                        throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
+
+                    col.max_length = *(uint8_t*)sp2.data();
+
+                    len++;
+                    sp2 = sp2.subspan(1);
+                    break;
+
+                case sql_type::VARCHAR:
+                case sql_type::NVARCHAR:
+                case sql_type::CHAR:
+                case sql_type::NCHAR: {
+                    if (sp2.size() < sizeof(uint16_t) + sizeof(collation))
+                        throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(uint16_t) + sizeof(collation));
+
+                    col.max_length = *(uint16_t*)sp2.data();
+
+                    col.coll = *(collation*)(sp2.data() + sizeof(uint16_t));
+
+                    len += sizeof(uint16_t) + sizeof(collation);
+                    sp2 = sp2.subspan(sizeof(uint16_t) + sizeof(collation));
+                    break;
+                }
+
+                case sql_type::VARBINARY:
+                case sql_type::BINARY:
+                    if (sp2.size() < sizeof(uint16_t))
+                        throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(uint16_t));
+
+                    col.max_length = *(uint16_t*)sp2.data();
+
+                    len += sizeof(uint16_t);
+                    sp2 = sp2.subspan(sizeof(uint16_t));
+                    break;
+
+                case sql_type::XML:
+                    if (sp2.size() < sizeof(uint8_t))
+                        throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
+
+                    len += sizeof(uint8_t);
+                    sp2 = sp2.subspan(sizeof(uint8_t));
+                    break;
+
+                case sql_type::DECIMAL:
+                case sql_type::NUMERIC:
+                    if (sp2.size() < 3)
+                        throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 3).", sp2.size(), 3);
+
+                    col.max_length = (uint8_t)sp2[0];
+                    col.precision = (uint8_t)sp2[1];
+                    col.scale = (uint8_t)sp2[2];
+
+                    len += 3;
+                    sp2 = sp2.subspan(3);
+
+                    break;
+
+                case sql_type::SQL_VARIANT:
+                    if (sp2.size() < sizeof(uint32_t))
+                        return;
+
+                    col.max_length = *(uint32_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint32_t));
+                    break;
+
+                case sql_type::IMAGE:
+                case sql_type::TEXT:
+                case sql_type::NTEXT:
+                {
+                    if (sp2.size() < sizeof(uint32_t))
+                        return;
+
+                    col.max_length = *(uint32_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint32_t));
+
+                    if (c.type == sql_type::TEXT || c.type == sql_type::NTEXT) {
+                        if (sp2.size() < sizeof(collation))
+                            return;
+
+                        sp2 = sp2.subspan(sizeof(collation));
+                    }
+
+                    if (sp2.size() < 1)
+                        return;
+
+                    auto num_parts = (uint8_t)sp2[0];
+
+                    sp2 = sp2.subspan(1);
+
+                    for (uint8_t j = 0; j < num_parts; j++) {
+                        if (sp2.size() < sizeof(uint16_t))
+                            return;
+
+                        auto partlen = *(uint16_t*)sp2.data();
+
+                        sp2 = sp2.subspan(sizeof(uint16_t));
+
+                        if (sp2.size() < partlen * sizeof(char16_t))
+                            return;
 
-        bufsize = sizeof(tds_all_headers) + sizeof(uint16_t) + (name.length() * sizeof(uint16_t)) + sizeof(uint16_t);
+                        sp2 = sp2.subspan(partlen * sizeof(char16_t));
+                    }
+
+                    break;
+                }
+
+                case sql_type::UDT:
+                {
+                    if (sp2.size() < sizeof(uint16_t))
+                        return;
+
+                    col.max_length = *(uint16_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint16_t));
+
+                    // db name
+
+                    if (sp2.size() < sizeof(uint8_t))
+                        return;
+
+                    auto string_len = *(uint8_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint8_t));
+
+                    if (sp2.size() < string_len * sizeof(char16_t))
+                        return;
+
+                    sp2 = sp2.subspan(string_len * sizeof(char16_t));
+
+                    // schema name
+
+                    if (sp2.size() < sizeof(uint8_t))
+                        return;
+
+                    string_len = *(uint8_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint8_t));
+
+                    if (sp2.size() < string_len * sizeof(char16_t))
+                        return;
+
+                    sp2 = sp2.subspan(string_len * sizeof(char16_t));
+
+                    // type name
+
+                    if (sp2.size() < sizeof(uint8_t))
+                        return;
+
+                    string_len = *(uint8_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint8_t));
+
+                    if (sp2.size() < string_len * sizeof(char16_t))
+                        return;
+
+                    sp2 = sp2.subspan(string_len * sizeof(char16_t));
+
+                    // assembly qualified name
+
+                    if (sp2.size() < sizeof(uint16_t))
+                        return;
+
+                    auto string_len2 = *(uint16_t*)sp2.data();
+
+                    sp2 = sp2.subspan(sizeof(uint16_t));
+
+                    if (sp2.size() < string_len2 * sizeof(char16_t))
+                        return;
+
+                    col.clr_name.assign((uint16_t*)sp2.data(), (uint16_t*)sp2.data() + string_len2);
+
+                    sp2 = sp2.subspan(string_len2 * sizeof(char16_t));
+
+                    break;
+                }
+
+                default:
+                    throw formatted_error("Unhandled type {} in COLMETADATA message.", c.type);
+            }
+
+            if (sp2.size() < 1)
+                throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
+
+            auto name_len = *(uint8_t*)&sp2[0];
+
+            sp2 = sp2.subspan(1);
+            len++;
+
+            if (sp2.size() < name_len * sizeof(char16_t))
+                throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), name_len * sizeof(char16_t));
+
+            col.name = u16string_view((char16_t*)sp2.data(), name_len);
+
+            sp2 = sp2.subspan(name_len * sizeof(char16_t));
+            len += name_len * sizeof(char16_t);
+        }
+    }
+
+    static void handle_return_value(span<const uint8_t> sp, const map<unsigned int, value*>& output_params) {
+        auto h = (tds_return_value*)&sp[0];
+
+        if (sp.size() < sizeof(tds_return_value))
+            throw formatted_error("Short RETURNVALUE message ({} bytes, expected at least {}).", sp.size(), sizeof(tds_return_value));
+
+        // FIXME - param name
+
+        if (is_byte_len_type(h->type)) {
+            uint8_t len;
+
+            if (sp.size() < sizeof(tds_return_value) + 2)
+                throw formatted_error("Short RETURNVALUE message ({} bytes, expected at least {}).", sp.size(), sizeof(tds_return_value) + 2);
+
+            len = *((uint8_t*)&sp[0] + sizeof(tds_return_value) + 1);
+
+            if (sp.size() < sizeof(tds_return_value) + 2 + len)
+                throw formatted_error("Short RETURNVALUE message ({} bytes, expected {}).", sp.size(), sizeof(tds_return_value) + 2 + len);
+
+            if (output_params.count(h->param_ordinal) != 0) {
+                value& out = *output_params.at(h->param_ordinal);
+
+                if (len == 0)
+                    out.is_null = true;
+                else {
+                    out.is_null = false;
+
+                    // FIXME - make sure not unexpected size?
+
+                    out.val.resize(len);
+                    memcpy(out.val.data(), (uint8_t*)&sp[0] + sizeof(tds_return_value) + 2, len);
+                }
+            }
+        } else
+            throw formatted_error("Unhandled type {} in RETURNVALUE message.", h->type);
+    }
+
+    // Appends one RPCReqBatch to buf - the name, flags, and parameters of a call. Any
+    // parameters which are streamed are left at the point where their data goes,
+    // which is recorded in splits.
+    static void write_rpc_request(vector<uint8_t>& buf, u16string_view name, const vector<value>& params,
+                                  map<unsigned int, plp_source>& plp_params, map<unsigned int, tvp>& tvp_params,
+                                  bool has_utf8, vector<stream_split>& splits) {
+        size_t bufsize = sizeof(uint16_t) + (name.length() * sizeof(uint16_t)) + sizeof(uint16_t);
 
         for (const auto& p : params) {
+            if (auto it = tvp_params.find((unsigned int)(&p - params.data())); it != tvp_params.end()) {
+                const auto& t = it->second;
+
+                bufsize += sizeof(tds_param_header);
+                bufsize += sizeof(uint8_t) + sizeof(uint8_t) + (t.schema.length() * sizeof(char16_t));
+                bufsize += sizeof(uint8_t) + (t.type_name.length() * sizeof(char16_t));
+                bufsize += sizeof(uint16_t);
+
+                for (const auto& col : t.cols) {
+                    bufsize += sizeof(tds_colmetadata_col) + bcp_colmetadata_size(col) + sizeof(uint8_t);
+                }
+
+                bufsize += sizeof(uint8_t);
+
+                continue;
+            }
+
+            if (plp_params.contains((unsigned int)(&p - params.data()))) {
+                switch (p.type) {
+                    case sql_type::VARBINARY:
+                        bufsize += offsetof(tds_VARBINARY_MAX_param, chunk_length);
+                        break;
+
+                    case sql_type::VARCHAR:
+                    case sql_type::NVARCHAR:
+                        bufsize += offsetof(tds_VARCHAR_MAX_param, chunk_length);
+                        break;
+
+                    default:
+                        throw formatted_error("Unhandled type {} for streamed RPC param.", p.type);
+                }
+
+                continue;
+            }
+
             switch (p.type) {
                 case sql_type::TINYINT:
                 case sql_type::BIT:
@@ -76,7 +489,7 @@ namespace tds {
                 case sql_type::VARCHAR:
                     if (p.is_null)
                         bufsize += sizeof(tds_VARCHAR_param);
-                    else if (p.coll.utf8 && !conn.impl->has_utf8) {
+                    else if (p.coll.utf8 && !has_utf8) {
                         auto s = utf8_to_utf16(string_view{(char*)p.val.data(), p.val.size()});
 
                         if ((s.length() * sizeof(char16_t)) > 8000) // MAX
@@ -154,17 +567,11 @@ namespace tds {
             }
         }
 
-        vector<uint8_t> buf(bufsize);
+        auto off = buf.size();
 
-        auto all_headers = (tds_all_headers*)&buf[0];
+        buf.resize(off + bufsize);
 
-        all_headers->total_size = sizeof(tds_all_headers);
-        all_headers->size = sizeof(uint32_t) + sizeof(tds_header_trans_desc);
-        all_headers->trans_desc.type = 2; // transaction descriptor
-        all_headers->trans_desc.descriptor = conn.impl->trans_id;
-        all_headers->trans_desc.outstanding = 1;
-
-        auto ptr = (uint8_t*)&all_headers[1];
+        auto ptr = buf.data() + off;
 
         *(uint16_t*)ptr = (uint16_t)name.length();
         ptr += sizeof(uint16_t);
@@ -182,6 +589,76 @@ namespace tds {
             h->flags = p.is_output ? 1 : 0;
             h->type = p.type;
 
+            if (auto it = plp_params.find((unsigned int)(&p - params.data())); it != plp_params.end()) {
+                // length of 0xfffffffffffffffe means unknown
+                if (p.type == sql_type::VARBINARY) {
+                    auto h2 = (tds_VARBINARY_MAX_param*)h;
+
+                    h2->max_length = 0xffff;
+                    h2->length = it->second.length.value_or(0xfffffffffffffffe);
+
+                    ptr += offsetof(tds_VARBINARY_MAX_param, chunk_length);
+                } else {
+                    auto h2 = (tds_VARCHAR_MAX_param*)h;
+
+                    h2->max_length = 0xffff;
+                    h2->collation = p.coll;
+                    h2->length = it->second.length.value_or(0xfffffffffffffffe);
+
+                    ptr += offsetof(tds_VARCHAR_MAX_param, chunk_length);
+                }
+
+                splits.emplace_back(ptr - buf.data(), &it->second);
+                continue;
+            }
+
+            if (auto it = tvp_params.find((unsigned int)(&p - params.data())); it != tvp_params.end()) {
+                auto& t = it->second;
+
+                ptr += sizeof(tds_param_header);
+
+                // TVP_TYPENAME - database, schema, and type
+
+                *ptr = 0;
+                ptr++;
+
+                *ptr = (uint8_t)t.schema.length();
+                ptr++;
+                memcpy(ptr, t.schema.data(), t.schema.length() * sizeof(char16_t));
+                ptr += t.schema.length() * sizeof(char16_t);
+
+                *ptr = (uint8_t)t.type_name.length();
+                ptr++;
+                memcpy(ptr, t.type_name.data(), t.type_name.length() * sizeof(char16_t));
+                ptr += t.type_name.length() * sizeof(char16_t);
+
+                *(uint16_t*)ptr = (uint16_t)t.cols.size();
+                ptr += sizeof(uint16_t);
+
+                for (const auto& col : t.cols) {
+                    auto coll = (collation*)(ptr + sizeof(tds_colmetadata_col) + sizeof(uint16_t));
+
+                    bcp_colmetadata_data(ptr, col, u"");
+
+                    // Unlike with INSERT BULK, the server goes by the collation given
+                    // here, which bcp_colmetadata_data leaves blank.
+
+                    if (col.type == sql_type::VARCHAR || col.type == sql_type::CHAR ||
+                        col.type == sql_type::NVARCHAR || col.type == sql_type::NCHAR) {
+                        if (!col.collation.empty())
+                            *coll = collation(utf16_to_utf8(col.collation));
+                        else if (col.type == sql_type::VARCHAR || col.type == sql_type::CHAR)
+                            throw formatted_error("TVP column of type {} has no collation.", col.type);
+                    }
+                }
+
+                *ptr = 0x00; // TVP_END_TOKEN, as there's no optional metadata
+                ptr++;
+
+                splits.emplace_back(ptr - buf.data(), &t);
+                continue;
+            }
+
             ptr += sizeof(tds_param_header);
 
             switch (p.type) {
@@ -315,7 +792,7 @@ namespace tds {
                     string_view sv{(char*)p.val.data(), p.val.size()};
                     u16string tmp;
 
-                    if (!p.is_null && !p.val.empty() && p.coll.utf8 && !conn.impl->has_utf8) {
+                    if (!p.is_null && !p.val.empty() && p.coll.utf8 && !has_utf8) {
                         h->type = sql_type::NVARCHAR;
                         tmp = utf8_to_utf16(string_view{(char*)p.val.data(), p.val.size()});
                         sv = string_view((char*)tmp.data(), tmp.length() * sizeof(char16_t));
@@ -518,31 +995,97 @@ namespace tds {
                     throw formatted_error("Unhandled type {} in RPC params.", p.type);
             }
         }
+    }
 
-        if (sess)
-            sess->get().send_msg(tds_msg::rpc, buf);
-        else if (conn.impl->mars_sess)
-            conn.impl->mars_sess->send_msg(tds_msg::rpc, buf);
-        else
-            conn.impl->sess.send_msg(tds_msg::rpc, buf);
+    // for a call with no streamed parameters, as in rpc_pipeline
+    static void write_rpc_request(vector<uint8_t>& buf, u16string_view name, const vector<value>& params, bool has_utf8) {
+        map<unsigned int, plp_source> plp_params;
+        map<unsigned int, tvp> tvp_params;
+        vector<stream_split> splits;
 
-        wait_for_packet();
+        write_rpc_request(buf, name, params, plp_params, tvp_params, has_utf8, splits);
     }
 
-    void rpc::do_rpc(session& sess, string_view name) {
-        do_rpc(sess, utf8_to_utf16(name));
+    void rpc::do_rpc(tds& conn, string_view name, bool wait) {
+        do_rpc(conn, utf8_to_utf16(name), wait);
     }
 
-    void rpc::do_rpc(session& sess, u16string_view name) {
+    void rpc::do_rpc(tds& conn, u16string_view name, bool wait) {
+        this->name = name;
+
+        vector<uint8_t> buf(sizeof(tds_all_headers));
+
+        auto all_headers = (tds_all_headers*)&buf[0];
+
+        all_headers->total_size = sizeof(tds_all_headers);
+        all_headers->size = sizeof(uint32_t) + sizeof(tds_header_trans_desc);
+        all_headers->trans_desc.type = 2; // transaction descriptor
+        all_headers->trans_desc.descriptor = conn.impl->trans_id;
+        all_headers->trans_desc.outstanding = 1;
+
+        vector<stream_split> splits;
+
+        write_rpc_request(buf, name, params, plp_params, tvp_params, conn.impl->has_utf8, splits);
+
+        if (splits.empty()) {
+            if (sess)
+                sess->get().send_msg(tds_msg::rpc, buf);
+            else if (conn.impl->mars_sess)
+                conn.impl->mars_sess->send_msg(tds_msg::rpc, buf);
+            else
+                conn.impl->sess.send_msg(tds_msg::rpc, buf);
+        } else {
+            msg_writer w(*conn.impl, sess ? &sess->get() : conn.impl->mars_sess.get(), tds_msg::rpc);
+            auto chunk = conn.impl->pool.get(conn.impl->packet_size);
+            size_t off = 0;
+
+            try {
+                for (const auto& sp : splits) {
+                    w.write(span(buf.data() + off, sp.first - off));
+
+                    if (holds_alternative<tvp*>(sp.second))
+                        send_tvp_rows(w, *get<tvp*>(sp.second));
+                    else
+                        send_plp_param(w, *get<plp_source*>(sp.second), chunk);
+
+                    off = sp.first;
+                }
+
+                w.write(span(buf.data() + off, buf.size() - off));
+                w.finish();
+            } catch (...) {
+                conn.impl->pool.put(move(chunk));
+
+                // send what we have with the ignore bit set, so the server discards it
+                w.abort();
+                throw;
+            }
+
+            conn.impl->pool.put(move(chunk));
+        }
+
+        if (wait)
+            wait_for_packet();
+        else
+            started = false;
+    }
+
+    void rpc::do_rpc(session& sess, string_view name, bool wait) {
+        do_rpc(sess, utf8_to_utf16(name), wait);
+    }
+
+    void rpc::do_rpc(session& sess, u16string_view name, bool wait) {
         this->sess.emplace(*sess.impl.get());
 
-        do_rpc(sess.conn, name);
+        do_rpc(sess.conn, name, wait);
     }
 
     rpc::~rpc() {
         if (finished)
             return;
 
+        plp_cb = nullptr;
+
         try {
             received_attn = false;
 
@@ -577,14 +1120,11 @@ namespace tds {
                 if (type != tds_msg::tabular_result)
                     continue;
 
-                parse_tokens(payload, tokens, buf_columns);
-
-                vector<uint8_t> t;
+                tokens.clear();
 
-                while (!tokens.empty()) {
-                    t.swap(tokens.front());
-                    tokens.pop_front();
+                parse_tokens(payload, tokens, buf_columns);
 
+                for (auto t : tokens) {
                     auto type = (token)t[0];
 
                     switch (type) {
@@ -614,6 +1154,8 @@ namespace tds {
         vector<uint8_t> payload;
         bool last_packet;
 
+        started = true;
+
         if (sess)
             sess->get().wait_for_msg(type, payload, &last_packet);
         else if (conn.impl->mars_sess)
@@ -626,28 +1168,49 @@ namespace tds {
         if (type != tds_msg::tabular_result)
             throw formatted_error("Received message type {}, expected tabular_result", (int)type);
 
-        buf.insert(buf.end(), payload.begin(), payload.end());
+        // tokens are parsed in place - only one split across packets gets carried over
+
+        if (!buf.empty()) {
+            buf.insert(buf.end(), payload.begin(), payload.end());
+            payload.swap(buf);
+        }
+
+        tokens.clear();
+
+        // rows belong to the last result set to have arrived, which is only the
+        // current one if the caller has caught up with next_result
+
+        auto in_cols = [&]() -> vector<column>& {
+            return results.empty() ? cols : results.back().cols;
+        };
+
+        auto in_rows = [&]() -> row_arena& {
+            return results.empty() ? rows : results.back().rows;
+        };
 
         {
-            auto sp = parse_tokens(buf, tokens, buf_columns);
+            span<const uint8_t> sp = payload;
 
-            if (sp.size() != buf.size()) {
-                vector<uint8_t> newbuf{sp.begin(), sp.end()};
-                buf.swap(newbuf);
-            }
-        }
+            // finish off a row whose large columns are being streamed
+
+            if (plp.active && plp.feed(sp, in_cols(), plp_cb))
+                handle_plp_row(plp, in_cols(), in_rows());
 
-        if (last_packet && !buf.empty())
-            throw formatted_error("Data remaining in buffer");
+            sp = parse_tokens(sp, tokens, buf_columns);
 
-        vector<uint8_t> t;
+            if (last_packet && (!sp.empty() || plp.active))
+                throw formatted_error("Data remaining in buffer");
 
-        while (!tokens.empty()) {
-            t.swap(tokens.front());
-            tokens.pop_front();
+            // If nothing was consumed, we're part-way through a large token, so keep
+            // appending to the same buffer rather than copying it all again.
 
-            span<const uint8_t> sp = t;
+            if (sp.size() == payload.size())
+                buf.swap(payload);
+            else
+                buf.assign(sp.begin(), sp.end());
+        }
 
+        for (auto sp : tokens) {
             auto type = (token)sp[0];
             sp = sp.subspan(1);
 
@@ -664,10 +1227,22 @@ namespace tds {
                     if (msg.status & 0x20) // attention
                         received_attn = true;
 
-                    if (conn.impl->count_handler && msg.status & 0x10) // row count valid
-                        conn.impl->count_handler(msg.rowcount, msg.curcmd);
+                    if (msg.status & 0x10) { // row count valid
+                        auto& rc = results.empty() ? row_count : results.back().row_count;
+
+                        // A result set gets the count of the statement which produced it. Otherwise
+                        // it's the last statement's, so that rows changed by triggers aren't included.
+
+                        if (!in_cols().empty()) {
+                            if (!rc.has_value())
+                                rc = msg.rowcount;
+                        } else if (type != token::DONEPROC)
+                            rc = msg.rowcount;
+
+                        if (conn.impl->count_handler)
+                            conn.impl->count_handler(msg.rowcount, msg.curcmd);
+                    }
 
-                    // FIXME - handle RPCs that return multiple row sets?
                     break;
                 }
 
@@ -710,394 +1285,423 @@ namespace tds {
                 }
 
                 case token::COLMETADATA:
-                {
-                    if (sp.size() < 4)
-                        throw formatted_error("Short COLMETADATA message ({} bytes, expected at least 4).", sp.size());
+                    // another result set - it's queued until next_result is called
+                    if (!cols.empty() || !results.empty())
+                        results.emplace_back();
 
-                    auto num_columns = *(uint16_t*)&sp[0];
-
-                    if (num_columns == 0)
-                        break;
-
-                    cols.clear();
-                    cols.reserve(num_columns);
+                    parse_colmetadata(sp, in_cols());
+                    break;
 
-                    size_t len = sizeof(uint16_t);
-                    auto sp2 = sp;
+                case token::RETURNVALUE:
+                    handle_return_value(sp, output_params);
+                    break;
 
-                    sp2 = sp2.subspan(sizeof(uint16_t));
+                case token::ROW:
+                case token::NBCROW:
+                    if (plp_cb) {
+                        plp.start(type == token::NBCROW);
+                        plp.feed(sp, in_cols(), plp_cb);
+                        handle_plp_row(plp, in_cols(), in_rows());
+                    } else if (type == token::ROW)
+                        handle_row(sp, in_cols(), in_rows());
+                    else
+                        handle_nbcrow(sp, in_cols(), in_rows());
+                    break;
 
-                    for (unsigned int i = 0; i < num_columns; i++) {
-                        if (sp2.size() < sizeof(tds_colmetadata_col))
-                            throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(tds_colmetadata_col));
-
-                        auto& c = *(tds_colmetadata_col*)&sp2[0];
-
-                        len += sizeof(tds_colmetadata_col);
-                        sp2 = sp2.subspan(sizeof(tds_colmetadata_col));
-
-                        cols.emplace_back();
-
-                        auto& col = cols.back();
-
-                        col.nullable = c.flags & 1;
-
-                        col.type = c.type;
-
-                        switch (c.type) {
-                            case sql_type::SQL_NULL:
-                            case sql_type::TINYINT:
-                            case sql_type::BIT:
-                            case sql_type::SMALLINT:
-                            case sql_type::INT:
-                            case sql_type::DATETIM4:
-                            case sql_type::REAL:
-                            case sql_type::MONEY:
-                            case sql_type::DATETIME:
-                            case sql_type::FLOAT:
-                            case sql_type::SMALLMONEY:
-                            case sql_type::BIGINT:
-                            case sql_type::DATE:
-                                // nop
-                                break;
-
-                            case sql_type::INTN:
-                            case sql_type::FLTN:
-                            case sql_type::TIME:
-                            case sql_type::DATETIME2:
-                            case sql_type::DATETIMN:
-                            case sql_type::DATETIMEOFFSET:
-                            case sql_type::BITN:
-                            case sql_type::MONEYN:
-                            case sql_type::UNIQUEIDENTIFIER:
-                                if (sp2.size() < sizeof(uint8_t))
-                                    throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
-
-                                col.max_length = *(uint8_t*)sp2.data();
-
-                                len++;
-                                sp2 = sp2.subspan(1);
-                                break;
-
-                            case sql_type::VARCHAR:
-                            case sql_type::NVARCHAR:
-                            case sql_type::CHAR:
-                            case sql_type::NCHAR: {
-                                if (sp2.size() < sizeof(uint16_t) + sizeof(collation))
-                                    throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(uint16_t) + sizeof(collation));
-
-                                col.max_length = *(uint16_t*)sp2.data();
-
-                                col.coll = *(collation*)(sp2.data() + sizeof(uint16_t));
-
-                                len += sizeof(uint16_t) + sizeof(collation);
-                                sp2 = sp2.subspan(sizeof(uint16_t) + sizeof(collation));
-                                break;
-                            }
+                case token::ORDER:
+                {
+                    if (sp.size() < sizeof(uint16_t))
+                        throw formatted_error("Short ORDER message ({} bytes, expected at least {}).", sp.size(), sizeof(uint16_t));
 
-                            case sql_type::VARBINARY:
-                            case sql_type::BINARY:
-                                if (sp2.size() < sizeof(uint16_t))
-                                    throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), sizeof(uint16_t));
+                    auto len = *(uint16_t*)sp.data();
+                    sp = sp.subspan(sizeof(uint16_t));
 
-                                col.max_length = *(uint16_t*)sp2.data();
+                    if (sp.size() < len)
+                        throw formatted_error("Short ORDER message ({} bytes, expected {}).", sp.size(), len);
 
-                                len += sizeof(uint16_t);
-                                sp2 = sp2.subspan(sizeof(uint16_t));
-                                break;
+                    break;
+                }
 
-                            case sql_type::XML:
-                                if (sp2.size() < sizeof(uint8_t))
-                                    throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
+                default:
+                    throw formatted_error("Unhandled token type {} while executing RPC.", type);
+            }
+        }
 
-                                len += sizeof(uint8_t);
-                                sp2 = sp2.subspan(sizeof(uint8_t));
-                                break;
+        // start streaming a row which didn't fit, rather than waiting for all of it
 
-                            case sql_type::DECIMAL:
-                            case sql_type::NUMERIC:
-                                if (sp2.size() < 3)
-                                    throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 3).", sp2.size(), 3);
+        if (plp_cb && !buf.empty() && !in_cols().empty() && ((token)buf[0] == token::ROW || (token)buf[0] == token::NBCROW)) {
+            auto sp = span<const uint8_t>(buf).subspan(1);
 
-                                col.max_length = (uint8_t)sp2[0];
-                                col.precision = (uint8_t)sp2[1];
-                                col.scale = (uint8_t)sp2[2];
+            plp.start((token)buf[0] == token::NBCROW);
 
-                                len += 3;
-                                sp2 = sp2.subspan(3);
+            if (plp.feed(sp, in_cols(), plp_cb))
+                handle_plp_row(plp, in_cols(), in_rows());
 
-                                break;
+            buf.erase(buf.begin(), buf.end() - (ptrdiff_t)sp.size());
+        }
 
-                            case sql_type::SQL_VARIANT:
-                                if (sp2.size() < sizeof(uint32_t))
-                                    return;
+        tokens.clear();
+        conn.impl->pool.put(move(payload));
 
-                                col.max_length = *(uint32_t*)sp2.data();
+        if (last_packet)
+            finished = true;
+    }
 
-                                sp2 = sp2.subspan(sizeof(uint32_t));
-                                break;
+    bool rpc::fetch_row_no_wait() {
+        if (rows.empty())
+            return false;
 
-                            case sql_type::IMAGE:
-                            case sql_type::TEXT:
-                            case sql_type::NTEXT:
-                            {
-                                if (sp2.size() < sizeof(uint32_t))
-                                    return;
+        auto r = rows.pop();
 
-                                col.max_length = *(uint32_t*)sp2.data();
+        for (unsigned int i = 0; i < rows.num_columns(r); i++) {
+            cols[i].is_null = rows.is_null(r, i);
 
-                                sp2 = sp2.subspan(sizeof(uint32_t));
+            if (!cols[i].is_null) {
+                auto v = rows.value(r, i);
 
-                                if (c.type == sql_type::TEXT || c.type == sql_type::NTEXT) {
-                                    if (sp2.size() < sizeof(collation))
-                                        return;
+                cols[i].val.assign(v.begin(), v.end());
+            }
+        }
 
-                                    sp2 = sp2.subspan(sizeof(collation));
-                                }
+        return true;
+    }
 
-                                if (sp2.size() < 1)
-                                    return;
+    optional<row_view> rpc::fetch_row_view() {
+        while (rows.empty()) {
+            if (finished || !results.empty())
+                return nullopt;
 
-                                auto num_parts = (uint8_t)sp2[0];
+            wait_for_packet();
+        }
 
-                                sp2 = sp2.subspan(1);
+        return row_view(rows, cols, rows.pop());
+    }
 
-                                for (uint8_t j = 0; j < num_parts; j++) {
-                                    if (sp2.size() < sizeof(uint16_t))
-                                        return;
+    size_t rpc::fetch_rows(size_t n, vector<column_vector>& v) {
+        size_t count = 0;
 
-                                    auto partlen = *(uint16_t*)sp2.data();
+        init_column_vectors(v, cols);
 
-                                    sp2 = sp2.subspan(sizeof(uint16_t));
+        while (count < n) {
+            while (rows.empty()) {
+                if (finished || !results.empty())
+                    return count;
 
-                                    if (sp2.size() < partlen * sizeof(char16_t))
-                                        return;
+                wait_for_packet();
+            }
 
-                                    sp2 = sp2.subspan(partlen * sizeof(char16_t));
-                                }
+            // the metadata may only have arrived while we were waiting, e.g. after PRINT output
+            if (count == 0)
+                init_column_vectors(v, cols);
 
-                                break;
-                            }
+            auto num = min(n - count, rows.available());
 
-                            case sql_type::UDT:
-                            {
-                                if (sp2.size() < sizeof(uint16_t))
-                                    return;
+            append_column_vectors(v, rows, rows.next, num);
+            rows.next += num;
+            count += num;
+        }
 
-                                col.max_length = *(uint16_t*)sp2.data();
+        return count;
+    }
 
-                                sp2 = sp2.subspan(sizeof(uint16_t));
+    void rpc::set_plp_handler(const plp_chunk_handler& handler) {
+        plp_cb = handler;
+    }
 
-                                // db name
+    vector<column_vector> rpc::fetch_rows(size_t n) {
+        vector<column_vector> v;
 
-                                if (sp2.size() < sizeof(uint8_t))
-                                    return;
+        fetch_rows(n, v);
 
-                                auto string_len = *(uint8_t*)sp2.data();
+        return v;
+    }
 
-                                sp2 = sp2.subspan(sizeof(uint8_t));
+    bool rpc::fetch_row() {
+        while (!rows.empty() || (!finished && results.empty())) {
+            if (fetch_row_no_wait())
+                return true;
 
-                                if (sp2.size() < string_len * sizeof(char16_t))
-                                    return;
+            if (finished || !results.empty())
+                return false;
 
-                                sp2 = sp2.subspan(string_len * sizeof(char16_t));
+            wait_for_packet();
+        }
 
-                                // schema name
+        return false;
+    }
 
-                                if (sp2.size() < sizeof(uint8_t))
-                                    return;
+    task<void> rpc::wait_for_packet_async() {
+        if (sess)
+            co_await msg_awaiter(sess->get());
+        else if (conn.impl->mars_sess)
+            co_await msg_awaiter(*conn.impl->mars_sess);
+        else
+            co_await msg_awaiter(conn.impl->sess);
 
-                                string_len = *(uint8_t*)sp2.data();
+        wait_for_packet();
+    }
 
-                                sp2 = sp2.subspan(sizeof(uint8_t));
+    task<void> rpc::start() {
+        if (!started)
+            co_await wait_for_packet_async();
+    }
 
-                                if (sp2.size() < string_len * sizeof(char16_t))
-                                    return;
+    task<bool> rpc::next_row() {
+        while (!rows.empty() || (!finished && results.empty())) {
+            if (fetch_row_no_wait())
+                co_return true;
 
-                                sp2 = sp2.subspan(string_len * sizeof(char16_t));
+            if (finished || !results.empty())
+                co_return false;
 
-                                // type name
+            co_await wait_for_packet_async();
+        }
 
-                                if (sp2.size() < sizeof(uint8_t))
-                                    return;
+        co_return false;
+    }
 
-                                string_len = *(uint8_t*)sp2.data();
+    bool rpc::next_result() {
+        while (results.empty()) {
+            if (finished)
+                return false;
 
-                                sp2 = sp2.subspan(sizeof(uint8_t));
+            wait_for_packet();
+        }
 
-                                if (sp2.size() < string_len * sizeof(char16_t))
-                                    return;
+        auto& rs = results.front();
 
-                                sp2 = sp2.subspan(string_len * sizeof(char16_t));
+        cols = move(rs.cols);
+        rows = move(rs.rows);
+        row_count = rs.row_count;
 
-                                // assembly qualified name
+        results.pop_front();
 
-                                if (sp2.size() < sizeof(uint16_t))
-                                    return;
+        return true;
+    }
 
-                                auto string_len2 = *(uint16_t*)sp2.data();
+    task<bool> rpc::next_result_async() {
+        while (results.empty()) {
+            if (finished)
+                co_return false;
 
-                                sp2 = sp2.subspan(sizeof(uint16_t));
+            co_await wait_for_packet_async();
+        }
 
-                                if (sp2.size() < string_len2 * sizeof(char16_t))
-                                    return;
+        co_return next_result();
+    }
 
-                                col.clr_name.assign((uint16_t*)sp2.data(), (uint16_t*)sp2.data() + string_len2);
+    uint16_t rpc::num_columns() const {
+        return (uint16_t)cols.size();
+    }
 
-                                sp2 = sp2.subspan(string_len2 * sizeof(char16_t));
+    const column& rpc::operator[](uint16_t i) const {
+        return cols[i];
+    }
 
-                                break;
-                            }
+    column& rpc::operator[](uint16_t i) {
+        return cols[i];
+    }
 
-                            default:
-                                throw formatted_error("Unhandled type {} in COLMETADATA message.", c.type);
-                        }
+    rpc_pipeline::rpc_pipeline(session& sess) : conn(sess.conn) {
+        this->sess.emplace(*sess.impl.get());
+    }
 
-                        if (sp2.size() < 1)
-                            throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least 1).", sp2.size());
+    void rpc_pipeline::execute() {
+        if (calls.empty())
+            return;
 
-                        auto name_len = *(uint8_t*)&sp2[0];
+        vector<uint8_t> buf(sizeof(tds_all_headers));
 
-                        sp2 = sp2.subspan(1);
-                        len++;
+        auto all_headers = (tds_all_headers*)&buf[0];
 
-                        if (sp2.size() < name_len * sizeof(char16_t))
-                            throw formatted_error("Short COLMETADATA message ({} bytes left, expected at least {}).", sp2.size(), name_len * sizeof(char16_t));
+        all_headers->total_size = sizeof(tds_all_headers);
+        all_headers->size = sizeof(uint32_t) + sizeof(tds_header_trans_desc);
+        all_headers->trans_desc.type = 2; // transaction descriptor
+        all_headers->trans_desc.descriptor = conn.impl->trans_id;
+        all_headers->trans_desc.outstanding = 1;
 
-                        col.name = u16string_view((char16_t*)sp2.data(), name_len);
+        for (size_t i = 0; i < calls.size(); i++) {
+            if (i != 0)
+                buf.push_back(0xff); // batch flag
 
-                        sp2 = sp2.subspan(name_len * sizeof(char16_t));
-                        len += name_len * sizeof(char16_t);
-                    }
+            write_rpc_request(buf, calls[i].name, calls[i].params, conn.impl->has_utf8);
+        }
 
-                    break;
-                }
+        if (sess)
+            sess->get().send_msg(tds_msg::rpc, buf);
+        else if (conn.impl->mars_sess)
+            conn.impl->mars_sess->send_msg(tds_msg::rpc, buf);
+        else
+            conn.impl->sess.send_msg(tds_msg::rpc, buf);
 
-                case token::RETURNVALUE:
-                {
-                    auto h = (tds_return_value*)&sp[0];
+        // Each call's results end with a DONEPROC. Errors are only thrown once
+        // everything has been read, so that the connection is left usable.
 
-                    if (sp.size() < sizeof(tds_return_value))
-                        throw formatted_error("Short RETURNVALUE message ({} bytes, expected at least {}).", sp.size(), sizeof(tds_return_value));
+        vector<uint8_t> partial;
+        vector<span<const uint8_t>> tokens;
+        vector<column> buf_columns;
+        exception_ptr exc;
+        size_t n = 0;
+        bool last_packet;
 
-                    // FIXME - param name
+        do {
+            enum tds_msg type;
+            vector<uint8_t> payload;
 
-                    if (is_byte_len_type(h->type)) {
-                        uint8_t len;
+            if (sess)
+                sess->get().wait_for_msg(type, payload, &last_packet);
+            else if (conn.impl->mars_sess)
+                conn.impl->mars_sess->wait_for_msg(type, payload, &last_packet);
+            else
+                conn.impl->sess.wait_for_msg(type, payload, &last_packet);
 
-                        if (sp.size() < sizeof(tds_return_value) + 2)
-                            throw formatted_error("Short RETURNVALUE message ({} bytes, expected at least {}).", sp.size(), sizeof(tds_return_value) + 2);
+            if (type != tds_msg::tabular_result)
+                throw formatted_error("Received message type {}, expected tabular_result", (int)type);
 
-                        len = *((uint8_t*)&sp[0] + sizeof(tds_return_value) + 1);
+            if (!partial.empty()) {
+                partial.insert(partial.end(), payload.begin(), payload.end());
+                payload.swap(partial);
+            }
 
-                        if (sp.size() < sizeof(tds_return_value) + 2 + len)
-                            throw formatted_error("Short RETURNVALUE message ({} bytes, expected {}).", sp.size(), sizeof(tds_return_value) + 2 + len);
+            tokens.clear();
 
-                        if (output_params.count(h->param_ordinal) != 0) {
-                            value& out = *output_params.at(h->param_ordinal);
+            {
+                auto sp = parse_tokens(payload, tokens, buf_columns);
 
-                            if (len == 0)
-                                out.is_null = true;
-                            else {
-                                out.is_null = false;
+                if (last_packet && !sp.empty())
+                    throw formatted_error("Data remaining in buffer");
 
-                                // FIXME - make sure not unexpected size?
+                if (sp.size() == payload.size())
+                    partial.swap(payload);
+                else
+                    partial.assign(sp.begin(), sp.end());
+            }
 
-                                out.val.resize(len);
-                                memcpy(out.val.data(), (uint8_t*)&sp[0] + sizeof(tds_return_value) + 2, len);
-                            }
-                        }
-                    } else
-                        throw formatted_error("Unhandled type {} in RETURNVALUE message.", h->type);
+            for (auto sp : tokens) {
+                auto type = (token)sp[0];
+                sp = sp.subspan(1);
 
-                    break;
-                }
+                if (n == calls.size())
+                    throw formatted_error("Unexpected token {} after the last RPC in pipeline.", type);
 
-                case token::ROW:
-                {
-                    rows.emplace_back();
+                auto& c = calls[n];
 
-                    auto& row = rows.back();
+                switch (type) {
+                    case token::DONE:
+                    case token::DONEINPROC:
+                    case token::DONEPROC:
+                    {
+                        if (sp.size() < sizeof(tds_done_msg))
+                            throw formatted_error("Short {} message ({} bytes, expected {}).", type, sp.size(), sizeof(tds_done_msg));
 
-                    row.resize(cols.size());
+                        const auto& msg = *(tds_done_msg*)sp.data();
 
-                    for (unsigned int i = 0; i < row.size(); i++) {
-                        auto& col = row[i];
+                        if (msg.status & 0x10) { // row count valid
+                            if (conn.impl->count_handler)
+                                conn.impl->count_handler(msg.rowcount, msg.curcmd);
 
-                        handle_row_col(get<0>(col), get<1>(col), cols[i].type, cols[i].max_length, sp);
-                    }
+                            if (!c.results.empty() && !c.results.back().row_count.has_value())
+                                c.results.back().row_count = msg.rowcount;
 
-                    break;
-                }
+                            // The last statement's count, not the sum, so that rows changed
+                            // by triggers aren't included. DONEPROC repeats it, if it's there.
+                            if (type != token::DONEPROC || !c.row_count.has_value())
+                                c.row_count = msg.rowcount;
+                        }
 
-                case token::NBCROW:
-                    handle_nbcrow(sp, cols, rows);
-                    break;
+                        if (type == token::DONEPROC)
+                            n++;
 
-                case token::ORDER:
-                {
-                    if (sp.size() < sizeof(uint16_t))
-                        throw formatted_error("Short ORDER message ({} bytes, expected at least {}).", sp.size(), sizeof(uint16_t));
+                        break;
+                    }
 
-                    auto len = *(uint16_t*)sp.data();
-                    sp = sp.subspan(sizeof(uint16_t));
+                    case token::INFO:
+                    case token::TDS_ERROR:
+                    case token::ENVCHANGE:
+                    {
+                        if (sp.size() < sizeof(uint16_t))
+                            throw formatted_error("Short {} message ({} bytes, expected at least 2).", type, sp.size());
+
+                        auto len = *(uint16_t*)&sp[0];
+
+                        sp = sp.subspan(sizeof(uint16_t));
+
+                        if (sp.size() < len)
+                            throw formatted_error("Short {} message ({} bytes, expected {}).", type, sp.size(), len);
+
+                        if (type == token::INFO) {
+                            if (conn.impl->message_handler)
+                                conn.impl->handle_info_msg(sp.subspan(0, len), false);
+                        } else if (type == token::TDS_ERROR) {
+                            if (conn.impl->message_handler)
+                                conn.impl->handle_info_msg(sp.subspan(0, len), true);
+                            else if (!exc) {
+                                exc = make_exception_ptr(formatted_error("RPC {} failed: {}", utf16_to_utf8(c.name),
+                                                                         utf16_to_utf8(extract_message(sp.subspan(0, len)))));
+                            }
+                        } else if (type == token::ENVCHANGE)
+                            conn.impl->handle_envchange_msg(sp.subspan(0, len));
 
-                    if (sp.size() < len)
-                        throw formatted_error("Short ORDER message ({} bytes, expected {}).", sp.size(), len);
+                        break;
+                    }
 
-                    break;
-                }
+                    case token::RETURNSTATUS:
+                    {
+                        if (sp.size() < sizeof(int32_t))
+                            throw formatted_error("Short RETURNSTATUS message ({} bytes, expected 4).", sp.size());
 
-                default:
-                    throw formatted_error("Unhandled token type {} while executing RPC.", type);
-            }
-        }
+                        c.return_status = *(int32_t*)&sp[0];
 
-        if (last_packet)
-            finished = true;
-    }
+                        break;
+                    }
 
-    bool rpc::fetch_row_no_wait() {
-        if (rows.empty())
-            return false;
+                    case token::COLMETADATA:
+                        parse_colmetadata(sp, c.results.emplace_back().cols);
+                        break;
 
-        auto& r = rows.front();
+                    case token::RETURNVALUE:
+                        handle_return_value(sp, c.output_params);
+                        break;
 
-        for (unsigned int i = 0; i < r.size(); i++) {
-            cols[i].is_null = get<1>(r[i]);
+                    case token::ROW:
+                    case token::NBCROW:
+                    {
+                        if (c.results.empty())
+                            throw formatted_error("{} token received before COLMETADATA.", type);
 
-            if (!cols[i].is_null)
-                cols[i].val.swap(get<0>(r[i]));
-        }
+                        auto& rs = c.results.back();
 
-        rows.pop_front();
+                        if (type == token::ROW)
+                            handle_row(sp, rs.cols, rs.rows);
+                        else
+                            handle_nbcrow(sp, rs.cols, rs.rows);
 
-        return true;
-    }
+                        break;
+                    }
 
-    bool rpc::fetch_row() {
-        while (!rows.empty() || !finished) {
-            if (fetch_row_no_wait())
-                return true;
+                    case token::ORDER:
+                    {
+                        if (sp.size() < sizeof(uint16_t))
+                            throw formatted_error("Short ORDER message ({} bytes, expected at least {}).", sp.size(), sizeof(uint16_t));
 
-            if (finished)
-                return false;
+                        auto len = *(uint16_t*)sp.data();
+                        sp = sp.subspan(sizeof(uint16_t));
 
-            wait_for_packet();
-        }
+                        if (sp.size() < len)
+                            throw formatted_error("Short ORDER message ({} bytes, expected {}).", sp.size(), len);
 
-        return false;
-    }
+                        break;
+                    }
 
-    uint16_t rpc::num_columns() const {
-        return (uint16_t)cols.size();
-    }
+                    default:
+                        throw formatted_error("Unhandled token type {} while executing RPC pipeline.", type);
+                }
+            }
 
-    const column& rpc::operator[](uint16_t i) const {
-        return cols[i];
-    }
+            conn.impl->pool.put(move(payload));
+        } while (!last_packet);
 
-    column& rpc::operator[](uint16_t i) {
-        return cols[i];
+        if (exc)
+            rethrow_exception(exc);
     }
 };
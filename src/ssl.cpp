@@ -4,6 +4,21 @@
 #if !defined(WITH_OPENSSL) && defined(_WIN32)
 #include <schannel.h>
 #endif
+#if defined(WITH_OPENSSL) && !defined(_WIN32)
+#include <openssl/kdf.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
 
 using namespace std;
 
@@ -239,6 +254,16 @@ static int verify_callback(int preverify, X509_STORE_CTX* x509_ctx) noexcept {
     }
 }
 
+static int new_session_callback(SSL* ssl, SSL_SESSION* sess) noexcept {
+    auto& c = *(tds::tds_ssl*)SSL_get_ex_data(ssl, 0);
+
+    try {
+        return c.ssl_new_session_cb(sess);
+    } catch (...) {
+        return 0;
+    }
+}
+
 #ifdef _WIN32
 class cert_store_closer {
 public:
@@ -287,6 +312,51 @@ static void add_certs_to_store(X509_STORE* store) {
 #endif
 
 namespace tds {
+    // All connections with the same check_certificate share an SSL_CTX, so the
+    // trust store is only loaded once, and they share the sessions which can be
+    // resumed, keyed by server name. These are never freed, so connections can
+    // still be closed from static destructors.
+
+    class shared_ssl_ctx {
+    public:
+        shared_ssl_ctx(bool check_certificate) {
+            ctx.reset(SSL_CTX_new(SSLv23_method()));
+            if (!ctx)
+                throw ssl_error("SSL_CTX_new", ERR_get_error());
+
+            if (check_certificate) {
+                if (!SSL_CTX_set_default_verify_paths(ctx.get()))
+                    throw ssl_error("SSL_CTX_set_default_verify_paths", ERR_get_error());
+
+#ifdef _WIN32
+                add_certs_to_store(SSL_CTX_get_cert_store(ctx.get()));
+#endif
+
+                SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, verify_callback);
+            }
+
+            SSL_CTX_set_options(ctx.get(), SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+
+            // OpenSSL doesn't look up client sessions itself, so we keep them
+            SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(ctx.get(), new_session_callback);
+        }
+
+        static shared_ssl_ctx& get(bool check_certificate) {
+            if (check_certificate) {
+                static auto& c = *new shared_ssl_ctx(true);
+                return c;
+            } else {
+                static auto& c = *new shared_ssl_ctx(false);
+                return c;
+            }
+        }
+
+        std::unique_ptr<SSL_CTX*, ssl_ctx_deleter> ctx;
+        std::mutex lock;
+        std::map<std::string, std::unique_ptr<SSL_SESSION*, ssl_session_deleter>, std::less<>> sessions;
+    };
+
     int tds_ssl::ssl_read_cb(span<uint8_t> sp) {
         if (sp.empty())
             return 0;
@@ -379,23 +449,38 @@ namespace tds {
         throw formatted_error("Error verifying SSL certificate: {}", str);
     }
 
-    tds_ssl::tds_ssl(tds_impl& tds) : tds(tds) {
-        ctx.reset(SSL_CTX_new(SSLv23_method()));
-        if (!ctx)
-            throw ssl_error("SSL_CTX_new", ERR_get_error());
+    // Sessions are per server rather than per host, as several instances on the same
+    // machine will have their own certificates and session keys.
+    static string session_key(const tds_impl& tds) {
+        return tds.hostname + ":" + to_string(tds.port);
+    }
 
-        if (tds.check_certificate) {
-            if (!SSL_CTX_set_default_verify_paths(ctx.get()))
-                throw ssl_error("SSL_CTX_set_default_verify_paths", ERR_get_error());
+    // Called once the handshake is done for TLS 1.2, or when a ticket arrives for
+    // TLS 1.3 - a newer session for the same server replaces the old one.
+    int tds_ssl::ssl_new_session_cb(SSL_SESSION* sess) {
+        if (tds.hostname.empty())
+            return 0;
 
-#ifdef _WIN32
-            add_certs_to_store(SSL_CTX_get_cert_store(ctx.get()));
-#endif
+        auto& shared = shared_ssl_ctx::get(tds.check_certificate);
 
-            SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, verify_callback);
-        }
+        lock_guard lg(shared.lock);
+
+        // We store a copy, as OpenSSL marks the original unresumable if we drop the connection
+        // without a close_notify - which we do deliberately when only the login is encrypted.
 
-        SSL_CTX_set_options(ctx.get(), SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+        unique_ptr<SSL_SESSION*, ssl_session_deleter> copy{SSL_SESSION_dup(sess)};
+
+        if (copy)
+            shared.sessions[session_key(tds)] = move(copy);
+
+        return 0;
+    }
+
+    tds_ssl::tds_ssl(tds_impl& tds) : tds(tds) {
+        auto& shared = shared_ssl_ctx::get(tds.check_certificate);
+
+        SSL_CTX_up_ref(shared.ctx.get());
+        ctx.reset(shared.ctx.get());
 
         meth.reset(BIO_meth_new(BIO_TYPE_MEM, "tdscpp"));
         if (!meth)
@@ -433,6 +518,13 @@ namespace tds {
 
             if (!SSL_set_tlsext_host_name(ssl.get(), tds.hostname.c_str()))
                 throw ssl_error("SSL_set_tlsext_host_name", ERR_get_error());
+
+            // resume the last session with this server if we can, skipping the full handshake
+
+            lock_guard lg(shared.lock);
+
+            if (auto it = shared.sessions.find(session_key(tds)); it != shared.sessions.end())
+                SSL_set_session(ssl.get(), it->second.get());
         }
 
         SSL_set_connect_state(ssl.get());
@@ -498,6 +590,150 @@ namespace tds {
 
         return out;
     }
+
+#ifndef _WIN32
+    template<typename T>
+    static void ktls_crypto_info(T& ci, uint16_t cipher_type, span<const uint8_t> key, span<const uint8_t> salt,
+                                 uint64_t seq) {
+        ci.info.version = TLS_1_2_VERSION;
+        ci.info.cipher_type = cipher_type;
+
+        memcpy(ci.key, key.data(), sizeof(ci.key));
+        memcpy(ci.salt, salt.data(), sizeof(ci.salt));
+
+        // big-endian - the record sequence number doubles as the explicit part of the nonce
+
+        for (unsigned int i = 0; i < sizeof(ci.rec_seq); i++) {
+            ci.rec_seq[i] = (uint8_t)(seq >> (8 * (sizeof(ci.rec_seq) - i - 1)));
+            ci.iv[i] = ci.rec_seq[i];
+        }
+    }
+
+    template<typename T>
+    static bool ktls_install(int sock, uint16_t cipher_type, span<const uint8_t> key_block, size_t key_len) {
+        T tx = {}, rx = {};
+
+        // Both sides have sent one record with these keys so far, their Finished messages.
+
+        ktls_crypto_info(tx, cipher_type, key_block.subspan(0, key_len), key_block.subspan(2 * key_len, 4), 1);
+        ktls_crypto_info(rx, cipher_type, key_block.subspan(key_len, key_len), key_block.subspan((2 * key_len) + 4, 4), 1);
+
+        auto ret = setsockopt(sock, SOL_TLS, TLS_TX, &tx, sizeof(tx));
+
+        OPENSSL_cleanse(&tx, sizeof(tx));
+
+        if (ret != 0) {
+            OPENSSL_cleanse(&rx, sizeof(rx));
+            return false;
+        }
+
+        ret = setsockopt(sock, SOL_TLS, TLS_RX, &rx, sizeof(rx));
+
+        OPENSSL_cleanse(&rx, sizeof(rx));
+
+        // we can't go back now that the kernel is encrypting what we send
+        if (ret != 0)
+            throw formatted_error("setsockopt(TLS_RX) failed (error {})", errno_to_string(errno));
+
+        return true;
+    }
+
+    class evp_pkey_ctx_deleter {
+    public:
+        typedef EVP_PKEY_CTX* pointer;
+
+        void operator()(EVP_PKEY_CTX* ctx) {
+            EVP_PKEY_CTX_free(ctx);
+        }
+    };
+
+    // Passes the connection's keys to the kernel, so that the socket can be used as if it were
+    // unencrypted. Returns false, leaving everything to OpenSSL, if the kernel can't do it or if
+    // this isn't TLS 1.2 with AES-GCM - which is what SQL Server uses. TLS 1.3 servers send
+    // tickets after the handshake, which we'd have to pick out of the stream ourselves.
+    bool tds_ssl::enable_ktls() {
+        if (SSL_version(ssl.get()) != TLS1_2_VERSION)
+            return false;
+
+        auto cipher = SSL_get_current_cipher(ssl.get());
+
+        if (!cipher)
+            return false;
+
+        size_t key_len;
+        uint16_t cipher_type;
+
+        switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+            case NID_aes_128_gcm:
+                key_len = 16;
+                cipher_type = TLS_CIPHER_AES_GCM_128;
+                break;
+
+            case NID_aes_256_gcm:
+                key_len = 32;
+                cipher_type = TLS_CIPHER_AES_GCM_256;
+                break;
+
+            default:
+                return false;
+        }
+
+        // key_block = PRF(master_secret, "key expansion", server_random + client_random), which for
+        // GCM is the client key, the server key, then the 4-byte salts - there's no MAC keys
+
+        uint8_t master_key[SSL_MAX_MASTER_KEY_LENGTH], client_random[SSL3_RANDOM_SIZE], server_random[SSL3_RANDOM_SIZE];
+        uint8_t key_block[(2 * 32) + (2 * 4)];
+        size_t key_block_len = (2 * key_len) + (2 * 4);
+        static const char label[] = "key expansion";
+
+        auto master_key_len = SSL_SESSION_get_master_key(SSL_get_session(ssl.get()), master_key, sizeof(master_key));
+        SSL_get_client_random(ssl.get(), client_random, sizeof(client_random));
+        SSL_get_server_random(ssl.get(), server_random, sizeof(server_random));
+
+        unique_ptr<EVP_PKEY_CTX*, evp_pkey_ctx_deleter> pctx{EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr)};
+
+        if (!pctx)
+            throw ssl_error("EVP_PKEY_CTX_new_id", ERR_get_error());
+
+        if (EVP_PKEY_derive_init(pctx.get()) <= 0 ||
+            EVP_PKEY_CTX_set_tls1_prf_md(pctx.get(), SSL_CIPHER_get_handshake_digest(cipher)) <= 0 ||
+            EVP_PKEY_CTX_set1_tls1_prf_secret(pctx.get(), master_key, (int)master_key_len) <= 0 ||
+            EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), (const uint8_t*)label, (int)sizeof(label) - 1) <= 0 ||
+            EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), server_random, (int)sizeof(server_random)) <= 0 ||
+            EVP_PKEY_CTX_add1_tls1_prf_seed(pctx.get(), client_random, (int)sizeof(client_random)) <= 0 ||
+            EVP_PKEY_derive(pctx.get(), key_block, &key_block_len) <= 0) {
+            OPENSSL_cleanse(master_key, sizeof(master_key));
+            throw ssl_error("EVP_PKEY_derive", ERR_get_error());
+        }
+
+        OPENSSL_cleanse(master_key, sizeof(master_key));
+
+        bool ret = false;
+
+        // fails if the tls module isn't loaded
+        if (setsockopt(tds.sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+            // set before TLS_RX goes in, so that the socket thread knows what EIO means
+            tds.ktls = true;
+
+            try {
+                if (cipher_type == TLS_CIPHER_AES_GCM_128)
+                    ret = ktls_install<tls12_crypto_info_aes_gcm_128>(tds.sock, cipher_type, span(key_block, key_block_len), key_len);
+                else
+                    ret = ktls_install<tls12_crypto_info_aes_gcm_256>(tds.sock, cipher_type, span(key_block, key_block_len), key_len);
+            } catch (...) {
+                OPENSSL_cleanse(key_block, sizeof(key_block));
+                throw;
+            }
+        }
+
+        OPENSSL_cleanse(key_block, sizeof(key_block));
+
+        if (!ret)
+            tds.ktls = false;
+
+        return ret;
+    }
+#endif
 };
 #elif defined(_WIN32)
 namespace tds {
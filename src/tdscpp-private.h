@@ -9,12 +9,18 @@
 #include <cstdint>
 #include <thread>
 #include <condition_variable>
+#include <deque>
+#include <set>
+#include <atomic>
 #include "config.h"
+#include "ringbuf.h"
 
 #ifdef _WIN32
 #define SECURITY_WIN32
 #include <windows.h>
 #include <sspi.h>
+#else
+#include <sys/epoll.h>
 #endif
 
 #ifdef WITH_OPENSSL
@@ -513,6 +519,10 @@ private:
 
 #endif
 
+#ifndef _WIN32
+std::string errno_to_string(int err);
+#endif
+
 #ifdef _WIN32
 class last_error : public std::exception {
 public:
@@ -581,6 +591,15 @@ public:
         SSL_CTX_free(ctx);
     }
 };
+
+class ssl_session_deleter {
+public:
+    typedef SSL_SESSION* pointer;
+
+    void operator()(SSL_SESSION* sess) {
+        SSL_SESSION_free(sess);
+    }
+};
 #endif
 
 class event {
@@ -592,7 +611,34 @@ public:
     unique_handle h;
 };
 
-class ringbuf;
+class send_queue {
+public:
+    void push(std::vector<uint8_t>&& buf);
+    void push(std::span<const uint8_t> sp);
+    size_t gather(std::span<std::span<const uint8_t>> out) const;
+    void consume(size_t bytes);
+    [[nodiscard]] bool empty() const;
+
+private:
+    std::deque<std::vector<uint8_t>> bufs;
+    size_t offset = 0; // bytes of bufs.front() already sent
+};
+
+// Freelist of packet payload buffers, filled by the socket thread and
+// handed back by whoever consumes the message.
+
+class packet_pool {
+public:
+    std::vector<uint8_t> get(size_t size);
+    void put(std::vector<uint8_t>&& buf) noexcept;
+
+private:
+    static constexpr size_t max_free = 64;
+    static constexpr size_t max_size = 65536;
+
+    std::mutex lock;
+    std::vector<std::vector<uint8_t>> free;
+};
 
 namespace tds {
 #if defined(WITH_OPENSSL) || defined(_WIN32)
@@ -605,6 +651,58 @@ namespace tds {
         bool last_packet;
     };
 
+    // Single-producer, single-consumer queue of messages from the socket thread.
+    // Slots are allocated in chunks, which are recycled once drained, so a
+    // handoff normally costs neither an allocation nor a lock. The consumer
+    // spins briefly before parking on a futex.
+
+    class mess_queue {
+    public:
+        mess_queue();
+        ~mess_queue();
+
+        mess_queue(const mess_queue&) = delete;
+        mess_queue& operator=(const mess_queue&) = delete;
+
+        bool push(mess&& m);
+        [[nodiscard]] bool pop(mess& m);
+        [[nodiscard]] bool empty() const;
+        size_t size() const;
+        void wait();
+        [[nodiscard]] bool arm();
+        void close();
+        [[nodiscard]] bool closed() const;
+        void wait_for_space(size_t limit, std::stop_token stop);
+
+    private:
+        static constexpr size_t chunk_size = 64;
+
+        struct chunk {
+            std::array<mess, chunk_size> slots;
+            chunk* next = nullptr;
+        };
+
+        void wake();
+
+        // producer side
+        alignas(64) chunk* tail;
+        size_t tail_pos = 0;
+        std::atomic<uint64_t> pushed = 0;
+
+        // consumer side
+        alignas(64) chunk* head;
+        size_t head_pos = 0;
+        std::atomic<uint64_t> popped = 0;
+
+        alignas(64) std::atomic<chunk*> spare = nullptr;
+        std::atomic<bool> parked = false;
+        std::atomic<uint32_t> signal = 0;
+        std::atomic<bool> is_closed = false;
+        std::atomic<bool> producer_parked = false;
+        std::mutex space_lock;
+        std::condition_variable_any space_cv;
+    };
+
     class tds_impl;
 
     class main_session {
@@ -615,17 +713,115 @@ namespace tds {
 #if defined(WITH_OPENSSL) || defined(_WIN32)
         void send_msg(enum tds_msg type, std::span<const uint8_t> msg, bool do_ssl = true);
         void send_raw(std::span<const uint8_t> msg, bool do_ssl = true);
+        void send_raw(std::vector<uint8_t>&& msg, bool do_ssl = true);
 #else
         void send_msg(enum tds_msg type, std::span<const uint8_t> msg);
         void send_raw(std::span<const uint8_t> msg);
+        void send_raw(std::vector<uint8_t>&& msg);
 #endif
+        void send_packet(enum tds_msg type, std::span<const uint8_t> msg, uint8_t status);
 
         tds_impl& tds;
-        std::condition_variable mess_in_cv;
         std::mutex mess_in_lock;
-        std::list<mess> mess_list;
-        std::condition_variable_any rate_limit_cv;
+        mess_queue mess_in;
         std::exception_ptr socket_thread_exc;
+        std::coroutine_handle<> waiter;
+    };
+
+    // state of the socket loop, kept on the stack of the dedicated thread or
+    // owned by tds_impl when running on a reactor
+
+    struct socket_state {
+        socket_state() : in_buf(65536)
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+                         , pt_buf(65536)
+#endif
+        {
+        }
+
+        ringbuf in_buf;
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+        ringbuf pt_buf;
+        bool do_ssl = false;
+#endif
+#ifndef _WIN32
+        int epoll_fd = -1;
+        struct epoll_event sock_ev;
+        bool poll_out = true;
+#endif
+    };
+
+#ifndef _WIN32
+    struct reactor_thread {
+        ~reactor_thread();
+
+        unique_handle epoll;
+        event wake;
+        std::mutex lock;
+        std::condition_variable removed_cv;
+        std::set<tds_impl*> conns;
+        std::vector<tds_impl*> removals;
+        bool finished = false;
+        std::jthread t;
+    };
+#endif
+
+    class reactor_impl {
+    public:
+        reactor_impl(unsigned int num_threads);
+        void add(tds_impl& conn);
+        void remove(tds_impl& conn) noexcept;
+
+#ifndef _WIN32
+    private:
+        void run(std::stop_token stop, reactor_thread& rt);
+        void detach(reactor_thread& rt, tds_impl& conn) noexcept;
+
+        std::vector<std::unique_ptr<reactor_thread>> threads;
+#endif
+    };
+
+    // Resumes the async API's coroutines when the connection has no executor, so that
+    // they never run on the socket thread - a coroutine which blocked there, such as by
+    // destroying a query, would be waiting for a message that only it could deliver.
+
+    // There's one of these for the whole process, shared by every connection.
+
+    class resume_thread {
+    public:
+        resume_thread();
+        void post(std::coroutine_handle<> h);
+
+    private:
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<std::coroutine_handle<>> queue;
+        std::jthread t;
+    };
+
+    // Handles from sp_prepare which aren't being used by a query, so that a later
+    // query with the same SQL can go straight to sp_execute. Most recently used
+    // first. clear() bumps the generation, so that handles which are checked out
+    // at the time don't get put back.
+
+    class prepared_cache {
+    public:
+        struct entry {
+            std::u16string key;
+            int32_t handle;
+        };
+
+        std::optional<entry> take(const std::u16string& key, uint64_t& gen);
+        std::optional<int32_t> put(entry&& e, uint64_t gen);
+        void clear();
+
+        unsigned int capacity = 0;
+
+    private:
+        std::mutex lock;
+        std::list<entry> entries;
+        std::map<std::u16string_view, std::list<entry>::iterator> index;
+        uint64_t generation = 0;
     };
 
     class tds_impl {
@@ -634,7 +830,9 @@ namespace tds {
                  std::string_view app_name, std::string_view db,
                  const msg_handler& message_handler,
                  const func_count_handler& count_handler, uint16_t port, encryption_type enc,
-                 bool check_certificate, bool mars, unsigned int rate_limit);
+                 bool check_certificate, bool mars, unsigned int rate_limit, bool use_io_uring,
+                 reactor* event_loop, const resume_handler& executor, std::chrono::milliseconds connect_timeout,
+                 bool use_ktls);
         ~tds_impl();
         void handle_info_msg(std::span<const uint8_t> sp, bool error) const;
 
@@ -644,7 +842,7 @@ namespace tds {
         void bcp(std::u16string_view table, const std::vector<std::u16string>& np, const std::vector<std::vector<value>>& vp,
                  std::u16string_view db);
 
-        void connect(const std::string& server, uint16_t port, bool get_fqdn);
+        void connect(const std::string& server, uint16_t port, bool get_fqdn, std::chrono::milliseconds timeout);
         void send_prelogin_msg(enum encryption_type encrypt, bool mars);
         void send_login_msg(std::string_view user, std::string_view password, std::string_view server,
                             std::string_view app_name, std::string_view db);
@@ -661,9 +859,20 @@ namespace tds {
 #endif
         void socket_thread(std::stop_token stop);
         void socket_thread_wrap(std::stop_token stop) noexcept;
-        void socket_thread_read(ringbuf& in_buf);
+        void socket_thread_finished(std::exception_ptr exc) noexcept;
+        void resume_waiters();
+#ifndef _WIN32
+        bool socket_thread_sock_event(std::stop_token stop, uint32_t events, socket_state& st);
+        void socket_thread_mess_event(socket_state& st);
+        void socket_thread_poll_out(socket_state& st, bool poll_out);
+#endif
+        bool socket_thread_read(ringbuf& in_buf);
         bool socket_thread_write();
         void socket_thread_parse_messages(std::stop_token stop, ringbuf& in_buf);
+#ifdef WITH_IO_URING
+        bool socket_thread_uring(std::stop_token stop, ringbuf& in_buf, const std::function<void()>& on_read,
+                                 const std::function<void()>& on_event);
+#endif
 #if defined(WITH_OPENSSL) || defined(_WIN32)
         void decrypt_messages(ringbuf& in_buf, ringbuf& pt_buf);
 #endif
@@ -679,9 +888,11 @@ namespace tds {
         int sock = 0;
 #endif
         std::string fqdn, hostname;
+        uint16_t port = 0;
         msg_handler message_handler;
         func_count_handler count_handler;
         uint32_t packet_size = 4096;
+        packet_pool pool;
         uint16_t spid = 0;
         bool has_utf8 = false;
 #if defined(WITH_OPENSSL) || defined(_WIN32)
@@ -699,12 +910,52 @@ namespace tds {
         event mess_event;
         main_session sess{*this};
         std::mutex mess_out_lock;
-        std::vector<uint8_t> mess_out_buf;
+        send_queue mess_out;
         unsigned int rate_limit;
+        bool use_io_uring;
+        bool use_ktls;
+        std::atomic<bool> ktls = false; // the kernel's doing the encryption
         bool connected = true;
+        reactor_impl* event_loop = nullptr;
+#ifndef _WIN32
+        reactor_thread* event_loop_thread = nullptr;
+#endif
+        std::unique_ptr<socket_state> event_loop_state;
+        std::stop_source event_loop_stop;
+        resume_handler executor;
+        std::vector<std::coroutine_handle<>> pending_resumes; // only touched by socket thread
+        prepared_cache prepared;
+        bool prepexec = false;
+        bool reset_pending = false; // set RESETCONNECTION on the next request
         std::jthread t;
     };
 
+    class pool_impl {
+    public:
+        pool_impl(const options& opts, size_t min_size, size_t max_size,
+                  std::chrono::seconds idle_timeout, std::chrono::seconds check_after);
+
+        std::unique_ptr<tds> get();
+        void put(std::unique_ptr<tds>&& conn);
+        void evict(std::list<std::unique_ptr<tds>>& closing);
+        void reap(std::stop_token stop);
+
+        struct idle_conn {
+            std::unique_ptr<tds> conn;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        options opts;
+        size_t min_size, max_size;
+        std::chrono::seconds idle_timeout, check_after;
+        std::mutex lock;
+        std::condition_variable cv;
+        std::list<idle_conn> idle; // most recently returned first
+        size_t open = 0; // including those in use or still connecting
+        std::condition_variable_any reap_cv;
+        std::jthread reaper; // last, so it's stopped before the rest goes
+    };
+
 #if defined(WITH_OPENSSL) || defined(_WIN32)
     class tds_ssl {
     public:
@@ -714,6 +965,10 @@ namespace tds {
         int ssl_write_cb(std::span<const uint8_t> sp);
         long ssl_ctrl_cb(int cmd, long num, void* ptr);
         int ssl_verify_cb(int preverify, X509_STORE_CTX* x509_ctx);
+        int ssl_new_session_cb(SSL_SESSION* sess);
+#ifndef _WIN32
+        bool enable_ktls();
+#endif
 #else
         ~tds_ssl();
 #endif
@@ -744,19 +999,30 @@ namespace tds {
 
     class batch_impl {
     public:
-        batch_impl(tds& conn, std::u16string_view q);
-        batch_impl(session& sess, std::u16string_view q);
+        batch_impl(tds& conn, std::u16string_view q, bool wait = true);
+        batch_impl(session& sess, std::u16string_view q, bool wait = true);
         ~batch_impl();
 
         bool fetch_row();
+        bool fetch_row_no_wait();
+        std::optional<row_view> fetch_row_view();
+        size_t fetch_rows(size_t n, std::vector<column_vector>& v);
         void wait_for_packet();
+        task<void> wait_for_packet_async();
+        task<bool> next_row();
+        bool next_result();
+        task<bool> next_result_async();
 
         std::vector<column> cols;
-        bool finished = false, received_attn = false;
-        std::list<std::vector<std::pair<value_data_t, bool>>> rows;
+        std::optional<uint64_t> row_count;
+        bool finished = false, received_attn = false, started = true;
+        row_arena rows;
+        std::list<result_set> results;
         tds& conn;
         std::optional<std::reference_wrapper<smp_session>> sess;
-        std::list<std::vector<uint8_t>> tokens;
+        std::vector<std::span<const uint8_t>> tokens;
+        plp_chunk_handler plp_cb;
+        plp_stream plp;
         std::vector<uint8_t> buf;
         std::vector<column> buf_columns;
     };
@@ -766,6 +1032,7 @@ namespace tds {
         smp_session(tds_impl& impl);
         ~smp_session();
         void send_msg(enum tds_msg type, std::span<const uint8_t> msg);
+        void send_packet(enum tds_msg type, std::span<const uint8_t> msg, uint8_t status);
         void wait_for_msg(enum tds_msg& type, std::vector<uint8_t>& payload, bool* last_packet = nullptr);
         void parse_message(std::stop_token stop, std::span<const uint8_t> msg);
         void send_ack();
@@ -773,13 +1040,92 @@ namespace tds {
         tds_impl& impl;
         uint32_t seqnum = 1;
         uint16_t sid;
-        std::condition_variable mess_in_cv;
         std::mutex mess_in_lock;
-        std::list<mess> mess_list;
-        std::condition_variable_any rate_limit_cv;
+        mess_queue mess_in;
         std::exception_ptr socket_thread_exc;
+        std::coroutine_handle<> waiter;
         uint32_t recv_wndw;
     };
+
+    // Sends a message a packet at a time, for when the caller doesn't have the
+    // whole payload in memory. A packet is only sent once there's more data to
+    // follow it, so finish() never sends an empty packet.
+
+    class msg_writer {
+    public:
+        msg_writer(tds_impl& impl, smp_session* smp, enum tds_msg type);
+        void write(std::span<const uint8_t> data);
+        void finish();
+        void abort();
+
+    private:
+        void flush(uint8_t status);
+
+        tds_impl& impl;
+        smp_session* smp;
+        enum tds_msg type;
+        std::vector<uint8_t> buf;
+        size_t max_size;
+    };
+
+    // Suspends until a message is waiting on a session, or the socket thread
+    // has stopped. The subsequent wait_for_msg won't block.
+
+    template<typename T>
+    class msg_awaiter {
+    public:
+        msg_awaiter(T& sess) : sess(sess) { }
+
+        ~msg_awaiter() {
+            if (!registered)
+                return;
+
+            // coroutine destroyed while suspended
+
+            std::lock_guard lg(sess.mess_in_lock);
+
+            if (sess.waiter == handle)
+                sess.waiter = nullptr;
+        }
+
+        bool await_ready() {
+            return ready();
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard lg(sess.mess_in_lock);
+
+            if (ready() || !sess.mess_in.arm())
+                return false;
+
+            handle = h;
+            sess.waiter = h;
+            registered = true;
+
+            return true;
+        }
+
+        void await_resume() noexcept {
+            registered = false;
+        }
+
+    private:
+        bool ready() const;
+
+        T& sess;
+        std::coroutine_handle<> handle;
+        bool registered = false;
+    };
+
+    template<>
+    inline bool msg_awaiter<main_session>::ready() const {
+        return !sess.mess_in.empty() || sess.mess_in.closed() || !sess.tds.connected;
+    }
+
+    template<>
+    inline bool msg_awaiter<smp_session>::ready() const {
+        return !sess.mess_in.empty() || sess.mess_in.closed() || !sess.impl.connected;
+    }
 };
 
 #ifdef _WIN32
@@ -1541,13 +1887,78 @@ static constexpr bool is_byte_len_type(enum tds::sql_type type) noexcept {
     }
 }
 
+// Conversions from TDS's wire formats to Arrow's 16-byte ones, used by arrow.cpp.
+
+namespace tds {
+    // DECIMAL and NUMERIC are a sign byte followed by the magnitude, little-endian;
+    // Arrow wants two's complement.
+
+    static constexpr void write_decimal128(std::span<uint8_t, 16> out, std::span<const uint8_t> sp) noexcept {
+        bool neg = sp[0] == 0;
+
+        for (size_t i = 0; i < 16; i++) {
+            out[i] = i + 1 < sp.size() ? sp[i + 1] : 0;
+        }
+
+        if (neg) {
+            unsigned int carry = 1;
+
+            for (size_t i = 0; i < 16; i++) {
+                auto v = (unsigned int)(uint8_t)~out[i] + carry;
+
+                out[i] = (uint8_t)v;
+                carry = v >> 8;
+            }
+        }
+    }
+
+    // MONEY is in ten-thousandths already, so only needs sign-extending - but its
+    // high half comes first.
+
+    static constexpr void write_money128(std::span<uint8_t, 16> out, std::span<const uint8_t> sp) noexcept {
+        auto le32 = [&](size_t off) {
+            return (uint32_t)sp[off] | ((uint32_t)sp[off + 1] << 8) | ((uint32_t)sp[off + 2] << 16) | ((uint32_t)sp[off + 3] << 24);
+        };
+
+        int64_t v;
+
+        if (sp.size() == 4)
+            v = (int32_t)le32(0);
+        else
+            v = (int64_t)(((uint64_t)le32(0) << 32) | le32(sizeof(uint32_t)));
+
+        for (size_t i = 0; i < 8; i++) {
+            out[i] = (uint8_t)((uint64_t)v >> (i * 8));
+            out[i + 8] = v < 0 ? 0xff : 0;
+        }
+    }
+
+    // GUIDs are stored with their first three fields little-endian
+
+    static constexpr void write_uuid(std::span<uint8_t, 16> out, std::span<const uint8_t> sp) noexcept {
+        out[0] = sp[3];
+        out[1] = sp[2];
+        out[2] = sp[1];
+        out[3] = sp[0];
+        out[4] = sp[5];
+        out[5] = sp[4];
+        out[6] = sp[7];
+        out[7] = sp[6];
+
+        for (size_t i = 8; i < 16; i++) {
+            out[i] = sp[i];
+        }
+    }
+};
+
 // tdscpp.cpp
-std::span<const uint8_t> parse_tokens(std::span<const uint8_t> sp, std::list<std::vector<uint8_t>>& tokens,
+std::span<const uint8_t> parse_tokens(std::span<const uint8_t> sp, std::vector<std::span<const uint8_t>>& tokens,
                                       std::vector<tds::column>& buf_columns);
-void handle_row_col(tds::value_data_t& val, bool& is_null, enum tds::sql_type type,
-                    unsigned int max_length, std::span<const uint8_t>& sp);
-void handle_nbcrow(std::span<const uint8_t>& sp, const std::vector<tds::column>& cols,
-                   std::list<std::vector<std::pair<tds::value_data_t, bool>>>& rows);
+void handle_row(std::span<const uint8_t>& sp, const std::vector<tds::column>& cols, tds::row_arena& rows);
+void handle_nbcrow(std::span<const uint8_t>& sp, const std::vector<tds::column>& cols, tds::row_arena& rows);
+void handle_plp_row(tds::plp_stream& plp, const std::vector<tds::column>& cols, tds::row_arena& rows);
+void init_column_vectors(std::vector<tds::column_vector>& v, const std::vector<tds::column>& cols);
+void append_column_vectors(std::vector<tds::column_vector>& v, const tds::row_arena& rows, size_t first, size_t count);
 
 // ver80coll.cpp
 std::weak_ordering compare_strings_80(std::u16string_view val1, std::u16string_view val2,
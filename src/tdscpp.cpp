@@ -6,6 +6,9 @@
 #include "tdscpp-private.h"
 #include "config.h"
 #include "ringbuf.h"
+#ifdef WITH_IO_URING
+#include "uring.h"
+#endif
 #include <iostream>
 #include <string>
 #include <list>
@@ -21,6 +24,8 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #ifdef HAVE_GSSAPI
 #include <gssapi/gssapi.h>
@@ -243,7 +248,7 @@ static bool parse_row_col(enum tds::sql_type type, unsigned int max_length, span
     return true;
 }
 
-span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>& tokens, vector<tds::column>& buf_columns) {
+span<const uint8_t> parse_tokens(span<const uint8_t> sp, vector<span<const uint8_t>>& tokens, vector<tds::column>& buf_columns) {
     while (!sp.empty()) {
         auto type = (tds::token)sp[0];
 
@@ -264,7 +269,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
                 if (sp.size() < (size_t)(1 + sizeof(uint16_t) + len))
                     return sp;
 
-                tokens.emplace_back(sp.data(), sp.data() + 1 + sizeof(uint16_t) + len);
+                tokens.emplace_back(sp.data(), 1 + sizeof(uint16_t) + len);
                 sp = sp.subspan(1 + sizeof(uint16_t) + len);
 
                 break;
@@ -276,7 +281,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
                 if (sp.size() < 1 + sizeof(tds_done_msg))
                     return sp;
 
-                tokens.emplace_back(sp.data(), sp.data() + 1 + sizeof(tds_done_msg));
+                tokens.emplace_back(sp.data(), 1 + sizeof(tds_done_msg));
                 sp = sp.subspan(1 + sizeof(tds_done_msg));
             break;
 
@@ -288,7 +293,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
 
                 if (num_columns == 0) {
                     buf_columns.clear();
-                    tokens.emplace_back(sp.data(), sp.data() + 5);
+                    tokens.emplace_back(sp.data(), 5);
                     sp = sp.subspan(5);
                     continue;
                 }
@@ -520,7 +525,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
 
                 auto len = (size_t)(sp2.data() - sp.data());
 
-                tokens.emplace_back(sp.data(), sp.data() + len);
+                tokens.emplace_back(sp.data(), len);
                 sp = sp.subspan(len);
 
                 buf_columns = cols;
@@ -538,7 +543,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
 
                 auto len = (size_t)(sp2.data() - sp.data());
 
-                tokens.emplace_back(sp.data(), sp.data() + len);
+                tokens.emplace_back(sp.data(), len);
                 sp = sp.subspan(len);
 
                 break;
@@ -578,7 +583,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
 
                 auto len = (size_t)(sp2.data() - sp.data());
 
-                tokens.emplace_back(sp.data(), sp.data() + len);
+                tokens.emplace_back(sp.data(), len);
                 sp = sp.subspan(len);
 
                 break;
@@ -589,7 +594,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
                 if (sp.size() < 1 + sizeof(int32_t))
                     return sp;
 
-                tokens.emplace_back(sp.data(), sp.data() + 1 + sizeof(int32_t));
+                tokens.emplace_back(sp.data(), 1 + sizeof(int32_t));
                 sp = sp.subspan(1 + sizeof(int32_t));
 
                 break;
@@ -615,7 +620,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
                     if (sp.size() < 1 + sizeof(tds_return_value) + 2 + len)
                         return sp;
 
-                    tokens.emplace_back(sp.data(), sp.data() + 1 + sizeof(tds_return_value) + 2 + len);
+                    tokens.emplace_back(sp.data(), 1 + sizeof(tds_return_value) + 2 + len);
                     sp = sp.subspan(1 + sizeof(tds_return_value) + 2 + len);
                 } else
                     throw formatted_error("Unhandled type {} in RETURNVALUE message.", h->type);
@@ -651,7 +656,7 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
 
                 auto token_len = (size_t)(sp2.data() - sp.data());
 
-                tokens.emplace_back(sp.data(), sp.data() + token_len);
+                tokens.emplace_back(sp.data(), token_len);
                 sp = sp.subspan(token_len);
 
                 break;
@@ -665,8 +670,45 @@ span<const uint8_t> parse_tokens(span<const uint8_t> sp, list<vector<uint8_t>>&
     return sp;
 }
 
-void handle_row_col(tds::value_data_t& val, bool& is_null, enum tds::sql_type type,
-                    unsigned int max_length, span<const uint8_t>& sp) {
+// Appends a value to the end of a row_arena's buffer, with the subset of the
+// vector interface that handle_row_col uses.
+
+class arena_value {
+public:
+    arena_value(vector<uint8_t>& buf) : buf(buf), start(buf.size()) { }
+
+    void assign(const uint8_t* first, const uint8_t* last) {
+        buf.resize(start);
+        buf.insert(buf.end(), first, last);
+    }
+
+    void clear() {
+        buf.resize(start);
+    }
+
+    void resize(size_t len) {
+        buf.resize(start + len);
+    }
+
+    void reserve(size_t len) {
+        buf.reserve(start + len);
+    }
+
+    uint8_t* data() {
+        return buf.data() + start;
+    }
+
+    size_t size() const {
+        return buf.size() - start;
+    }
+
+    vector<uint8_t>& buf;
+    size_t start;
+};
+
+template<typename T>
+static void handle_row_col(T& val, bool& is_null, enum tds::sql_type type,
+                           unsigned int max_length, span<const uint8_t>& sp) {
     switch (type) {
         case tds::sql_type::TINYINT:
         case tds::sql_type::BIT:
@@ -1828,7 +1870,7 @@ static string wsa_error_to_string(int err) {
     }
 }
 #else
-static string errno_to_string(int err) {
+string errno_to_string(int err) {
     switch (err) {
         case E2BIG: return "E2BIG";
         case EACCES: return "EACCES";
@@ -2014,6 +2056,84 @@ void event::set() {
 
 #endif
 
+void send_queue::push(vector<uint8_t>&& buf) {
+    if (!buf.empty())
+        bufs.emplace_back(move(buf));
+}
+
+void send_queue::push(span<const uint8_t> sp) {
+    if (!sp.empty())
+        bufs.emplace_back(sp.begin(), sp.end());
+}
+
+size_t send_queue::gather(span<span<const uint8_t>> out) const {
+    size_t num = 0;
+
+    for (const auto& b : bufs) {
+        if (num == out.size())
+            break;
+
+        out[num] = num == 0 ? span<const uint8_t>(b).subspan(offset) : span<const uint8_t>(b);
+        num++;
+    }
+
+    return num;
+}
+
+void send_queue::consume(size_t bytes) {
+    while (bytes > 0) {
+        auto left = bufs.front().size() - offset;
+
+        if (bytes < left) {
+            offset += bytes;
+            return;
+        }
+
+        bytes -= left;
+        bufs.pop_front();
+        offset = 0;
+    }
+}
+
+bool send_queue::empty() const {
+    return bufs.empty();
+}
+
+vector<uint8_t> packet_pool::get(size_t size) {
+    vector<uint8_t> ret;
+
+    {
+        lock_guard lg(lock);
+
+        if (!free.empty()) {
+            ret.swap(free.back());
+            free.pop_back();
+        }
+    }
+
+    ret.resize(size);
+
+    return ret;
+}
+
+void packet_pool::put(vector<uint8_t>&& buf) noexcept {
+    // anything bigger has grown to hold a token split across many packets
+    if (buf.capacity() == 0 || buf.capacity() > max_size)
+        return;
+
+    buf.clear();
+
+    lock_guard lg(lock);
+
+    if (free.size() >= max_free)
+        return;
+
+    try {
+        free.emplace_back(move(buf));
+    } catch (...) {
+    }
+}
+
 static void name_thread(string_view name) {
 #ifdef _WIN32
     if (auto h = LoadLibraryW(L"kernelbase.dll")) {
@@ -2036,14 +2156,27 @@ static void name_thread(string_view name) {
 #endif
 }
 
-void handle_nbcrow(span<const uint8_t>& sp, const vector<tds::column>& cols, list<vector<pair<tds::value_data_t, bool>>>& rows) {
-    if (cols.empty())
-        return;
+static void handle_row_value(span<const uint8_t>& sp, const tds::column& col, tds::row_arena& rows, bool is_null) {
+    arena_value v(rows.data);
+
+    if (!is_null)
+        handle_row_col(v, is_null, col.type, col.max_length, sp);
+
+    rows.cells.emplace_back(v.start, v.size());
+    rows.nulls.push_back(is_null);
+}
+
+void handle_row(span<const uint8_t>& sp, const vector<tds::column>& cols, tds::row_arena& rows) {
+    rows.start_row();
 
-    rows.emplace_back();
-    auto& row = rows.back();
+    for (const auto& col : cols) {
+        handle_row_value(sp, col, rows, false);
+    }
+}
 
-    row.resize(cols.size());
+void handle_nbcrow(span<const uint8_t>& sp, const vector<tds::column>& cols, tds::row_arena& rows) {
+    if (cols.empty())
+        return;
 
     auto bitset_length = (cols.size() + 7) / 8;
 
@@ -2055,9 +2188,9 @@ void handle_nbcrow(span<const uint8_t>& sp, const vector<tds::column>& cols, lis
 
     sp = sp.subspan(bitset_length);
 
-    for (unsigned int i = 0; i < row.size(); i++) {
-        auto& col = row[i];
+    rows.start_row();
 
+    for (unsigned int i = 0; i < cols.size(); i++) {
         if (i != 0) {
             if ((i & 7) == 0) {
                 bitset = bitset.subspan(1);
@@ -2066,10 +2199,321 @@ void handle_nbcrow(span<const uint8_t>& sp, const vector<tds::column>& cols, lis
                 bsv >>= 1;
         }
 
-        if (bsv & 1) // NULL
-            get<1>(col) = true;
+        handle_row_value(sp, cols[i], rows, bsv & 1);
+    }
+}
+
+static bool is_plp_col(const tds::column& col) {
+    switch (col.type) {
+        case tds::sql_type::VARCHAR:
+        case tds::sql_type::NVARCHAR:
+        case tds::sql_type::VARBINARY:
+        case tds::sql_type::CHAR:
+        case tds::sql_type::NCHAR:
+        case tds::sql_type::BINARY:
+            return col.max_length == 0xffff;
+
+        case tds::sql_type::XML:
+        case tds::sql_type::UDT:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+void tds::plp_stream::start(bool nbc) noexcept {
+    this->nbc = nbc;
+    active = true;
+    col = 0;
+    phase = nbc ? 0 : 1;
+    row.clear();
+    pending.clear();
+}
+
+bool tds::plp_stream::gather(span<const uint8_t>& sp, size_t len) {
+    auto n = min(len - pending.size(), sp.size());
+
+    pending.insert(pending.end(), sp.begin(), sp.begin() + (ptrdiff_t)n);
+    sp = sp.subspan(n);
+
+    return pending.size() == len;
+}
+
+bool tds::plp_stream::feed(span<const uint8_t>& sp, const vector<column>& cols, const plp_chunk_handler& handler) {
+    static const uint8_t plp_null[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    static const uint8_t plp_empty[12] = { };
+
+    while (true) {
+        switch (phase) {
+            case 0: { // NBCROW bitmap
+                auto bitset_length = (cols.size() + 7) / 8;
+                auto n = min(bitset_length - row.size(), sp.size());
+
+                row.insert(row.end(), sp.begin(), sp.begin() + (ptrdiff_t)n);
+                sp = sp.subspan(n);
+
+                if (row.size() < bitset_length)
+                    return false;
+
+                phase = 1;
+                break;
+            }
+
+            case 1: { // start of column
+                if (col == cols.size()) {
+                    active = false;
+                    return true;
+                }
+
+                if (nbc && row[col / 8] & (1 << (col % 8))) {
+                    col++;
+                    break;
+                }
+
+                const auto& c = cols[col];
+
+                if (is_plp_col(c)) {
+                    phase = 2;
+                    break;
+                }
+
+                if (pending.empty()) {
+                    auto sp2 = sp;
+
+                    if (!parse_row_col(c.type, c.max_length, sp2)) {
+                        pending.assign(sp.begin(), sp.end());
+                        sp = sp.subspan(sp.size());
+                        return false;
+                    }
+
+                    row.insert(row.end(), sp.data(), sp2.data());
+                    sp = sp2;
+                } else {
+                    auto old_size = pending.size();
+
+                    pending.insert(pending.end(), sp.begin(), sp.end());
+
+                    span<const uint8_t> sp2 = pending;
+
+                    if (!parse_row_col(c.type, c.max_length, sp2)) {
+                        sp = sp.subspan(sp.size());
+                        return false;
+                    }
+
+                    auto used = (size_t)(sp2.data() - pending.data());
+
+                    row.insert(row.end(), pending.begin(), pending.begin() + (ptrdiff_t)used);
+                    sp = sp.subspan(used - old_size);
+                    pending.clear();
+                }
+
+                col++;
+                break;
+            }
+
+            case 2: { // PLP length
+                if (!gather(sp, sizeof(uint64_t)))
+                    return false;
+
+                auto len = *(uint64_t*)pending.data();
+
+                pending.clear();
+
+                if (len == 0xffffffffffffffff) {
+                    row.insert(row.end(), begin(plp_null), end(plp_null));
+                    col++;
+                    phase = 1;
+                } else
+                    phase = 3;
+
+                break;
+            }
+
+            case 3: { // chunk length
+                if (!gather(sp, sizeof(uint32_t)))
+                    return false;
+
+                chunk_left = *(uint32_t*)pending.data();
+
+                pending.clear();
+
+                if (chunk_left == 0) {
+                    if (handler)
+                        handler((uint16_t)col, {});
+
+                    row.insert(row.end(), begin(plp_empty), end(plp_empty));
+                    col++;
+                    phase = 1;
+                } else
+                    phase = 4;
+
+                break;
+            }
+
+            case 4: { // chunk data
+                if (sp.empty())
+                    return false;
+
+                auto n = min((size_t)chunk_left, sp.size());
+
+                if (handler)
+                    handler((uint16_t)col, sp.subspan(0, n));
+
+                sp = sp.subspan(n);
+                chunk_left -= (uint32_t)n;
+
+                if (chunk_left == 0)
+                    phase = 3;
+
+                break;
+            }
+        }
+    }
+}
+
+void handle_plp_row(tds::plp_stream& plp, const vector<tds::column>& cols, tds::row_arena& rows) {
+    span<const uint8_t> sp = plp.row;
+
+    if (plp.nbc)
+        handle_nbcrow(sp, cols, rows);
+    else
+        handle_row(sp, cols, rows);
+}
+
+void init_column_vectors(vector<tds::column_vector>& v, const vector<tds::column>& cols) {
+    v.resize(cols.size());
+
+    for (size_t i = 0; i < cols.size(); i++) {
+        auto& cv = v[i];
+
+        cv.col = cols[i];
+        cv.length = 0;
+        cv.validity.clear();
+        cv.ints.clear();
+        cv.floats.clear();
+        cv.offsets.clear();
+        cv.data.clear();
+        cv.offsets.push_back(0);
+    }
+}
+
+static void set_validity(tds::column_vector& cv, const tds::row_arena& rows, size_t col, size_t first, size_t count) {
+    auto start = cv.length;
+
+    cv.validity.resize((start + count + 7) / 8);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!rows.is_null(first + i, col))
+            cv.validity[(start + i) / 8] |= (uint8_t)(1 << ((start + i) % 8));
+    }
+}
+
+template<typename T, typename U>
+static void append_fixed(vector<U>& dest, const tds::row_arena& rows, size_t col, size_t first, size_t count) {
+    auto start = dest.size();
+
+    dest.resize(start + count);
+
+    auto ptr = dest.data() + start;
+
+    for (size_t i = 0; i < count; i++) {
+        if (rows.is_null(first + i, col))
+            ptr[i] = 0;
         else
-            handle_row_col(get<0>(col), get<1>(col), cols[i].type, cols[i].max_length, sp);
+            ptr[i] = (U)*(T*)rows.value(first + i, col).data();
+    }
+}
+
+static void append_var(tds::column_vector& cv, const tds::row_arena& rows, size_t col, size_t first, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!rows.is_null(first + i, col)) {
+            auto d = rows.value(first + i, col);
+
+            cv.data.insert(cv.data.end(), d.begin(), d.end());
+        }
+
+        cv.offsets.push_back((int64_t)cv.data.size());
+    }
+}
+
+void append_column_vectors(vector<tds::column_vector>& v, const tds::row_arena& rows, size_t first, size_t count) {
+    for (size_t col = 0; col < v.size(); col++) {
+        auto& cv = v[col];
+
+        set_validity(cv, rows, col, first, count);
+
+        switch (cv.col.type) {
+            case tds::sql_type::TINYINT:
+            case tds::sql_type::BIT:
+                append_fixed<uint8_t>(cv.ints, rows, col, first, count);
+            break;
+
+            case tds::sql_type::SMALLINT:
+                append_fixed<int16_t>(cv.ints, rows, col, first, count);
+            break;
+
+            case tds::sql_type::INT:
+                append_fixed<int32_t>(cv.ints, rows, col, first, count);
+            break;
+
+            case tds::sql_type::BIGINT:
+                append_fixed<int64_t>(cv.ints, rows, col, first, count);
+            break;
+
+            case tds::sql_type::INTN:
+            case tds::sql_type::BITN:
+                switch (cv.col.max_length) {
+                    case 1:
+                        append_fixed<uint8_t>(cv.ints, rows, col, first, count);
+                    break;
+
+                    case 2:
+                        append_fixed<int16_t>(cv.ints, rows, col, first, count);
+                    break;
+
+                    case 4:
+                        append_fixed<int32_t>(cv.ints, rows, col, first, count);
+                    break;
+
+                    case 8:
+                        append_fixed<int64_t>(cv.ints, rows, col, first, count);
+                    break;
+
+                    default:
+                        throw formatted_error("INTN has unexpected length {}.", cv.col.max_length);
+                }
+            break;
+
+            case tds::sql_type::REAL:
+                append_fixed<float>(cv.floats, rows, col, first, count);
+            break;
+
+            case tds::sql_type::FLOAT:
+                append_fixed<double>(cv.floats, rows, col, first, count);
+            break;
+
+            case tds::sql_type::FLTN:
+                switch (cv.col.max_length) {
+                    case sizeof(float):
+                        append_fixed<float>(cv.floats, rows, col, first, count);
+                    break;
+
+                    case sizeof(double):
+                        append_fixed<double>(cv.floats, rows, col, first, count);
+                    break;
+
+                    default:
+                        throw formatted_error("FLTN has unexpected length {}.", cv.col.max_length);
+                }
+            break;
+
+            default:
+                append_var(cv, rows, col, first, count);
+            break;
+        }
+
+        cv.length += count;
     }
 }
 
@@ -2099,8 +2543,12 @@ namespace tds {
     tds::tds(const options& opts) {
         impl = make_unique<tds_impl>(opts.server, opts.user, opts.password, opts.app_name, opts.db,
                                      opts.message_handler, opts.count_handler, opts.port,
-                                     opts.encrypt, opts.check_certificate, opts.mars, opts.rate_limit);
+                                     opts.encrypt, opts.check_certificate, opts.mars, opts.rate_limit,
+                                     opts.use_io_uring, opts.event_loop, opts.executor, opts.connect_timeout,
+                                     opts.use_ktls);
 
+        impl->prepared.capacity = opts.prepared_cache_size;
+        impl->prepexec = opts.prepexec;
         codepage = opts.codepage;
 
         if (codepage == 0) {
@@ -2124,8 +2572,19 @@ namespace tds {
     tds_impl::tds_impl(const string& server, string_view user, string_view password,
                        string_view app_name, string_view db, const msg_handler& message_handler,
                        const func_count_handler& count_handler, uint16_t port, encryption_type enc,
-                       bool check_certificate, bool mars, unsigned int rate_limit) :
-                       message_handler(message_handler), count_handler(count_handler), check_certificate(check_certificate), rate_limit(rate_limit) {
+                       bool check_certificate, bool mars, unsigned int rate_limit, bool use_io_uring,
+                       reactor* event_loop, const resume_handler& executor, chrono::milliseconds connect_timeout,
+                       bool use_ktls) :
+                       message_handler(message_handler), count_handler(count_handler), check_certificate(check_certificate),
+                       rate_limit(rate_limit), use_io_uring(use_io_uring), use_ktls(use_ktls), executor(executor) {
+        if (event_loop) {
+            // the reactor threads can't block waiting for the client to catch up
+            if (rate_limit != 0)
+                throw runtime_error("rate_limit is not supported when using a reactor.");
+
+            this->event_loop = event_loop->impl.get();
+        }
+
 #ifdef _WIN32
         WSADATA wsa_data;
 
@@ -2155,8 +2614,9 @@ namespace tds {
             } while (true);
         } else {
 #endif
-            connect(server, port, user.empty());
+            connect(server, port, user.empty(), connect_timeout);
             hostname = server;
+            this->port = port;
 
 #ifdef _WIN32
             u_long mode = 1;
@@ -2175,7 +2635,11 @@ namespace tds {
         enc = encryption_type::ENCRYPT_NOT_SUP;
 #endif
 
-        t = jthread([this](stop_token stop) { socket_thread_wrap(stop); });
+        if (event_loop) {
+            event_loop_state = make_unique<socket_state>();
+            this->event_loop->add(*this);
+        } else
+            t = jthread([this](stop_token stop) { socket_thread_wrap(stop); });
 
         try {
             send_prelogin_msg(enc, mars);
@@ -2183,6 +2647,15 @@ namespace tds {
 #if defined(WITH_OPENSSL) || defined(_WIN32)
             if (server_enc != encryption_type::ENCRYPT_NOT_SUP) {
                 ssl = make_unique<tds_ssl>(*this);
+
+#if defined(WITH_OPENSSL) && !defined(_WIN32)
+                // if the kernel's taken over, we can read and write the socket as if it were unencrypted
+                if (use_ktls && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ)) {
+                    if (ssl->enable_ktls())
+                        ssl.reset();
+                }
+#endif
+
                 mess_event.set();
             }
 #endif
@@ -2197,8 +2670,14 @@ namespace tds {
             if (this->mars)
                 mars_sess = make_unique<smp_session>(*this);
         } catch (...) {
-            t.request_stop();
-            mess_event.set();
+            if (this->event_loop) {
+                event_loop_stop.request_stop();
+                this->event_loop->remove(*this);
+            } else {
+                t.request_stop();
+                mess_event.set();
+            }
+
             throw;
         }
     }
@@ -2207,13 +2686,25 @@ namespace tds {
         try {
             socket_thread(stop);
         } catch (...) {
-            {
-                lock_guard lg(sess.mess_in_lock);
-                sess.socket_thread_exc = current_exception();
-            }
+            socket_thread_finished(current_exception());
+            return;
         }
 
-        sess.mess_in_cv.notify_all();
+        socket_thread_finished(nullptr);
+    }
+
+    void tds_impl::socket_thread_finished(exception_ptr exc) noexcept {
+        {
+            lock_guard lg(sess.mess_in_lock);
+
+            if (exc)
+                sess.socket_thread_exc = exc;
+
+            sess.mess_in.close();
+
+            if (sess.waiter)
+                pending_resumes.push_back(exchange(sess.waiter, nullptr));
+        }
 
         if (mars_sess) {
             lock_guard lg(mars_lock);
@@ -2223,71 +2714,179 @@ namespace tds {
 
                 {
                     lock_guard lg(sess.mess_in_lock);
-                    sess.socket_thread_exc = current_exception();
-                }
 
-                sess.mess_in_cv.notify_all();
+                    if (exc)
+                        sess.socket_thread_exc = exc;
+
+                    sess.mess_in.close();
+
+                    if (sess.waiter)
+                        pending_resumes.push_back(exchange(sess.waiter, nullptr));
+                }
             }
         }
+
+        try {
+            resume_waiters();
+        } catch (...) {
+        }
     }
 
-    void tds_impl::socket_thread_read(ringbuf& in_buf) {
-        uint8_t buf[4096];
+    void tds_impl::resume_waiters() {
+        auto waiters = move(pending_resumes);
 
-        do {
-            size_t to_read = min(in_buf.available(), sizeof(buf));
+        pending_resumes.clear();
 
-            if (to_read == 0)
-                break;
+        for (auto h : waiters) {
+            if (executor)
+                executor(h);
+            else {
+                // Never freed, as it may be running a coroutine at exit, and it
+                // mustn't be destroyed from a coroutine which owns the last connection.
+                static auto default_executor = new resume_thread;
 
-            auto ret = recv(sock, (char*)buf, (int)to_read, 0);
+                default_executor->post(h);
+            }
+        }
+    }
+
+    resume_thread::resume_thread() {
+        t = jthread([this]() {
+            name_thread("tdscpp resume");
+
+            do {
+                coroutine_handle<> h;
+
+                {
+                    unique_lock ul(lock);
+
+                    cv.wait(ul, [&]() { return !queue.empty(); });
+
+                    h = queue.front();
+                    queue.pop_front();
+                }
+
+                h.resume();
+            } while (true);
+        });
+    }
+
+    void resume_thread::post(coroutine_handle<> h) {
+        {
+            lock_guard lg(lock);
+
+            queue.push_back(h);
+        }
+
+        cv.notify_one();
+    }
+
+    // returns false if the server has closed the connection in a way we can't otherwise see
+    bool tds_impl::socket_thread_read(ringbuf& in_buf) {
+        do {
+            auto bufs = in_buf.free_spans();
+            size_t to_read = bufs[0].size() + bufs[1].size();
+
+            if (to_read == 0)
+                break;
+
+            // read straight into the ringbuf, filling both halves of the wrap in one call
 
-            if (ret < 0) {
 #ifdef _WIN32
+            array<WSABUF, 2> wsabufs;
+            DWORD num_bufs = bufs[1].empty() ? 1 : 2, flags = 0, read;
+
+            for (unsigned int i = 0; i < num_bufs; i++) {
+                wsabufs[i].buf = (char*)bufs[i].data();
+                wsabufs[i].len = (ULONG)bufs[i].size();
+            }
+
+            if (WSARecv(sock, wsabufs.data(), num_bufs, &read, &flags, nullptr, nullptr) != 0) {
                 if (WSAGetLastError() == WSAEWOULDBLOCK)
                     break;
 
-                throw formatted_error("recv failed (error {})", wsa_error_to_string(WSAGetLastError()));
+                throw formatted_error("WSARecv failed (error {})", wsa_error_to_string(WSAGetLastError()));
+            }
+
+            size_t ret = read;
 #else
+            array<struct iovec, 2> iov;
+            int num_bufs = bufs[1].empty() ? 1 : 2;
+
+            for (int i = 0; i < num_bufs; i++) {
+                iov[i].iov_base = bufs[i].data();
+                iov[i].iov_len = bufs[i].size();
+            }
+
+            auto ret = readv(sock, iov.data(), num_bufs);
+
+            if (ret < 0) {
                 if (errno == EWOULDBLOCK)
                     break;
 
-                throw formatted_error("recv failed (error {})", errno_to_string(errno));
-#endif
+                // With kTLS, a record that isn't application data, such as the server's
+                // close_notify or any other alert, fails the read with EIO.
+                if (errno == EIO && ktls)
+                    return false;
+
+                throw formatted_error("readv failed (error {})", errno_to_string(errno));
             }
+#endif
 
             if (ret == 0)
                 break;
 
-            in_buf.write(span(buf, ret));
+            in_buf.commit((size_t)ret);
+
+            if ((size_t)ret < to_read) // socket drained
+                break;
         } while (true);
+
+        return true;
     }
 
     bool tds_impl::socket_thread_write() {
-        while (!mess_out_buf.empty()) {
-            auto ret = send(sock, (char*)mess_out_buf.data(), (int)mess_out_buf.size(), 0);
+        while (!mess_out.empty()) {
+            array<span<const uint8_t>, 64> bufs;
+
+            auto num_bufs = mess_out.gather(bufs);
 
-            if (ret < 0) {
 #ifdef _WIN32
+            array<WSABUF, bufs.size()> wsabufs;
+            DWORD sent;
+
+            for (size_t i = 0; i < num_bufs; i++) {
+                wsabufs[i].buf = (char*)bufs[i].data();
+                wsabufs[i].len = (ULONG)bufs[i].size();
+            }
+
+            if (WSASend(sock, wsabufs.data(), (DWORD)num_bufs, &sent, 0, nullptr, nullptr) != 0) {
                 if (WSAGetLastError() == WSAEWOULDBLOCK)
                     return false;
 
-                throw formatted_error("send failed (error {})", wsa_error_to_string(WSAGetLastError()));
+                throw formatted_error("WSASend failed (error {})", wsa_error_to_string(WSAGetLastError()));
+            }
+
+            size_t ret = sent;
 #else
-                if (errno == EWOULDBLOCK)
-                    return false;
+            array<struct iovec, bufs.size()> iov;
 
-                throw formatted_error("send failed (error {})", errno_to_string(errno));
-#endif
+            for (size_t i = 0; i < num_bufs; i++) {
+                iov[i].iov_base = (void*)bufs[i].data();
+                iov[i].iov_len = bufs[i].size();
             }
 
-            if (ret == (int)mess_out_buf.size()) {
-                mess_out_buf.clear();
-                break;
+            auto ret = writev(sock, iov.data(), (int)num_bufs);
+
+            if (ret < 0) {
+                if (errno == EWOULDBLOCK)
+                    return false;
+
+                throw formatted_error("writev failed (error {})", errno_to_string(errno));
             }
+#endif
 
-            vector<uint8_t> newbuf{mess_out_buf.begin() + ret, mess_out_buf.end()};
-            mess_out_buf.swap(newbuf);
+            mess_out.consume((size_t)ret);
         }
 
         return true;
@@ -2301,7 +2900,7 @@ namespace tds {
 
             if ((uint8_t)h.type == 0x53) {
                 if (in_buf.size() < sizeof(smp_header))
-                    return;
+                    break;
 
                 smp_header smp;
 
@@ -2321,11 +2920,10 @@ namespace tds {
                     throw formatted_error("SMP message length was {}, expected at least {}", smp.length, sizeof(smp_header));
 
                 if (in_buf.size() < smp.length)
-                    return;
+                    break;
 
-                vector<uint8_t> buf;
+                auto buf = pool.get(smp.length);
 
-                buf.resize(smp.length);
                 in_buf.read(buf);
 
                 {
@@ -2340,6 +2938,8 @@ namespace tds {
                         }
                     }
                 }
+
+                pool.put(move(buf));
             } else {
                 auto len = htons(h.length);
 
@@ -2347,7 +2947,7 @@ namespace tds {
                     throw formatted_error("message length was {}, expected at least {}", len, sizeof(tds_header));
 
                 if (in_buf.size() < len)
-                    return;
+                    break;
 
                 in_buf.discard(sizeof(tds_header));
 
@@ -2356,7 +2956,7 @@ namespace tds {
                 m.type = h.type;
 
                 if (len >= sizeof(tds_header)) {
-                    m.payload.resize(len - sizeof(tds_header));
+                    m.payload = pool.get(len - sizeof(tds_header));
                     in_buf.read(m.payload);
                 }
 
@@ -2364,22 +2964,25 @@ namespace tds {
 
                 spid = htons(h.spid);
 
-                {
-                    unique_lock ul(sess.mess_in_lock);
-
-                    if (rate_limit != 0) {
-                        sess.rate_limit_cv.wait(ul, stop, [&]() { return sess.mess_list.size() < rate_limit; });
+                if (rate_limit != 0 && sess.mess_in.size() >= rate_limit) {
+                    resume_waiters();
 
-                        if (stop.stop_requested())
-                            return;
-                    }
+                    sess.mess_in.wait_for_space(rate_limit, stop);
 
-                    sess.mess_list.emplace_back(move(m));
+                    if (stop.stop_requested())
+                        break;
                 }
 
-                sess.mess_in_cv.notify_one();
+                if (sess.mess_in.push(move(m))) {
+                    lock_guard lg(sess.mess_in_lock);
+
+                    if (sess.waiter)
+                        pending_resumes.push_back(exchange(sess.waiter, nullptr));
+                }
             }
         }
+
+        resume_waiters();
     }
 
 #if defined(WITH_OPENSSL) || defined(_WIN32)
@@ -2398,7 +3001,7 @@ namespace tds {
         while (true) {
             unique_lock lock(mess_out_lock);
 
-            if (mess_out_buf.empty())
+            if (mess_out.empty())
                 return;
 
             lock.unlock();
@@ -2415,8 +3018,11 @@ namespace tds {
 
             lock.lock();
 
-            auto ret = WriteFile(pipe.get(), mess_out_buf.data(), (DWORD)mess_out_buf.size(),
-                                 &tmp, &async);
+            span<const uint8_t> buf;
+
+            mess_out.gather(span(&buf, 1));
+
+            auto ret = WriteFile(pipe.get(), buf.data(), (DWORD)buf.size(), &tmp, &async);
 
             if (!ret && GetLastError() != ERROR_IO_PENDING)
                 throw last_error("WriteFile", GetLastError());
@@ -2424,25 +3030,284 @@ namespace tds {
             if (!GetOverlappedResult(pipe.get(), &async, &written, true))
                 throw last_error("GetOverlappedResult", GetLastError());
 
-            if (written > 0) {
-                vector<uint8_t> newbuf{mess_out_buf.data() + written, mess_out_buf.data() + mess_out_buf.size()};
-                mess_out_buf.swap(newbuf);
-            }
+            mess_out.consume(written);
 
-            if (mess_out_buf.empty())
+            if (mess_out.empty())
                 return;
         }
     }
 #endif
 
+#ifdef WITH_IO_URING
+    enum class uring_op : uint64_t {
+        recv = 1,
+        send,
+        event,
+        cancel
+    };
+
+    bool tds_impl::socket_thread_uring(stop_token stop, ringbuf& in_buf, const function<void()>& on_read,
+                                       const function<void()>& on_event) {
+        optional<uring> ring;
+
+        try {
+            ring.emplace(8);
+        } catch (...) {
+            return false; // not supported by kernel, or disabled by sysctl - fall back to epoll
+        }
+
+        // On a non-blocking socket, io_uring fails reads with EAGAIN rather than waiting
+        // for data itself, which would mean a poll and another read each time we're idle.
+
+        if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK) != 0)
+            throw formatted_error("fcntl failed to make socket blocking (error {})", errno_to_string(errno));
+
+        auto storage = in_buf.storage();
+        struct iovec fixed_iov = { storage.data(), storage.size() };
+        bool use_fixed = ring->register_buffers(span(&fixed_iov, 1));
+        array<struct iovec, 2> recv_iov;
+        array<struct iovec, 64> send_iov;
+        uint64_t event_val;
+        bool recv_pending = false, send_pending = false, event_pending = false;
+
+        auto queue_recv = [&]() {
+            auto bufs = in_buf.free_spans();
+
+            if (bufs[0].empty())
+                throw runtime_error("Receive buffer full.");
+
+            auto sqe = ring->get_sqe();
+
+            sqe->fd = sock;
+            sqe->user_data = (uint64_t)uring_op::recv;
+
+            // READ_FIXED only takes one buffer, so use READV if the free space wraps
+
+            if (use_fixed && bufs[1].empty()) {
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->addr = (uintptr_t)bufs[0].data();
+                sqe->len = (uint32_t)bufs[0].size();
+                sqe->buf_index = 0;
+            } else {
+                unsigned int num_bufs = bufs[1].empty() ? 1 : 2;
+
+                for (unsigned int i = 0; i < num_bufs; i++) {
+                    recv_iov[i].iov_base = bufs[i].data();
+                    recv_iov[i].iov_len = bufs[i].size();
+                }
+
+                sqe->opcode = IORING_OP_READV;
+                sqe->addr = (uintptr_t)recv_iov.data();
+                sqe->len = num_bufs;
+            }
+
+            sqe->off = (uint64_t)-1; // current position, as this is a socket
+
+            recv_pending = true;
+        };
+
+        // caller holds mess_out_lock
+        auto queue_send = [&]() {
+            array<span<const uint8_t>, send_iov.size()> bufs;
+
+            auto num_bufs = mess_out.gather(bufs);
+
+            for (size_t i = 0; i < num_bufs; i++) {
+                send_iov[i].iov_base = (void*)bufs[i].data();
+                send_iov[i].iov_len = bufs[i].size();
+            }
+
+            auto sqe = ring->get_sqe();
+
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = sock;
+            sqe->addr = (uintptr_t)send_iov.data();
+            sqe->len = (uint32_t)num_bufs;
+            sqe->off = (uint64_t)-1;
+            sqe->user_data = (uint64_t)uring_op::send;
+
+            send_pending = true;
+        };
+
+        auto queue_event = [&]() {
+            auto sqe = ring->get_sqe();
+
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = mess_event.h.get();
+            sqe->addr = (uintptr_t)&event_val;
+            sqe->len = sizeof(event_val);
+            sqe->off = (uint64_t)-1;
+            sqe->user_data = (uint64_t)uring_op::event;
+
+            event_pending = true;
+        };
+
+        // The kernel may still write into in_buf, event_val, or read the iovecs
+        // after the ring is closed, so cancel anything outstanding and wait for it
+        // before we return.
+
+        struct drain_guard {
+            drain_guard(const function<void()>& func) : func(func) { }
+
+            ~drain_guard() {
+                try {
+                    func();
+                } catch (...) {
+                }
+            }
+
+            const function<void()>& func;
+        };
+
+        function<void()> drain = [&]() {
+            for (auto op : { uring_op::recv, uring_op::send, uring_op::event }) {
+                auto sqe = ring->get_sqe();
+
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)op;
+                sqe->user_data = (uint64_t)uring_op::cancel;
+            }
+
+            while (recv_pending || send_pending || event_pending) {
+                ring->submit(1);
+
+                struct io_uring_cqe cqe;
+
+                while (ring->peek_cqe(cqe)) {
+                    switch ((uring_op)cqe.user_data) {
+                        case uring_op::recv:
+                            recv_pending = false;
+                            break;
+
+                        case uring_op::send:
+                            send_pending = false;
+                            break;
+
+                        case uring_op::event:
+                            event_pending = false;
+                            break;
+
+                        default:
+                            break;
+                    }
+                }
+            }
+        };
+
+        drain_guard dg(drain);
+
+        queue_recv();
+        queue_event();
+
+        {
+            lock_guard lg(mess_out_lock);
+
+            if (!mess_out.empty())
+                queue_send();
+        }
+
+        while (!stop.stop_requested()) {
+            ring->submit(1);
+
+            struct io_uring_cqe cqe;
+
+            while (ring->peek_cqe(cqe)) {
+                switch ((uring_op)cqe.user_data) {
+                    case uring_op::recv:
+                        if (cqe.res == -EINTR) {
+                            queue_recv();
+                            break;
+                        } else if (cqe.res == -EIO && ktls) { // alert from the server, see socket_thread_read
+                            recv_pending = false;
+                            connected = false;
+                            return true;
+                        } else if (cqe.res < 0)
+                            throw formatted_error("read failed (error {})", errno_to_string(-cqe.res));
+
+                        recv_pending = false;
+
+                        if (cqe.res == 0) {
+                            connected = false;
+                            return true;
+                        }
+
+                        in_buf.commit((size_t)cqe.res);
+
+                        on_read();
+
+                        if (stop.stop_requested())
+                            return true;
+
+                        queue_recv();
+                        break;
+
+                    case uring_op::send: {
+                        lock_guard lg(mess_out_lock);
+
+                        if (cqe.res < 0 && cqe.res != -EINTR)
+                            throw formatted_error("writev failed (error {})", errno_to_string(-cqe.res));
+
+                        send_pending = false;
+
+                        if (cqe.res > 0)
+                            mess_out.consume((size_t)cqe.res);
+
+                        if (!mess_out.empty())
+                            queue_send();
+
+                        break;
+                    }
+
+                    case uring_op::event: {
+                        event_pending = false;
+
+                        if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN)
+                            throw formatted_error("read failed (error {})", errno_to_string(-cqe.res));
+
+                        on_event();
+
+                        if (stop.stop_requested())
+                            return true;
+
+                        queue_event();
+
+                        lock_guard lg(mess_out_lock);
+
+                        if (!send_pending && !mess_out.empty())
+                            queue_send();
+
+                        break;
+                    }
+
+                    default:
+                        break;
+                }
+            }
+        }
+
+        return true;
+    }
+#endif
+
     void tds_impl::socket_thread(stop_token stop) {
         name_thread("tdscpp thread");
 
+        socket_state st;
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+        auto& do_ssl = st.do_ssl;
+
+        do_ssl = ssl && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ);
+#endif
+
+        // the epoll loop gets at these through st instead
+#if defined(_WIN32) || defined(WITH_IO_URING)
+        auto& in_buf = st.in_buf;
 #if defined(WITH_OPENSSL) || defined(_WIN32)
-        bool do_ssl = ssl && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ);
-        ringbuf pt_buf(65536);
+        auto& pt_buf = st.pt_buf;
+#endif
 #endif
-        ringbuf in_buf(65536);
 
 #ifdef _WIN32
         if (pipe.get() != INVALID_HANDLE_VALUE) {
@@ -2554,28 +3419,51 @@ namespace tds {
                     {
                         lock_guard lg(mess_out_lock);
 
-                        if (can_write && !mess_out_buf.empty())
+                        if (can_write && !mess_out.empty())
                             can_write = socket_thread_write();
                     }
                 }
             }
         }
 #else
+#ifdef WITH_IO_URING
+        if (use_io_uring) {
+            auto on_read = [&]() {
+#ifdef WITH_OPENSSL
+                if (do_ssl) {
+                    decrypt_messages(in_buf, pt_buf);
+                    socket_thread_parse_messages(stop, pt_buf);
+                } else
+#endif
+                    socket_thread_parse_messages(stop, in_buf);
+            };
+
+            auto on_event = [&]() {
+#ifdef WITH_OPENSSL
+                do_ssl = ssl && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ);
+#endif
+            };
+
+            if (socket_thread_uring(stop, in_buf, on_read, on_event))
+                return;
+        }
+#endif
+
         unique_handle epoll{epoll_create1(EPOLL_CLOEXEC)};
 
         if (epoll.get() == -1)
             throw formatted_error("epoll_create1 failed (error {})", errno_to_string(errno));
 
-        array<struct epoll_event, 2> evs;
+        st.epoll_fd = epoll.get();
+        st.sock_ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        st.sock_ev.data.fd = sock;
 
-        bool poll_out = true;
+        struct epoll_event event_ev;
 
-        evs[0].events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
-        evs[0].data.fd = sock;
-        evs[1].events = EPOLLIN;
-        evs[1].data.fd = mess_event.h.get();
+        event_ev.events = EPOLLIN;
+        event_ev.data.fd = mess_event.h.get();
 
-        for (auto& e : evs) {
+        for (auto e : { st.sock_ev, event_ev }) {
             if (epoll_ctl(epoll.get(), EPOLL_CTL_ADD, e.data.fd, &e) == -1)
                 throw formatted_error("epoll_ctl failed (error {})", errno_to_string(errno));
         }
@@ -2594,65 +3482,301 @@ namespace tds {
 
             if (ret != 0) {
                 if (ev.data.fd == sock) {
-                    if (ev.events & EPOLLIN) {
-                        socket_thread_read(in_buf);
+                    if (!socket_thread_sock_event(stop, ev.events, st)) {
+                        connected = false;
 
-#ifdef WITH_OPENSSL
-                        if (do_ssl) {
-                            decrypt_messages(in_buf, pt_buf);
-                            socket_thread_parse_messages(stop, pt_buf);
-                        } else
-#endif
-                            socket_thread_parse_messages(stop, in_buf);
+                        break;
                     }
+                } else if (ev.data.fd == mess_event.h.get())
+                    socket_thread_mess_event(st);
+            }
+        }
+#endif
+    }
 
-                    if (ev.events & EPOLLOUT) {
-                        lock_guard lg(mess_out_lock);
+#ifndef _WIN32
+    // returns false if the server has hung up
+    bool tds_impl::socket_thread_sock_event(stop_token stop, uint32_t events, socket_state& st) {
+        if (events & EPOLLIN) {
+            auto open = socket_thread_read(st.in_buf);
 
-                        socket_thread_write();
+#ifdef WITH_OPENSSL
+            if (st.do_ssl) {
+                decrypt_messages(st.in_buf, st.pt_buf);
+                socket_thread_parse_messages(stop, st.pt_buf);
+            } else
+#endif
+                socket_thread_parse_messages(stop, st.in_buf);
 
-                        if (mess_out_buf.empty()) {
-                            auto& e = evs[0];
+            // parse whatever arrived before the alert first
+            if (!open)
+                return false;
+        }
 
-                            e.events &= ~EPOLLOUT;
+        if (events & EPOLLOUT) {
+            lock_guard lg(mess_out_lock);
 
-                            if (epoll_ctl(epoll.get(), EPOLL_CTL_MOD, e.data.fd, &e) == -1)
-                                throw formatted_error("epoll_ctl failed (error {})", errno_to_string(errno));
+            socket_thread_write();
 
-                            poll_out = false;
-                        }
-                    }
+            if (mess_out.empty())
+                socket_thread_poll_out(st, false);
+        }
 
-                    if (ev.events & (EPOLLRDHUP | EPOLLHUP)) {
-                        connected = false;
+        if (events & (EPOLLRDHUP | EPOLLHUP))
+            return false;
 
-                        break;
-                    }
-                } else if (ev.data.fd == mess_event.h.get()) {
-                    mess_event.reset();
+        return true;
+    }
+
+    void tds_impl::socket_thread_mess_event(socket_state& st) {
+        mess_event.reset();
 
 #ifdef WITH_OPENSSL
-                    do_ssl = ssl && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ);
+        st.do_ssl = ssl && (server_enc == encryption_type::ENCRYPT_ON || server_enc == encryption_type::ENCRYPT_REQ);
 #endif
 
-                    {
-                        lock_guard lg(mess_out_lock);
+        lock_guard lg(mess_out_lock);
 
-                        if (!poll_out && !mess_out_buf.empty()) {
-                            auto& e = evs[0];
+        if (!st.poll_out && !mess_out.empty())
+            socket_thread_poll_out(st, true);
+    }
 
-                            e.events |= EPOLLOUT;
+    void tds_impl::socket_thread_poll_out(socket_state& st, bool poll_out) {
+        if (poll_out)
+            st.sock_ev.events |= EPOLLOUT;
+        else
+            st.sock_ev.events &= ~EPOLLOUT;
 
-                            if (epoll_ctl(epoll.get(), EPOLL_CTL_MOD, e.data.fd, &e) == -1)
-                                throw formatted_error("epoll_ctl failed (error {})", errno_to_string(errno));
+        if (epoll_ctl(st.epoll_fd, EPOLL_CTL_MOD, sock, &st.sock_ev) == -1)
+            throw formatted_error("epoll_ctl failed (error {})", errno_to_string(errno));
 
-                            poll_out = true;
-                        }
+        st.poll_out = poll_out;
+    }
+#endif
+
+#ifdef _WIN32
+    reactor_impl::reactor_impl(unsigned int) {
+        throw runtime_error("tds::reactor is not supported on Windows.");
+    }
+
+    void reactor_impl::add(tds_impl&) {
+    }
+
+    void reactor_impl::remove(tds_impl&) noexcept {
+    }
+#else
+    reactor_impl::reactor_impl(unsigned int num_threads) {
+        if (num_threads == 0)
+            throw runtime_error("tds::reactor needs at least one thread.");
+
+        for (unsigned int i = 0; i < num_threads; i++) {
+            auto& rt = *threads.emplace_back(make_unique<reactor_thread>());
+
+            rt.epoll.reset(epoll_create1(EPOLL_CLOEXEC));
+
+            if (rt.epoll.get() == -1)
+                throw formatted_error("epoll_create1 failed (error {})", errno_to_string(errno));
+
+            struct epoll_event ev;
+
+            ev.events = EPOLLIN;
+            ev.data.u64 = 0;
+
+            if (epoll_ctl(rt.epoll.get(), EPOLL_CTL_ADD, rt.wake.h.get(), &ev) == -1)
+                throw formatted_error("epoll_ctl failed (error {})", errno_to_string(errno));
+
+            rt.t = jthread([this, &rt](stop_token stop) {
+                try {
+                    run(stop, rt);
+                } catch (...) {
+                    lock_guard lg(rt.lock);
+
+                    for (auto conn : rt.conns) {
+                        conn->socket_thread_finished(current_exception());
+                    }
+
+                    rt.finished = true;
+                    rt.removals.clear();
+                    rt.removed_cv.notify_all();
+                }
+            });
+        }
+    }
+
+    reactor_thread::~reactor_thread() {
+        if (!t.joinable())
+            return;
+
+        t.request_stop();
+
+        try {
+            wake.set();
+        } catch (...) {
+        }
+
+        t.join();
+    }
+
+    // Each connection adds two fds to the epoll: its socket, tagged with the
+    // pointer to its tds_impl, and its mess_event, tagged with the pointer | 1.
+
+    void reactor_impl::add(tds_impl& conn) {
+        reactor_thread* rt = nullptr;
+        size_t best;
+
+        for (auto& t : threads) {
+            lock_guard lg(t->lock);
+
+            if (t->finished)
+                continue;
+
+            if (!rt || t->conns.size() < best) {
+                rt = t.get();
+                best = t->conns.size();
+            }
+        }
+
+        if (!rt)
+            throw runtime_error("No reactor threads are running.");
+
+        auto& st = *conn.event_loop_state;
+
+        st.epoll_fd = rt->epoll.get();
+        st.sock_ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        st.sock_ev.data.u64 = (uintptr_t)&conn;
+        st.poll_out = true;
+
+        struct epoll_event event_ev;
+
+        event_ev.events = EPOLLIN;
+        event_ev.data.u64 = (uintptr_t)&conn | 1;
+
+        unique_lock ul(rt->lock, defer_lock);
+
+        if (this_thread::get_id() != rt->t.get_id())
+            ul.lock();
+
+        conn.event_loop_thread = rt;
+        rt->conns.insert(&conn);
+
+        if (epoll_ctl(rt->epoll.get(), EPOLL_CTL_ADD, conn.sock, &st.sock_ev) == -1) {
+            auto err = errno;
+
+            rt->conns.erase(&conn);
+            throw formatted_error("epoll_ctl failed (error {})", errno_to_string(err));
+        }
+
+        if (epoll_ctl(rt->epoll.get(), EPOLL_CTL_ADD, conn.mess_event.h.get(), &event_ev) == -1) {
+            auto err = errno;
+
+            epoll_ctl(rt->epoll.get(), EPOLL_CTL_DEL, conn.sock, nullptr);
+            rt->conns.erase(&conn);
+            throw formatted_error("epoll_ctl failed (error {})", errno_to_string(err));
+        }
+    }
+
+    void reactor_impl::detach(reactor_thread& rt, tds_impl& conn) noexcept {
+        if (rt.conns.erase(&conn) == 0)
+            return;
+
+        epoll_ctl(rt.epoll.get(), EPOLL_CTL_DEL, conn.sock, nullptr);
+        epoll_ctl(rt.epoll.get(), EPOLL_CTL_DEL, conn.mess_event.h.get(), nullptr);
+    }
+
+    void reactor_impl::remove(tds_impl& conn) noexcept {
+        if (!conn.event_loop_thread)
+            return;
+
+        auto& rt = *conn.event_loop_thread;
+
+        if (this_thread::get_id() == rt.t.get_id()) {
+            detach(rt, conn);
+            return;
+        }
+
+        // Hand the removal to the reactor thread, so that once we return it can't
+        // be holding any stale events for this connection.
+
+        unique_lock ul(rt.lock);
+
+        if (rt.finished)
+            return;
+
+        rt.removals.push_back(&conn);
+
+        try {
+            rt.wake.set();
+        } catch (...) {
+        }
+
+        rt.removed_cv.wait(ul, [&]() {
+            return find(rt.removals.begin(), rt.removals.end(), &conn) == rt.removals.end();
+        });
+    }
+
+    void reactor_impl::run(stop_token stop, reactor_thread& rt) {
+        name_thread("tdscpp reactor");
+
+        array<struct epoll_event, 64> evs;
+
+        while (!stop.stop_requested()) {
+            auto ret = epoll_wait(rt.epoll.get(), evs.data(), (int)evs.size(), -1);
+
+            if (ret == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                throw formatted_error("epoll_wait failed (error {})", errno_to_string(errno));
+            }
+
+            lock_guard lg(rt.lock);
+
+            for (int i = 0; i < ret; i++) {
+                const auto& ev = evs[i];
+
+                if (ev.data.u64 == 0) {
+                    rt.wake.reset();
+                    continue;
+                }
+
+                auto& conn = *(tds_impl*)(uintptr_t)(ev.data.u64 & ~(uint64_t)1);
+
+                if (!rt.conns.contains(&conn)) // detached earlier in this batch
+                    continue;
+
+                try {
+                    if (ev.data.u64 & 1)
+                        conn.socket_thread_mess_event(*conn.event_loop_state);
+                    else if (!conn.socket_thread_sock_event(conn.event_loop_stop.get_token(), ev.events,
+                                                            *conn.event_loop_state)) {
+                        conn.connected = false;
+                        detach(rt, conn);
+                        conn.socket_thread_finished(nullptr);
                     }
+                } catch (...) {
+                    detach(rt, conn);
+                    conn.socket_thread_finished(current_exception());
+                }
+            }
+
+            if (!rt.removals.empty()) {
+                for (auto conn : rt.removals) {
+                    detach(rt, *conn);
                 }
+
+                rt.removals.clear();
+                rt.removed_cv.notify_all();
             }
         }
+    }
 #endif
+
+    reactor::reactor(unsigned int num_threads) {
+        impl = make_unique<reactor_impl>(num_threads);
+    }
+
+    reactor::~reactor() {
+        // needs to be defined for unique_ptr<reactor_impl> to work
     }
 
     smp_session::smp_session(tds_impl& impl) : impl(impl) {
@@ -2712,10 +3836,20 @@ namespace tds {
         }
     }
 
-    void smp_session::send_msg(enum tds_msg type, span<const uint8_t> msg) {
-        vector<uint8_t> buf;
+    // RESETCONNECTION goes on the first packet of the next request, once the
+    // connection has been returned to a pool
+    static uint8_t reset_status(tds_impl& impl, enum tds_msg type) {
+        if (!impl.reset_pending || (type != tds_msg::sql_batch && type != tds_msg::rpc && type != tds_msg::trans_man_req))
+            return 0;
+
+        impl.reset_pending = false;
 
+        return 8;
+    }
+
+    void smp_session::send_msg(enum tds_msg type, span<const uint8_t> msg) {
         do {
+            vector<uint8_t> buf;
             size_t to_send = min(msg.size(), impl.packet_size - sizeof(tds_header));
 
             buf.reserve(sizeof(smp_header) + sizeof(tds_header) + to_send);
@@ -2735,7 +3869,7 @@ namespace tds {
             auto& h2 = *(tds_header*)(buf.data() + sizeof(smp_header));
 
             h2.type = type;
-            h2.status = to_send == msg.size() ? 1 : 0; // 1 == last message
+            h2.status = (to_send == msg.size() ? 1 : 0) | reset_status(impl, type); // 1 == last message
             h2.length = htons((uint16_t)(to_send + sizeof(tds_header)));
             h2.spid = 0;
             h2.packet_id = 0; // FIXME? "Currently ignored" according to spec
@@ -2743,39 +3877,57 @@ namespace tds {
 
             buf.insert(buf.end(), msg.data(), msg.data() + to_send);
 
-            impl.sess.send_raw(buf);
+            impl.sess.send_raw(move(buf));
 
             msg = msg.subspan(to_send);
         } while (!msg.empty());
     }
 
-    void smp_session::wait_for_msg(enum tds_msg& type, vector<uint8_t>& payload, bool* last_packet) {
-        mess m;
+    void smp_session::send_packet(enum tds_msg type, span<const uint8_t> msg, uint8_t status) {
+        vector<uint8_t> buf;
 
-        {
-            unique_lock ul(mess_in_lock);
+        buf.reserve(sizeof(smp_header) + sizeof(tds_header) + msg.size());
+        buf.resize(sizeof(smp_header) + sizeof(tds_header));
 
-            mess_in_cv.wait(ul, [&]() { return !mess_list.empty() || socket_thread_exc || !impl.connected; });
+        auto& h1 = *(smp_header*)buf.data();
 
-            if (!socket_thread_exc && impl.connected) {
-                auto& m2 = mess_list.front();
+        h1.smid = 0x53;
+        h1.flags = smp_message_type::DATA;
+        h1.sid = sid;
+        h1.length = (uint32_t)(sizeof(smp_header) + sizeof(tds_header) + msg.size());
+        h1.seqnum = seqnum;
+        h1.wndw = recv_wndw;
 
-                m.type = m2.type;
-                m.payload.swap(m2.payload);
-                m.last_packet = m2.last_packet;
+        seqnum++;
 
-                mess_list.pop_front();
-            }
-        }
+        auto& h2 = *(tds_header*)(buf.data() + sizeof(smp_header));
+
+        h2.type = type;
+        h2.status = status | reset_status(impl, type);
+        h2.length = htons((uint16_t)(msg.size() + sizeof(tds_header)));
+        h2.spid = 0;
+        h2.packet_id = 0;
+        h2.window = 0;
+
+        buf.insert(buf.end(), msg.data(), msg.data() + msg.size());
+
+        impl.sess.send_raw(move(buf));
+    }
+
+    void smp_session::wait_for_msg(enum tds_msg& type, vector<uint8_t>& payload, bool* last_packet) {
+        mess m;
+
+        mess_in.wait();
 
-        if (socket_thread_exc)
-            rethrow_exception(socket_thread_exc);
+        if (mess_in.closed() || !impl.connected) {
+            if (socket_thread_exc)
+                rethrow_exception(socket_thread_exc);
 
-        if (!impl.connected)
             throw runtime_error("Disconnected.");
+        }
 
-        if (impl.rate_limit != 0)
-            rate_limit_cv.notify_one();
+        if (!mess_in.pop(m))
+            throw runtime_error("Message queue empty.");
 
         type = m.type;
         payload.swap(m.payload);
@@ -2830,135 +3982,281 @@ namespace tds {
                 m.type = h.type;
 
                 if (len >= sizeof(tds_header)) {
-                    m.payload.assign(msg.data() + sizeof(smp_header) + sizeof(tds_header),
-                                     msg.data() + sizeof(smp_header) + len);
+                    m.payload = impl.pool.get(len - sizeof(tds_header));
+                    memcpy(m.payload.data(), msg.data() + sizeof(smp_header) + sizeof(tds_header), m.payload.size());
+                }
+
+                m.last_packet = h.status & 1;
+
+                // FIXME - do SMP sessions have separate SPIDs?
+
+                if (impl.rate_limit != 0 && mess_in.size() >= impl.rate_limit) {
+                    impl.resume_waiters();
+
+                    mess_in.wait_for_space(impl.rate_limit, stop);
+
+                    if (stop.stop_requested())
+                        return;
+                }
+
+                if (mess_in.push(move(m))) {
+                    lock_guard lg(mess_in_lock);
+
+                    if (waiter)
+                        impl.pending_resumes.push_back(exchange(waiter, nullptr));
+                }
+
+                break;
+            }
+
+            default:
+                throw formatted_error("Server sent unexpected SMP message type {:02x}.", (uint8_t)s.flags);
+        }
+    }
+
+    tds_impl::~tds_impl() {
+        if (event_loop) {
+            event_loop_stop.request_stop();
+            event_loop->remove(*this);
+        }
+
+        if (t.joinable()) {
+            t.request_stop();
+
+            try {
+                mess_event.set();
+            } catch (...) {
+            }
+        }
+
+#ifdef _WIN32
+        if (sock != INVALID_SOCKET)
+            closesocket(sock);
+#else
+        if (sock != 0)
+            close(sock);
+#endif
+    }
+
+    // RFC 8305 suggests 250ms
+    static const auto connect_stagger = chrono::milliseconds(250);
+
+    // Starts a non-blocking connect to each address in turn, a short while apart,
+    // and keeps whichever succeeds first - so one which is unreachable, such as
+    // the offline subnet of a multi-subnet availability group listener, doesn't
+    // hold up the rest.
+    void tds_impl::connect(const string& server, uint16_t port, bool get_fqdn, chrono::milliseconds timeout) {
+        struct addrinfo hints;
+        struct addrinfo* res;
+        int ret;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        ret = getaddrinfo(server.c_str(), nullptr, &hints, &res);
+
+        if (ret != 0)
+            throw formatted_error("getaddrinfo returned {}", ret);
+
+        // alternate between address families, starting with the preferred one
+
+        vector<struct addrinfo*> addrs, others;
+
+        for (auto ai = res; ai; ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+                continue;
+
+            if (addrs.empty() || ai->ai_family == addrs.front()->ai_family)
+                addrs.push_back(ai);
+            else
+                others.push_back(ai);
+        }
+
+        for (size_t i = 0; i < others.size(); i++) {
+            addrs.insert(addrs.begin() + (ptrdiff_t)min(i * 2 + 1, addrs.size()), others[i]);
+        }
+
+        vector<struct pollfd> pending;
+        vector<struct addrinfo*> pending_ai;
+        struct addrinfo* connected_ai = nullptr;
+        size_t next = 0;
+        int last_error = 0;
+        auto now = chrono::steady_clock::now();
+        auto deadline = now + timeout;
+        auto next_attempt = now;
+
+#ifdef _WIN32
+        sock = INVALID_SOCKET;
+#else
+        sock = 0;
+#endif
+
+        while (true) {
+            now = chrono::steady_clock::now();
+
+            if (timeout.count() != 0 && now >= deadline)
+                break;
+
+            if (next < addrs.size() && (pending.empty() || now >= next_attempt)) {
+                auto ai = addrs[next];
+
+                next++;
+
+                auto s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+#ifdef _WIN32
+                if (s == INVALID_SOCKET) {
+                    last_error = WSAGetLastError();
+                    continue;
+                }
+
+                u_long mode = 1;
+
+                ioctlsocket(s, FIONBIO, &mode);
+#else
+                if (s < 0) {
+                    last_error = errno;
+                    continue;
+                }
+
+                fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+                if (ai->ai_family == AF_INET)
+                    ((struct sockaddr_in*)ai->ai_addr)->sin_port = htons(port);
+                else
+                    ((struct sockaddr_in6*)ai->ai_addr)->sin6_port = htons(port);
+
+                if (::connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0) {
+                    sock = s;
+                    connected_ai = ai;
+                    break;
+                }
+
+#ifdef _WIN32
+                if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                    last_error = WSAGetLastError();
+                    closesocket(s);
+                    continue;
+                }
+#else
+                if (errno != EINPROGRESS) {
+                    last_error = errno;
+                    close(s);
+                    continue;
                 }
+#endif
 
-                m.last_packet = h.status & 1;
-
-                // FIXME - do SMP sessions have separate SPIDs?
-
-                {
-                    unique_lock ul(mess_in_lock);
-
-                    if (impl.rate_limit != 0) {
-                        rate_limit_cv.wait(ul, stop, [&]() { return mess_list.size() < impl.rate_limit; });
+                pending.push_back({s, POLLOUT, 0});
+                pending_ai.push_back(ai);
+                next_attempt = now + connect_stagger;
 
-                        if (stop.stop_requested())
-                            return;
-                    }
+                continue;
+            }
 
-                    mess_list.emplace_back(move(m));
-                }
+            if (pending.empty())
+                break;
 
-                mess_in_cv.notify_one();
+            // wait until one connects or fails, the next attempt is due, or we time out
 
-                break;
-            }
+            int wait = -1;
 
-            default:
-                throw formatted_error("Server sent unexpected SMP message type {:02x}.", (uint8_t)s.flags);
-        }
-    }
+            if (next < addrs.size() || timeout.count() != 0) {
+                auto until = next < addrs.size() ? next_attempt : deadline;
 
-    tds_impl::~tds_impl() {
-        if (t.joinable()) {
-            t.request_stop();
+                if (timeout.count() != 0 && deadline < until)
+                    until = deadline;
 
-            try {
-                mess_event.set();
-            } catch (...) {
+                wait = (int)chrono::ceil<chrono::milliseconds>(max(until - now, chrono::steady_clock::duration::zero())).count();
             }
-        }
 
 #ifdef _WIN32
-        if (sock != INVALID_SOCKET)
-            closesocket(sock);
+            ret = WSAPoll(pending.data(), (ULONG)pending.size(), wait);
+
+            if (ret < 0)
+                throw formatted_error("WSAPoll failed ({}).", wsa_error_to_string(WSAGetLastError()));
 #else
-        if (sock != 0)
-            close(sock);
-#endif
-    }
+            ret = poll(pending.data(), pending.size(), wait);
 
-    void tds_impl::connect(const string& server, uint16_t port, bool get_fqdn) {
-        struct addrinfo hints;
-        struct addrinfo* res;
-        struct addrinfo* orig_res;
-        int ret;
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_protocol = IPPROTO_TCP;
+                throw formatted_error("poll failed (error {})", errno_to_string(errno));
+            }
+#endif
 
-        ret = getaddrinfo(server.c_str(), nullptr, &hints, &res);
+            for (size_t i = 0; i < pending.size(); i++) {
+                if (pending[i].revents == 0)
+                    continue;
 
-        if (ret != 0)
-            throw formatted_error("getaddrinfo returned {}", ret);
+                int err = 0;
+                socklen_t len = sizeof(err);
 
-        orig_res = res;
+                if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0)
 #ifdef _WIN32
-        sock = INVALID_SOCKET;
+                    err = WSAGetLastError();
 #else
-        sock = 0;
+                    err = errno;
 #endif
 
-        do {
-            char hostname[NI_MAXHOST];
+                if (err == 0 && pending[i].revents & POLLOUT) {
+                    sock = pending[i].fd;
+                    connected_ai = pending_ai[i];
+                    pending.erase(pending.begin() + (ptrdiff_t)i);
+                    pending_ai.erase(pending_ai.begin() + (ptrdiff_t)i);
+                    break;
+                }
 
-            sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+                last_error = err;
 
 #ifdef _WIN32
-            if (sock == INVALID_SOCKET)
-                continue;
+                closesocket(pending[i].fd);
 #else
-            if (sock < 0)
-                continue;
+                close(pending[i].fd);
 #endif
 
-            if (res->ai_family == AF_INET)
-                ((struct sockaddr_in*)res->ai_addr)->sin_port = htons(port);
-            else if (res->ai_family == AF_INET6)
-                ((struct sockaddr_in6*)res->ai_addr)->sin6_port = htons(port);
-            else {
-#ifdef _WIN32
-                closesocket(sock);
-                sock = INVALID_SOCKET;
-#else
-                close(sock);
-                sock = 0;
-#endif
-                continue;
+                pending.erase(pending.begin() + (ptrdiff_t)i);
+                pending_ai.erase(pending_ai.begin() + (ptrdiff_t)i);
+                i--;
+
+                // no point waiting to try the next one
+                next_attempt = now;
             }
 
-            if (::connect(sock, res->ai_addr, (int)res->ai_addrlen) != 0) {
+            if (connected_ai)
+                break;
+        }
+
+        for (const auto& p : pending) {
 #ifdef _WIN32
-                closesocket(sock);
-                sock = INVALID_SOCKET;
+            closesocket(p.fd);
 #else
-                close(sock);
-                sock = 0;
+            close(p.fd);
 #endif
-                continue;
-            }
+        }
 
-            if (get_fqdn) {
-                if (getnameinfo(res->ai_addr, (socklen_t)res->ai_addrlen, hostname, sizeof(hostname), nullptr, 0, 0) == 0)
-                    fqdn = hostname;
-            }
+        if (connected_ai && get_fqdn) {
+            char hostname[NI_MAXHOST];
 
-            break;
-        } while ((res = res->ai_next));
+            if (getnameinfo(connected_ai->ai_addr, (socklen_t)connected_ai->ai_addrlen, hostname, sizeof(hostname), nullptr, 0, 0) == 0)
+                fqdn = hostname;
+        }
 
-        freeaddrinfo(orig_res);
+        freeaddrinfo(res);
+
+        if (!connected_ai) {
+            if (timeout.count() != 0 && chrono::steady_clock::now() >= deadline)
+                throw formatted_error("Timed out connecting to {}:{}.", server, port);
 
 #ifdef _WIN32
-        if (sock == INVALID_SOCKET)
-            throw formatted_error("Could not connect to {}:{}.", server, port);
+            throw formatted_error("Could not connect to {}:{} ({}).", server, port, wsa_error_to_string(last_error));
 #else
-        if (sock <= 0)
-            throw formatted_error("Could not connect to {}:{}.", server, port);
+            throw formatted_error("Could not connect to {}:{} (error {}).", server, port, errno_to_string(last_error));
 #endif
+        }
     }
 
     void tds_impl::send_prelogin_msg(enum encryption_type encrypt, bool mars) {
@@ -3287,7 +4585,7 @@ namespace tds {
 #endif
             bool last_packet;
             vector<uint8_t> buf;
-            list<vector<uint8_t>> tokens;
+            vector<span<const uint8_t>> tokens;
             vector<column> buf_columns;
 #ifdef _WIN32
             vector<uint8_t> sspibuf;
@@ -3300,31 +4598,31 @@ namespace tds {
                 if (type != tds_msg::tabular_result)
                     throw formatted_error("Received message type {}, expected tabular_result", (int)type);
 
-                buf.insert(buf.end(), payload.begin(), payload.end());
+                if (!buf.empty()) {
+                    buf.insert(buf.end(), payload.begin(), payload.end());
+                    payload.swap(buf);
+                }
+
+                tokens.clear();
 
                 {
-                    auto sp = parse_tokens(buf, tokens, buf_columns);
+                    auto sp = parse_tokens(payload, tokens, buf_columns);
 
-                    if (sp.size() != buf.size()) {
-                        vector<uint8_t> newbuf{sp.begin(), sp.end()};
-                        buf.swap(newbuf);
-                    }
-                }
+                    if (last_packet && !sp.empty())
+                        throw formatted_error("Data remaining in buffer");
 
-                if (last_packet && !buf.empty())
-                    throw formatted_error("Data remaining in buffer");
+                    if (sp.size() == payload.size())
+                        buf.swap(payload);
+                    else
+                        buf.assign(sp.begin(), sp.end());
+                }
 
                 received_loginack = false;
 
-                vector<uint8_t> t;
-
-                while (!tokens.empty()) {
-                    t.swap(tokens.front());
-                    tokens.pop_front();
-
+                for (auto t : tokens) {
                     auto type = (token)t[0];
 
-                    auto sp = span<const uint8_t>(t).subspan(1);
+                    auto sp = t.subspan(1);
 
                     switch (type) {
                         case token::DONE:
@@ -3656,120 +4954,381 @@ namespace tds {
         } else {
             msg.sspi_offset = off;
 
-            if (sspi.size() >= numeric_limits<uint16_t>::max()) {
-                msg.sspi_length = numeric_limits<uint16_t>::max();
-                msg.sspi_long = (uint32_t)sspi.size();
-            } else {
-                msg.sspi_length = (uint16_t)sspi.size();
-                msg.sspi_long = 0;
-            }
+            if (sspi.size() >= numeric_limits<uint16_t>::max()) {
+                msg.sspi_length = numeric_limits<uint16_t>::max();
+                msg.sspi_long = (uint32_t)sspi.size();
+            } else {
+                msg.sspi_length = (uint16_t)sspi.size();
+                msg.sspi_long = 0;
+            }
+
+            memcpy((uint8_t*)&msg + msg.sspi_offset, sspi.data(), sspi.size());
+
+            off += (uint16_t)sspi.size();
+        }
+
+        msg.extension_offset = off;
+        msg.extension_length = sizeof(uint32_t);
+
+        *(uint32_t*)((uint8_t*)&msg + msg.extension_offset) = off + sizeof(uint32_t);
+        off += sizeof(uint32_t);
+
+        for (const auto& f : features) {
+            memcpy((uint8_t*)&msg + off, f.data(), f.length());
+            off += (uint16_t)f.length();
+        }
+
+        *(enum tds_feature*)((uint8_t*)&msg + off) = tds_feature::TERMINATOR;
+
+        sess.send_msg(tds_msg::tds7_login, payload);
+    }
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+    void main_session::send_raw(span<const uint8_t> buf, bool do_ssl)
+#else
+    void main_session::send_raw(span<const uint8_t> buf)
+#endif
+    {
+        lock_guard lg(tds.mess_out_lock);
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+        if (do_ssl && tds.ssl)
+            tds.mess_out.push(tds.ssl->enc(buf));
+        else
+#endif
+            tds.mess_out.push(buf);
+
+        tds.mess_event.set();
+    }
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+    void main_session::send_raw(vector<uint8_t>&& buf, bool do_ssl)
+#else
+    void main_session::send_raw(vector<uint8_t>&& buf)
+#endif
+    {
+        lock_guard lg(tds.mess_out_lock);
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+        if (do_ssl && tds.ssl)
+            tds.mess_out.push(tds.ssl->enc(buf));
+        else
+#endif
+            tds.mess_out.push(move(buf));
+
+        tds.mess_event.set();
+    }
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+    void main_session::send_msg(enum tds_msg type, span<const uint8_t> msg, bool do_ssl)
+#else
+    void main_session::send_msg(enum tds_msg type, span<const uint8_t> msg)
+#endif
+    {
+        do {
+            size_t to_send = min(msg.size(), tds.packet_size - sizeof(tds_header));
+
+            vector<uint8_t> buf;
+
+            buf.resize(to_send + sizeof(tds_header));
+
+            auto& h = *(tds_header*)buf.data();
+
+            h.type = type;
+            h.status = (to_send == msg.size() ? 1 : 0) | reset_status(tds, type); // 1 == last message
+            h.length = htons((uint16_t)(to_send + sizeof(tds_header)));
+            h.spid = 0;
+            h.packet_id = 0; // FIXME? "Currently ignored" according to spec
+            h.window = 0;
+
+            memcpy(buf.data() + sizeof(tds_header), msg.data(), to_send);
+
+#if defined(WITH_OPENSSL) || defined(_WIN32)
+            send_raw(move(buf), do_ssl);
+#else
+            send_raw(move(buf));
+#endif
+
+            msg = msg.subspan(to_send);
+        } while (!msg.empty());
+    }
+
+    void main_session::send_packet(enum tds_msg type, span<const uint8_t> msg, uint8_t status) {
+        vector<uint8_t> buf;
+
+        buf.resize(msg.size() + sizeof(tds_header));
+
+        auto& h = *(tds_header*)buf.data();
+
+        h.type = type;
+        h.status = status | reset_status(tds, type);
+        h.length = htons((uint16_t)(msg.size() + sizeof(tds_header)));
+        h.spid = 0;
+        h.packet_id = 0;
+        h.window = 0;
+
+        memcpy(buf.data() + sizeof(tds_header), msg.data(), msg.size());
+
+        send_raw(move(buf));
+    }
+
+    msg_writer::msg_writer(tds_impl& impl, smp_session* smp, enum tds_msg type) :
+                           impl(impl), smp(smp), type(type) {
+        max_size = impl.packet_size - sizeof(tds_header);
+        buf.reserve(max_size);
+    }
+
+    void msg_writer::flush(uint8_t status) {
+        if (smp)
+            smp->send_packet(type, buf, status);
+        else
+            impl.sess.send_packet(type, buf, status);
+
+        buf.clear();
+    }
+
+    void msg_writer::write(span<const uint8_t> data) {
+        while (!data.empty()) {
+            if (buf.size() == max_size)
+                flush(0);
+
+            auto to_copy = min(data.size(), max_size - buf.size());
+
+            buf.insert(buf.end(), data.data(), data.data() + to_copy);
+            data = data.subspan(to_copy);
+        }
+    }
+
+    void msg_writer::finish() {
+        flush(1); // last packet
+    }
+
+    void msg_writer::abort() {
+        flush(3); // last packet, and tell the server to ignore the message
+    }
+
+    optional<prepared_cache::entry> prepared_cache::take(const u16string& key, uint64_t& gen) {
+        lock_guard lg(lock);
+
+        gen = generation;
+
+        auto it = index.find(key);
+
+        if (it == index.end())
+            return nullopt;
+
+        auto e = move(*it->second);
+
+        entries.erase(it->second);
+        index.erase(it);
+
+        return e;
+    }
+
+    // Returns the handle which needs to be unprepared, if any - either the least
+    // recently used, or e's own if there's already one for the same SQL.
+    optional<int32_t> prepared_cache::put(entry&& e, uint64_t gen) {
+        lock_guard lg(lock);
+
+        if (gen != generation) // handle was invalidated while checked out
+            return nullopt;
+
+        if (index.contains(e.key))
+            return e.handle;
+
+        entries.emplace_front(move(e));
+        index.emplace(entries.front().key, entries.begin());
+
+        if (entries.size() <= capacity)
+            return nullopt;
+
+        auto h = entries.back().handle;
+
+        index.erase(entries.back().key);
+        entries.pop_back();
+
+        return h;
+    }
+
+    void prepared_cache::clear() {
+        lock_guard lg(lock);
+
+        index.clear();
+        entries.clear();
+        generation++;
+    }
+
+    static void cpu_relax() noexcept {
+#ifdef _WIN32
+        YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    mess_queue::mess_queue() {
+        head = tail = new chunk;
+    }
+
+    mess_queue::~mess_queue() {
+        while (head) {
+            auto next = head->next;
+
+            delete head;
+            head = next;
+        }
+
+        delete spare.load();
+    }
+
+    // called by the socket thread - returns true if the consumer was parked
+    bool mess_queue::push(mess&& m) {
+        if (tail_pos == chunk_size) {
+            auto c = spare.exchange(nullptr);
+
+            if (!c)
+                c = new chunk;
+
+            c->next = nullptr;
+            tail->next = c;
+            tail = c;
+            tail_pos = 0;
+        }
+
+        tail->slots[tail_pos] = move(m);
+        tail_pos++;
+
+        pushed.fetch_add(1);
+
+        if (!parked.exchange(false))
+            return false;
+
+        wake();
+
+        return true;
+    }
+
+    bool mess_queue::pop(mess& m) {
+        if (popped.load(memory_order_relaxed) == pushed.load())
+            return false;
 
-            memcpy((uint8_t*)&msg + msg.sspi_offset, sspi.data(), sspi.size());
+        if (head_pos == chunk_size) {
+            auto old = head;
 
-            off += (uint16_t)sspi.size();
+            head = head->next;
+            head_pos = 0;
+
+            delete spare.exchange(old);
         }
 
-        msg.extension_offset = off;
-        msg.extension_length = sizeof(uint32_t);
+        auto& slot = head->slots[head_pos];
 
-        *(uint32_t*)((uint8_t*)&msg + msg.extension_offset) = off + sizeof(uint32_t);
-        off += sizeof(uint32_t);
+        m.type = slot.type;
+        m.payload.swap(slot.payload);
+        m.last_packet = slot.last_packet;
+        slot.payload.clear();
 
-        for (const auto& f : features) {
-            memcpy((uint8_t*)&msg + off, f.data(), f.length());
-            off += (uint16_t)f.length();
-        }
+        head_pos++;
 
-        *(enum tds_feature*)((uint8_t*)&msg + off) = tds_feature::TERMINATOR;
+        popped.fetch_add(1);
 
-        sess.send_msg(tds_msg::tds7_login, payload);
+        if (producer_parked.load()) {
+            lock_guard lg(space_lock);
+
+            space_cv.notify_one();
+        }
+
+        return true;
     }
 
-#if defined(WITH_OPENSSL) || defined(_WIN32)
-    void main_session::send_raw(span<const uint8_t> buf, bool do_ssl)
-#else
-    void main_session::send_raw(span<const uint8_t> buf)
-#endif
-    {
-        lock_guard lg(tds.mess_out_lock);
+    bool mess_queue::empty() const {
+        return popped.load() == pushed.load();
+    }
 
-#if defined(WITH_OPENSSL) || defined(_WIN32)
-        if (do_ssl && tds.ssl) {
-            auto enc = tds.ssl->enc(buf);
+    size_t mess_queue::size() const {
+        return (size_t)(pushed.load() - popped.load());
+    }
 
-            tds.mess_out_buf.insert(tds.mess_out_buf.end(), enc.begin(), enc.end());
-        } else {
-#endif
-            tds.mess_out_buf.insert(tds.mess_out_buf.end(), buf.begin(), buf.end());
+    // called by the consumer - returns once a message is waiting or the queue is closed
+    void mess_queue::wait() {
+        for (unsigned int i = 0; i < 4000; i++) {
+            if (!empty() || closed())
+                return;
 
-#if defined(WITH_OPENSSL) || defined(_WIN32)
+            cpu_relax();
         }
-#endif
 
-        tds.mess_event.set();
+        do {
+            auto sig = signal.load();
+
+            if (!arm())
+                return;
+
+            signal.wait(sig);
+        } while (true);
     }
 
-#if defined(WITH_OPENSSL) || defined(_WIN32)
-    void main_session::send_msg(enum tds_msg type, span<const uint8_t> msg, bool do_ssl)
-#else
-    void main_session::send_msg(enum tds_msg type, span<const uint8_t> msg)
-#endif
-    {
-        do {
-            size_t to_send = min(msg.size(), tds.packet_size - sizeof(tds_header));
+    // tells the producer to wake us - returns false if there's no need to wait
+    bool mess_queue::arm() {
+        parked.store(true);
 
-            vector<uint8_t> buf;
+        if (!empty() || closed()) {
+            parked.store(false);
+            return false;
+        }
 
-            buf.resize(to_send + sizeof(tds_header));
+        return true;
+    }
 
-            auto& h = *(tds_header*)buf.data();
+    void mess_queue::wake() {
+        signal.fetch_add(1);
+        signal.notify_one();
+    }
 
-            h.type = type;
-            h.status = to_send == msg.size() ? 1 : 0; // 1 == last message
-            h.length = htons((uint16_t)(to_send + sizeof(tds_header)));
-            h.spid = 0;
-            h.packet_id = 0; // FIXME? "Currently ignored" according to spec
-            h.window = 0;
+    void mess_queue::close() {
+        is_closed.store(true);
+        parked.store(false);
 
-            memcpy(buf.data() + sizeof(tds_header), msg.data(), to_send);
+        wake();
 
-#if defined(WITH_OPENSSL) || defined(_WIN32)
-            send_raw(buf, do_ssl);
-#else
-            send_raw(buf);
-#endif
+        {
+            lock_guard lg(space_lock);
 
-            msg = msg.subspan(to_send);
-        } while (!msg.empty());
+            space_cv.notify_one();
+        }
     }
 
-    void main_session::wait_for_msg(enum tds_msg& type, vector<uint8_t>& payload, bool* last_packet) {
-        mess m;
+    bool mess_queue::closed() const {
+        return is_closed.load();
+    }
 
-        {
-            unique_lock ul(mess_in_lock);
+    // called by the socket thread when rate limiting
+    void mess_queue::wait_for_space(size_t limit, stop_token stop) {
+        unique_lock ul(space_lock);
 
-            mess_in_cv.wait(ul, [&]() { return !mess_list.empty() || socket_thread_exc || !tds.connected; });
+        producer_parked.store(true);
 
-            if (!socket_thread_exc && tds.connected) {
-                auto& m2 = mess_list.front();
+        space_cv.wait(ul, stop, [&]() { return size() < limit; });
 
-                m.type = m2.type;
-                m.payload.swap(m2.payload);
-                m.last_packet = m2.last_packet;
+        producer_parked.store(false);
+    }
 
-                mess_list.pop_front();
-            }
-        }
+    void main_session::wait_for_msg(enum tds_msg& type, vector<uint8_t>& payload, bool* last_packet) {
+        mess m;
 
-        if (socket_thread_exc)
-            rethrow_exception(socket_thread_exc);
+        mess_in.wait();
+
+        if (mess_in.closed() || !tds.connected) {
+            if (socket_thread_exc)
+                rethrow_exception(socket_thread_exc);
 
-        if (!tds.connected)
             throw runtime_error("Disconnected.");
+        }
 
-        if (tds.rate_limit != 0)
-            rate_limit_cv.notify_one();
+        if (!mess_in.pop(m))
+            throw runtime_error("Message queue empty.");
 
         type = m.type;
         payload.swap(m.payload);
@@ -3897,87 +5456,271 @@ namespace tds {
         return p;
     }
 
+    // replace ? in q with parameters
+    static u16string replace_placeholders(u16string_view q) {
+        u16string q2;
+        bool in_quotes = false;
+        unsigned int param_num = 1;
+
+        q2.reserve(q.length());
+
+        for (unsigned int i = 0; i < q.length(); i++) {
+            if (q[i] == '\'')
+                in_quotes = !in_quotes;
+
+            if (q[i] == '?' && !in_quotes) {
+                q2 += u"@P" + to_u16string(param_num);
+                param_num++;
+            } else
+                q2 += q[i];
+        }
+
+        return q2;
+    }
+
     // FIXME - can we do static assert if no. of question marks different from no. of parameters?
-    void query::do_query(tds& conn, u16string_view q) {
+    void query::do_query(tds& conn, u16string_view q, bool wait) {
+        u16string q2, params_string;
+
         if (!params.empty()) {
-            u16string q2;
-            bool in_quotes = false;
-            unsigned int param_num = 1;
+            q2 = replace_placeholders(q);
+            params_string = create_params_string();
+        } else
+            q2 = q;
+
+        if (from_cache(q2, params_string)) {
+            prepared(wait);
+            return;
+        }
 
-            // replace ? in q with parameters
+        if (conn.impl->prepexec) {
+            // handle only comes back once the results have been read
 
-            q2.reserve(q.length());
+            if (wait)
+                r2 = make_unique<rpc>(conn, u"sp_prepexec", handle, params_string, q2, params);
+            else
+                r2 = make_unique<rpc>(deferred, conn, u"sp_prepexec", handle, params_string, q2, params);
 
-            for (unsigned int i = 0; i < q.length(); i++) {
-                if (q[i] == '\'')
-                    in_quotes = !in_quotes;
+            take_metadata();
 
-                if (q[i] == '?' && !in_quotes) {
-                    q2 += u"@P" + to_u16string(param_num);
-                    param_num++;
-                } else
-                    q2 += q[i];
+            return;
+        }
+
+        r1 = make_unique<rpc>(deferred, conn, u"sp_prepare", handle, params_string, q2, 1); // 1 means return metadata
+
+        if (wait) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+    }
+
+    void query::do_query(session& sess, u16string_view q, bool wait) {
+        u16string q2, params_string;
+
+        this->sess = sess;
+
+        if (!params.empty()) {
+            q2 = replace_placeholders(q);
+            params_string = create_params_string();
+        } else
+            q2 = q;
+
+        if (from_cache(q2, params_string)) {
+            prepared(wait);
+            return;
+        }
+
+        if (conn.impl->prepexec) {
+            // handle only comes back once the results have been read
+
+            if (wait)
+                r2 = make_unique<rpc>(sess, u"sp_prepexec", handle, params_string, q2, params);
+            else
+                r2 = make_unique<rpc>(deferred, sess, u"sp_prepexec", handle, params_string, q2, params);
+
+            take_metadata();
+
+            return;
+        }
+
+        r1 = make_unique<rpc>(deferred, sess, u"sp_prepare", handle, params_string, q2, 1); // 1 means return metadata
+
+        if (wait) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+    }
+
+    static const size_t run_many_batch = 1000; // executions per message
+
+    vector<uint64_t> tds::run_many(u16string_view s, span<const vector<value>> rows) {
+        vector<uint64_t> counts;
+
+        if (rows.empty())
+            return counts;
+
+        auto num_params = rows.front().size();
+
+        for (const auto& r : rows) {
+            if (r.size() != num_params)
+                throw formatted_error("Row has {} parameters, expected {}.", r.size(), num_params);
+        }
+
+        // declare each parameter as its first non-NULL type, long enough for all the values
+
+        u16string params_string;
+
+        for (size_t i = 0; i < num_params; i++) {
+            const value* first = nullptr;
+            size_t length = 0;
+
+            for (const auto& r : rows) {
+                if (r[i].is_null)
+                    continue;
+
+                if (!first)
+                    first = &r[i];
+
+                length = max(length, r[i].val.size());
             }
 
-            rpc r1(conn, u"sp_prepare", handle, create_params_string(), q2, 1); // 1 means return metadata
+            if (!first)
+                first = &rows.front()[i];
 
-            while (r1.fetch_row()) { }
+            if (!params_string.empty())
+                params_string += u", ";
 
-            cols = r1.cols;
-        } else {
-            rpc r1(conn, u"sp_prepare", handle, u"", q, 1); // 1 means return metadata
+            params_string += u"@P" + to_u16string(i + 1) + u" ";
+            params_string += type_to_string(first->type, length, first->precision, first->scale, u"", first->clr_name);
+        }
+
+        output_param<int32_t> handle;
 
-            while (r1.fetch_row()) { }
+        {
+            rpc r(*this, u"sp_prepare", handle, params_string, num_params == 0 ? u16string(s) : replace_placeholders(s));
 
-            cols = r1.cols;
+            while (r.fetch_row()) { }
         }
 
         if (handle.is_null)
             throw runtime_error("sp_prepare failed.");
 
-        r2 = make_unique<rpc>(conn, u"sp_execute", static_cast<value>(handle), params);
-    }
-
-    void query::do_query(session& sess, u16string_view q) {
-        this->sess = sess;
+        counts.reserve(rows.size());
 
-        if (!params.empty()) {
-            u16string q2;
-            bool in_quotes = false;
-            unsigned int param_num = 1;
+        try {
+            for (size_t i = 0; i < rows.size(); i += run_many_batch) {
+                rpc_pipeline p(*this);
 
-            // replace ? in q with parameters
+                for (size_t j = i; j < min(rows.size(), i + run_many_batch); j++) {
+                    p.add(u"sp_execute", static_cast<value>(handle), rows[j]);
+                }
 
-            q2.reserve(q.length());
+                p.execute();
 
-            for (unsigned int i = 0; i < q.length(); i++) {
-                if (q[i] == '\'')
-                    in_quotes = !in_quotes;
+                for (const auto& c : p.calls) {
+                    counts.push_back(c.row_count.value_or(0));
+                }
+            }
+        } catch (...) {
+            try {
+                rpc r(*this, u"sp_unprepare", static_cast<value>(handle));
 
-                if (q[i] == '?' && !in_quotes) {
-                    q2 += u"@P" + to_u16string(param_num);
-                    param_num++;
-                } else
-                    q2 += q[i];
+                while (r.fetch_row()) { }
+            } catch (...) {
             }
 
-            rpc r1(sess, u"sp_prepare", handle, create_params_string(), q2, 1); // 1 means return metadata
+            throw;
+        }
+
+        rpc r(*this, u"sp_unprepare", static_cast<value>(handle));
 
-            while (r1.fetch_row()) { }
+        while (r.fetch_row()) { }
 
-            cols = r1.cols;
-        } else {
-            rpc r1(sess, u"sp_prepare", handle, u"", q, 1); // 1 means return metadata
+        return counts;
+    }
+
+    // If a handle for the same SQL is in the connection's cache, takes it rather
+    // than calling sp_prepare.
+    bool query::from_cache(u16string_view q, u16string_view params_string) {
+        auto& cache = conn.impl->prepared;
+
+        if (cache.capacity == 0)
+            return false;
+
+        // same text can mean something different in another database
+
+        cache_key = conn.impl->db_name;
+        cache_key += u'\0';
+        cache_key += params_string;
+        cache_key += u'\0';
+        cache_key += q;
+
+        auto e = cache.take(cache_key, cache_gen);
+
+        if (!e.has_value())
+            return false;
+
+        static_cast<value&>(handle) = e->handle;
 
-            while (r1.fetch_row()) { }
+        return true;
+    }
 
-            cols = r1.cols;
+    // called once sp_prepare has finished, or the handle has come from the cache
+    void query::prepared(bool wait) {
+        if (r1) {
+            cols = r1->cols;
+            r1.reset();
         }
 
         if (handle.is_null)
             throw runtime_error("sp_prepare failed.");
 
-        r2 = make_unique<rpc>(sess, u"sp_execute", static_cast<value>(handle), params);
+        // if streaming, the handler has to be in place before the first packet arrives
+
+        if (wait && !plp_cb) {
+            if (sess)
+                r2 = make_unique<rpc>(sess->get(), u"sp_execute", static_cast<value>(handle), params);
+            else
+                r2 = make_unique<rpc>(conn, u"sp_execute", static_cast<value>(handle), params);
+        } else {
+            if (sess)
+                r2 = make_unique<rpc>(deferred, sess->get(), u"sp_execute", static_cast<value>(handle), params);
+            else
+                r2 = make_unique<rpc>(deferred, conn, u"sp_execute", static_cast<value>(handle), params);
+        }
+
+        if (plp_cb)
+            r2->set_plp_handler(plp_cb);
+
+        take_metadata();
+    }
+
+    // The columns are always those of sp_execute's own response - the table may
+    // have been altered since the statement was prepared.
+    void query::take_metadata() {
+        if (exec_metadata || r2->cols.empty())
+            return;
+
+        cols = r2->cols;
+        exec_metadata = true;
+    }
+
+    task<void> query::start() {
+        if (!r2) {
+            bool more;
+
+            do {
+                more = co_await r1->next_row();
+            } while (more);
+
+            prepared(false);
+        }
+
+        co_await r2->start();
+
+        take_metadata();
     }
 
     uint16_t query::num_columns() const {
@@ -3985,21 +5728,117 @@ namespace tds {
     }
 
     bool query::fetch_row() {
+        if (!r2) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+
         if (!r2->fetch_row())
             return false;
 
+        take_metadata();
+
+        for (size_t i = 0; i < cols.size(); i++) {
+            cols[i].val.swap(r2->cols[i].val);
+            cols[i].is_null = r2->cols[i].is_null;
+        }
+
+        return true;
+    }
+
+    optional<row_view> query::fetch_row_view() {
+        if (!r2) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+
+        return r2->fetch_row_view();
+    }
+
+    size_t query::fetch_rows(size_t n, vector<column_vector>& v) {
+        if (!r2) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+
+        return r2->fetch_rows(n, v);
+    }
+
+    void query::set_plp_handler(const plp_chunk_handler& handler) {
+        plp_cb = handler;
+
+        if (r2)
+            r2->set_plp_handler(handler);
+    }
+
+    vector<column_vector> query::fetch_rows(size_t n) {
+        vector<column_vector> v;
+
+        fetch_rows(n, v);
+
+        return v;
+    }
+
+    task<bool> query::next_row() {
+        if (!r2)
+            co_await start();
+
+        if (!co_await r2->next_row())
+            co_return false;
+
+        take_metadata();
+
         for (size_t i = 0; i < cols.size(); i++) {
             cols[i].val.swap(r2->cols[i].val);
             cols[i].is_null = r2->cols[i].is_null;
         }
 
+        co_return true;
+    }
+
+    bool query::next_result() {
+        if (!r2) {
+            while (r1->fetch_row()) { }
+
+            prepared(true);
+        }
+
+        if (!r2->next_result())
+            return false;
+
+        cols = r2->cols;
+
         return true;
     }
 
+    task<bool> query::next_result_async() {
+        if (!r2)
+            co_await start();
+
+        if (!co_await r2->next_result_async())
+            co_return false;
+
+        cols = r2->cols;
+
+        co_return true;
+    }
+
+    optional<uint64_t> query::row_count() const {
+        if (!r2)
+            return nullopt;
+
+        return r2->row_count;
+    }
+
     bool query::fetch_row_no_wait() {
-        if (!r2->fetch_row_no_wait())
+        if (!r2 || !r2->fetch_row_no_wait())
             return false;
 
+        take_metadata();
+
         for (size_t i = 0; i < cols.size(); i++) {
             cols[i].val.swap(r2->cols[i].val);
             cols[i].is_null = r2->cols[i].is_null;
@@ -4018,8 +5857,25 @@ namespace tds {
 
     query::~query() {
         try {
+            r1.reset(nullptr);
+
+            // With sp_prepexec the handle only comes back after the results, so if we
+            // cancel before then it's lost - the server frees it when the connection
+            // closes or is reset.
             r2.reset(nullptr);
 
+            if (handle.is_null)
+                return;
+
+            if (!cache_key.empty() && !handle.is_null && conn.impl->connected) {
+                auto evicted = conn.impl->prepared.put({move(cache_key), (int32_t)handle}, cache_gen);
+
+                if (!evicted.has_value())
+                    return;
+
+                static_cast<value&>(handle) = *evicted;
+            }
+
             // FIXME
 
             if (sess) {
@@ -4353,6 +6209,11 @@ WHERE columns.object_id = OBJECT_ID(?))"), db.empty() ? table : (u16string(db) +
                 break;
             }
 
+            case tds_envchange_type::reset_completion_acknowledgement:
+                // resetting the connection unprepares everything
+                prepared.clear();
+                break;
+
             case tds_envchange_type::packet_size: {
                 if (sp.size() < sizeof(tds_envchange_packet_size) - offsetof(tds_envchange_packet_size, header.type)) {
                     throw formatted_error("Short ENVCHANGE message ({} bytes, expected at least {}).", sp.size(),
@@ -18,6 +18,13 @@
 #include <ranges>
 #include <chrono>
 #include <array>
+#include <coroutine>
+#include <utility>
+#include <tuple>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <iosfwd>
 #include <time.h>
 #include <nlohmann/json_fwd.hpp>
 
@@ -54,6 +61,42 @@
 #define WARN_UNUSED
 #endif
 
+// Structures from the Arrow C data interface, see https://arrow.apache.org/docs/format/CDataInterface.html
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+    void (*release)(struct ArrowSchema*);
+    void* private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+    void (*release)(struct ArrowArray*);
+    void* private_data;
+};
+
+#endif
+
 namespace tds {
     enum class sql_type : uint8_t {
         SQL_NULL = 0x1F,
@@ -92,6 +135,7 @@ namespace tds {
         NCHAR = 0xEF,
         UDT = 0xF0,
         XML = 0xF1,
+        TVP = 0xF3,
     };
 
     enum class token : uint8_t {
@@ -135,6 +179,161 @@ namespace tds {
     using msg_handler = std::function<void(std::string_view server, std::string_view message, std::string_view proc_name,
                                       int32_t msgno, int32_t line_number, int16_t state, uint8_t severity, bool error)>;
     using func_count_handler = std::function<void(uint64_t count, uint16_t curcmd)>;
+    using resume_handler = std::function<void(std::coroutine_handle<> h)>;
+    using plp_chunk_handler = std::function<void(uint16_t col, std::span<const uint8_t> chunk)>;
+
+    // Lazily-started coroutine returned by the async API. Either co_await it from
+    // another coroutine, or call get() to run it to completion on this thread.
+
+    template<typename T = void>
+    class task;
+
+    template<typename T>
+    class task_promise_base {
+    public:
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        auto final_suspend() noexcept {
+            struct final_awaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept {
+                    auto& p = *this->p;
+
+                    if (p.sync) {
+                        std::lock_guard lg(p.sync->lock);
+
+                        p.sync->done = true;
+                        p.sync->cv.notify_one();
+
+                        return std::noop_coroutine();
+                    }
+
+                    return p.continuation ? p.continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {
+                }
+
+                task_promise_base* p;
+            };
+
+            return final_awaiter{this};
+        }
+
+        void unhandled_exception() noexcept {
+            exc = std::current_exception();
+        }
+
+        struct sync_state {
+            std::mutex lock;
+            std::condition_variable cv;
+            bool done = false;
+        };
+
+        std::coroutine_handle<> continuation;
+        sync_state* sync = nullptr;
+        std::exception_ptr exc;
+    };
+
+    template<typename T>
+    class task_promise : public task_promise_base<T> {
+    public:
+        task<T> get_return_object() noexcept;
+
+        void return_value(T v) {
+            val.emplace(std::move(v));
+        }
+
+        std::optional<T> val;
+    };
+
+    template<>
+    class task_promise<void> : public task_promise_base<void> {
+    public:
+        task<void> get_return_object() noexcept;
+
+        void return_void() noexcept {
+        }
+    };
+
+    template<typename T>
+    class task {
+    public:
+        using promise_type = task_promise<T>;
+
+        explicit task(std::coroutine_handle<promise_type> h) noexcept : h(h) { }
+
+        task(task&& that) noexcept : h(std::exchange(that.h, nullptr)) { }
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+
+        ~task() {
+            if (h)
+                h.destroy();
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+            h.promise().continuation = c;
+            return h;
+        }
+
+        T await_resume() {
+            auto& p = h.promise();
+
+            if (p.exc)
+                std::rethrow_exception(p.exc);
+
+            if constexpr (!std::is_void_v<T>)
+                return std::move(*p.val);
+        }
+
+        // blocks until the coroutine has finished - it may be resumed on another thread meanwhile
+        T get() {
+            typename task_promise_base<T>::sync_state st;
+
+            h.promise().sync = &st;
+            h.resume();
+
+            {
+                std::unique_lock ul(st.lock);
+
+                st.cv.wait(ul, [&]() { return st.done; });
+            }
+
+            return await_resume();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> h;
+    };
+
+    template<typename T>
+    task<T> task_promise<T>::get_return_object() noexcept {
+        return task<T>{std::coroutine_handle<task_promise<T>>::from_promise(*this)};
+    }
+
+    inline task<void> task_promise<void>::get_return_object() noexcept {
+        return task<void>{std::coroutine_handle<task_promise<void>>::from_promise(*this)};
+    }
+
+    // Tag for constructors which send the request without waiting for the
+    // response, for use with start() and next_row().
+
+    struct deferred_t {
+        explicit deferred_t() = default;
+    };
+
+    inline constexpr deferred_t deferred{};
 
     class value;
     class tds_impl;
@@ -570,6 +769,19 @@ namespace tds {
         ENCRYPT_REQ
     };
 
+    class reactor_impl;
+
+    class TDSCPP reactor {
+    public:
+        reactor(unsigned int num_threads = 1);
+        ~reactor();
+
+        reactor(const reactor&) = delete;
+        reactor& operator=(const reactor&) = delete;
+
+        std::unique_ptr<reactor_impl> impl;
+    };
+
     struct options {
         options(std::string_view server, std::string_view user = "", std::string_view password = "",
                 std::string_view app_name = "tdscpp", std::string_view db = "",
@@ -596,6 +808,13 @@ namespace tds {
         unsigned int codepage;
         bool mars;
         unsigned int rate_limit;
+        bool use_io_uring = false; // Linux only, falls back to epoll if io_uring is unavailable
+        reactor* event_loop = nullptr; // if set, share its threads rather than starting one per connection - must outlive the connection
+        resume_handler executor; // resumes coroutines waiting on the async API - if not set, they're resumed on a thread shared by every connection
+        unsigned int prepared_cache_size = 0; // prepared statements kept for reuse by query, rather than unprepared - 0 to disable
+        bool prepexec = false; // prepare and first execute a query in one round-trip with sp_prepexec - metadata then only arrives with the results, and the handle after them, so it's lost if the query is abandoned early
+        std::chrono::milliseconds connect_timeout = std::chrono::seconds(15); // across all the server's addresses - 0 to wait for as long as the OS does
+        bool use_ktls = false; // Linux only - with TLS 1.2 and AES-GCM, the kernel does the encryption once the handshake is done, if it's able to
     };
 
     template<typename T, size_t arg_count>
@@ -686,6 +905,14 @@ namespace tds {
 
         void run_rpc(const string_or_u16string auto& rpc_name);
 
+        // Runs s once for each of rows - each a tuple or range of parameters - preparing
+        // it once and pipelining the executions. Returns the number of rows affected by
+        // each execution.
+        template<typename T>
+        std::vector<uint64_t> run_many(no_check<T> s, const std::ranges::input_range auto& rows);
+
+        std::vector<uint64_t> run_many(std::u16string_view s, std::span<const std::vector<value>> rows);
+
         template<string_or_u16string T = std::u16string_view>
         void bcp(const string_or_u16string auto& table, const list_of_u16string auto& np,
                  const list_of_list_of_values auto& vp, const T& db = u"") {
@@ -736,6 +963,55 @@ namespace tds {
         void bcp_sendmsg(std::span<const uint8_t> msg);
     };
 
+    class pool_impl;
+
+    // A thread-safe pool of connections made with the same options. get() waits
+    // if max_size connections are already in use. A connection which is returned
+    // has its session state reset by the server along with its next request, and
+    // one which has been idle for check_after is checked before it's handed out.
+    // Idle connections beyond min_size are closed after idle_timeout, by a thread
+    // of the pool's own. The pool has to outlive the connections taken from it.
+
+    class TDSCPP pool {
+    public:
+        class TDSCPP connection {
+        public:
+            connection(pool_impl& p, std::unique_ptr<tds>&& conn) noexcept : p(&p), conn(std::move(conn)) { }
+            connection(connection&& that) noexcept : p(that.p), conn(std::move(that.conn)) { }
+            connection(const connection&) = delete;
+            connection& operator=(const connection&) = delete;
+            ~connection();
+
+            tds& operator*() const noexcept {
+                return *conn;
+            }
+
+            tds* operator->() const noexcept {
+                return conn.get();
+            }
+
+            operator tds&() const noexcept {
+                return *conn;
+            }
+
+        private:
+            pool_impl* p;
+            std::unique_ptr<tds> conn;
+        };
+
+        pool(const options& opts, size_t min_size = 0, size_t max_size = 16,
+             std::chrono::seconds idle_timeout = std::chrono::minutes(5),
+             std::chrono::seconds check_after = std::chrono::seconds(30));
+        ~pool();
+
+        pool(const pool&) = delete;
+        pool& operator=(const pool&) = delete;
+
+        connection get();
+
+        std::unique_ptr<pool_impl> impl;
+    };
+
     using time_t = std::chrono::duration<int64_t, std::ratio<1, 10000000>>;
 
     class TDSCPP WARN_UNUSED datetime {
@@ -914,6 +1190,121 @@ namespace tds {
 
     using value_data_t = std::vector<uint8_t>;
 
+    class value;
+
+    // A value which doesn't own its data, such as one still in the buffer it was
+    // received into. It's only valid for as long as that buffer is.
+
+    class TDSCPP WARN_UNUSED value_view {
+    public:
+        value_view() = default;
+        value_view(const value& v) noexcept;
+
+        explicit operator std::string() const;
+        explicit operator std::u8string() const;
+        explicit operator std::u16string() const;
+        explicit operator std::string_view() const; // throws for VARCHAR if the collation isn't UTF-8
+        explicit operator std::u16string_view() const;
+        explicit operator int64_t() const;
+        explicit operator double() const;
+        explicit operator std::chrono::year_month_day() const;
+        explicit operator datetime() const;
+        explicit operator datetimeoffset() const;
+
+        explicit operator time_t() const;
+
+        template<typename T, typename U>
+        explicit operator std::chrono::duration<T, U>() const {
+            return std::chrono::duration_cast<std::chrono::duration<T, U>>((time_t)*this);
+        }
+
+        template<typename T>
+        requires std::is_integral_v<T>
+        explicit operator T() const {
+            return static_cast<T>(static_cast<int64_t>(*this));
+        }
+
+        template<typename T>
+        requires std::is_floating_point_v<T>
+        explicit operator T() const {
+            return static_cast<T>(static_cast<double>(*this));
+        }
+
+        explicit operator std::chrono::time_point<std::chrono::system_clock>() const {
+            return static_cast<std::chrono::time_point<std::chrono::system_clock>>(static_cast<datetime>(*this));
+        }
+
+        template<unsigned N>
+        explicit operator numeric<N>() const {
+            auto type2 = type;
+            std::span d = val;
+
+            if (is_null)
+                return 0;
+
+            if (type2 == sql_type::SQL_VARIANT) {
+                type2 = (sql_type)d[0];
+                d = d.subspan(1);
+                auto propbytes = d[0];
+                d = d.subspan(1 + propbytes);
+            }
+
+            switch (type2) {
+                case sql_type::TINYINT:
+                case sql_type::SMALLINT:
+                case sql_type::INT:
+                case sql_type::BIGINT:
+                case sql_type::INTN:
+                    return (int64_t)*this;
+
+                case sql_type::NUMERIC:
+                case sql_type::DECIMAL: {
+                    numeric<N> n;
+
+                    n.neg = d[0] == 0;
+
+                    if (d.size() >= 9)
+                        n.low_part = *(uint64_t*)&d[1];
+                    else
+                        n.low_part = *(uint32_t*)&d[1];
+
+                    if (d.size() >= 17)
+                        n.high_part = *(uint64_t*)&d[1 + sizeof(uint64_t)];
+                    else if (d.size() >= 13)
+                        n.high_part = *(uint32_t*)&d[1 + sizeof(uint64_t)];
+                    else
+                        n.high_part = 0;
+
+                    if (N < scale) {
+                        for (unsigned int i = N; i < scale; i++) {
+                            n.ten_div();
+                        }
+                    } else if (N > scale) {
+                        for (unsigned int i = scale; i < N; i++) {
+                            n.ten_mult();
+                        }
+                    }
+
+                    return n;
+                }
+
+                // FIXME - REAL / FLOAT
+
+                default:
+                    return (int64_t)*this; // FIXME - should be double when supported
+            }
+        }
+
+        enum sql_type type = (sql_type)0;
+        std::span<const uint8_t> val;
+        bool is_null = false;
+        unsigned int max_length = 0;
+        uint8_t precision = 0;
+        uint8_t scale = 0;
+        collation coll;
+        std::u16string_view clr_name;
+    };
+
     class TDSCPP WARN_UNUSED value {
     public:
         // make sure pointers don't get interpreted as bools
@@ -1239,90 +1630,39 @@ namespace tds {
 
         template<unsigned N>
         explicit operator numeric<N>() const {
-            auto type2 = type;
-            std::span d = val;
+            return static_cast<numeric<N>>(value_view(*this));
+        }
 
-            if (is_null)
-                return 0;
+        std::string collation_name() const;
+        std::partial_ordering operator<=>(const value& v) const;
 
-            if (type2 == sql_type::SQL_VARIANT) {
-                type2 = (sql_type)d[0];
-                d = d.subspan(1);
-                auto propbytes = d[0];
-                d = d.subspan(1 + propbytes);
-            }
+        bool operator==(const value& v) const {
+            return (*this <=> v) == std::partial_ordering::equivalent;
+        }
 
-            switch (type2) {
-                case sql_type::TINYINT:
-                case sql_type::SMALLINT:
-                case sql_type::INT:
-                case sql_type::BIGINT:
-                case sql_type::INTN:
-                    return (int64_t)*this;
+        std::string to_literal() const;
 
-                case sql_type::NUMERIC:
-                case sql_type::DECIMAL: {
-                    numeric<N> n;
+        enum sql_type type;
+        value_data_t val;
+        bool is_null = false;
+        bool is_output = false;
+        unsigned int max_length = 0;
+        uint8_t precision;
+        uint8_t scale;
+        collation coll;
+        std::u16string clr_name;
+    };
 
-                    n.neg = d[0] == 0;
+    class TDSCPP column : public value {
+    public:
+        std::u16string name;
+        bool nullable;
+    };
 
-                    if (d.size() >= 9)
-                        n.low_part = *(uint64_t*)&d[1];
-                    else
-                        n.low_part = *(uint32_t*)&d[1];
-
-                    if (d.size() >= 17)
-                        n.high_part = *(uint64_t*)&d[1 + sizeof(uint64_t)];
-                    else if (d.size() >= 13)
-                        n.high_part = *(uint32_t*)&d[1 + sizeof(uint64_t)];
-                    else
-                        n.high_part = 0;
-
-                    if (N < scale) {
-                        for (unsigned int i = N; i < scale; i++) {
-                            n.ten_div();
-                        }
-                    } else if (N > scale) {
-                        for (unsigned int i = scale; i < N; i++) {
-                            n.ten_mult();
-                        }
-                    }
-
-                    return n;
-                }
-
-                // FIXME - REAL / FLOAT
-
-                default:
-                    return (int64_t)*this; // FIXME - should be double when supported
-            }
-        }
-
-        std::string collation_name() const;
-        std::partial_ordering operator<=>(const value& v) const;
-
-        bool operator==(const value& v) const {
-            return (*this <=> v) == std::partial_ordering::equivalent;
-        }
-
-        std::string to_literal() const;
-
-        enum sql_type type;
-        value_data_t val;
-        bool is_null = false;
-        bool is_output = false;
-        unsigned int max_length = 0;
-        uint8_t precision;
-        uint8_t scale;
-        collation coll;
-        std::u16string clr_name;
-    };
-
-    class TDSCPP column : public value {
-    public:
-        std::u16string name;
-        bool nullable;
-    };
+    inline value_view::value_view(const value& v) noexcept : type(v.type), val(v.val), is_null(v.is_null),
+                                                            max_length(v.max_length), precision(v.precision),
+                                                            scale(v.scale), coll(v.coll), clr_name(v.clr_name) {
+    }
 
     template<typename T>
     class output_param : public value {
@@ -1392,6 +1732,240 @@ namespace tds {
         void bcp_sendmsg(std::span<const uint8_t> msg);
     };
 
+    // Rows which have been received but not yet fetched. The values all live
+    // in one byte buffer, found by offset and length, and the buffers keep
+    // their capacity once drained, so decoding doesn't allocate per value.
+
+    class TDSCPP row_arena {
+    public:
+        struct cell {
+            size_t offset;
+            size_t length;
+        };
+
+        [[nodiscard]] constexpr bool empty() const noexcept {
+            return next == row_start.size();
+        }
+
+        constexpr size_t num_columns(size_t row) const noexcept {
+            auto end = row + 1 < row_start.size() ? row_start[row + 1] : cells.size();
+
+            return end - row_start[row];
+        }
+
+        constexpr std::span<const uint8_t> value(size_t row, size_t col) const noexcept {
+            const auto& c = cells[row_start[row] + col];
+
+            return std::span(data.data() + c.offset, c.length);
+        }
+
+        constexpr bool is_null(size_t row, size_t col) const noexcept {
+            return nulls[row_start[row] + col];
+        }
+
+        // Rows stay where they are once popped, so that they can still be viewed - the
+        // space is only reclaimed when the next row arrives.
+
+        constexpr size_t pop() noexcept {
+            return next++;
+        }
+
+        constexpr size_t available() const noexcept {
+            return row_start.size() - next;
+        }
+
+        constexpr void start_row() {
+            if (next != 0 && next == row_start.size()) {
+                data.clear();
+                cells.clear();
+                nulls.clear();
+                row_start.clear();
+                next = 0;
+            }
+
+            row_start.push_back(cells.size());
+        }
+
+        std::vector<uint8_t> data;
+        std::vector<cell> cells;
+        std::vector<bool> nulls;
+        std::vector<size_t> row_start;
+        size_t next = 0;
+    };
+
+    // Takes apart a ROW or NBCROW token as it arrives, passing the data of any
+    // VARCHAR(MAX), NVARCHAR(MAX), VARBINARY(MAX), XML, or UDT columns to a handler
+    // rather than keeping it. Once the row is complete, row holds the token with
+    // these columns made empty (or left NULL).
+
+    class TDSCPP plp_stream {
+    public:
+        void start(bool nbc) noexcept;
+        bool feed(std::span<const uint8_t>& sp, const std::vector<column>& cols, const plp_chunk_handler& handler);
+
+        bool active = false;
+        bool nbc = false;
+        std::vector<uint8_t> row;
+
+    private:
+        bool gather(std::span<const uint8_t>& sp, size_t len);
+
+        unsigned int col;
+        unsigned int phase;
+        uint32_t chunk_left;
+        std::vector<uint8_t> pending;
+    };
+
+    class TDSCPP row_view {
+    public:
+        row_view(const row_arena& rows, const std::vector<column>& cols, size_t row) noexcept :
+            rows(&rows), cols(&cols), row(row) {
+        }
+
+        uint16_t num_columns() const noexcept {
+            return (uint16_t)cols->size();
+        }
+
+        const column& col(uint16_t i) const noexcept {
+            return (*cols)[i];
+        }
+
+        bool is_null(uint16_t i) const noexcept {
+            return rows->is_null(row, i);
+        }
+
+        std::span<const uint8_t> data(uint16_t i) const noexcept {
+            return rows->value(row, i);
+        }
+
+        value_view operator[](uint16_t i) const noexcept {
+            value_view v((*cols)[i]);
+
+            v.is_null = rows->is_null(row, i);
+
+            if (v.is_null)
+                v.val = {};
+            else
+                v.val = rows->value(row, i);
+
+            return v;
+        }
+
+    private:
+        const row_arena* rows;
+        const std::vector<column>* cols;
+        size_t row;
+    };
+
+    // A result set which has arrived, but which the caller hasn't moved on to yet
+    // with next_result - or, for rpc_pipeline, one of a call's results.
+
+    struct result_set {
+        size_t num_rows() const noexcept {
+            return rows.available();
+        }
+
+        row_view row(size_t i) const noexcept {
+            return row_view(rows, cols, i);
+        }
+
+        std::vector<column> cols;
+        row_arena rows;
+        std::optional<uint64_t> row_count;
+    };
+
+    // One column of a block of rows returned by fetch_rows. Integer and BIT columns are
+    // decoded into ints, REAL and FLOAT columns into floats, and everything else is left
+    // as its raw data (UTF-16 for NVARCHAR etc.) in data, with row i running from
+    // offsets[i] to offsets[i + 1]. Bit i of validity is clear if row i is NULL.
+
+    class TDSCPP column_vector {
+    public:
+        bool is_null(size_t row) const noexcept {
+            return !(validity[row / 8] & (1 << (row % 8)));
+        }
+
+        std::span<const uint8_t> bytes(size_t row) const noexcept {
+            return std::span(data.data() + offsets[row], (size_t)(offsets[row + 1] - offsets[row]));
+        }
+
+        column col;
+        size_t length = 0;
+        std::vector<uint8_t> validity;
+        std::vector<int64_t> ints;
+        std::vector<double> floats;
+        std::vector<int64_t> offsets;
+        std::vector<uint8_t> data;
+    };
+
+    // A VARBINARY(MAX), VARCHAR(MAX), or NVARCHAR(MAX) RPC parameter whose data is
+    // pulled from read while the request is being sent, rather than held in memory.
+    // read fills as much of the span as it can, and returns 0 at the end of the data.
+    // If length is given, the server is told it upfront, and the data must match it.
+
+    class TDSCPP plp_source {
+    public:
+        plp_source(const std::function<size_t(std::span<uint8_t>)>& read, sql_type type = sql_type::VARBINARY,
+                   std::optional<uint64_t> length = std::nullopt, collation coll = {}) :
+                   read(read), type(type), length(length), coll(coll) { }
+        plp_source(std::istream& is, sql_type type = sql_type::VARBINARY,
+                   std::optional<uint64_t> length = std::nullopt, collation coll = {});
+
+        std::function<size_t(std::span<uint8_t>)> read;
+        sql_type type;
+        std::optional<uint64_t> length;
+        collation coll;
+    };
+
+    // A table-valued parameter. type_name can include the schema, and cols have to
+    // match the table type's columns. Rows are read from next_row while the request
+    // is being sent - it fills in the values of the next row and returns true, or
+    // returns false when there are no more.
+
+    class TDSCPP tvp {
+    public:
+        tvp(std::u16string_view type_name, const std::vector<col_info>& cols,
+            const std::function<bool(std::vector<value>&)>& next_row) : cols(cols), next_row(next_row) {
+            set_type_name(type_name);
+        }
+
+        // rows isn't copied, so has to outlive the RPC it's sent with
+        template<typename T> requires list_of_list_of_values<T>
+        tvp(std::u16string_view type_name, const std::vector<col_info>& cols, const T& rows) : cols(cols) {
+            set_type_name(type_name);
+
+            next_row = [&rows, it = std::ranges::begin(rows)](std::vector<value>& v) mutable {
+                if (it == std::ranges::end(rows))
+                    return false;
+
+                for (const auto& t : *it) {
+                    v.emplace_back(t);
+                }
+
+                it++;
+
+                return true;
+            };
+        }
+
+        std::u16string schema;
+        std::u16string type_name;
+        std::vector<col_info> cols;
+        std::function<bool(std::vector<value>&)> next_row;
+
+    private:
+        void set_type_name(std::u16string_view name) {
+            auto dot = name.find(u'.');
+
+            if (dot == std::u16string_view::npos)
+                type_name = name;
+            else {
+                schema = name.substr(0, dot);
+                type_name = name.substr(dot + 1);
+            }
+        }
+    };
+
     class TDSCPP rpc {
     public:
         ~rpc();
@@ -1448,6 +2022,26 @@ namespace tds {
             do_rpc(sess, rpc_name);
         }
 
+        template<typename... Args>
+        rpc(deferred_t, tds& tds, const string_or_u16string auto& rpc_name, Args&&... args) : conn(tds) {
+            params.reserve(sizeof...(args));
+
+            if constexpr (sizeof...(args) > 0)
+                add_param(args...);
+
+            do_rpc(conn, rpc_name, false);
+        }
+
+        template<typename... Args>
+        rpc(deferred_t, session& sess, const string_or_u16string auto& rpc_name, Args&&... args) : conn(sess.conn) {
+            params.reserve(sizeof...(args));
+
+            if constexpr (sizeof...(args) > 0)
+                add_param(args...);
+
+            do_rpc(sess, rpc_name, false);
+        }
+
         uint16_t num_columns() const;
 
         const column& operator[](uint16_t i) const;
@@ -1455,9 +2049,32 @@ namespace tds {
 
         bool fetch_row();
         bool fetch_row_no_wait();
+        // Returns the next row without copying it out of the receive buffer. The
+        // view is only valid until the next call to fetch_row or fetch_row_view.
+        std::optional<row_view> fetch_row_view();
+        // Decodes up to n rows into one column_vector per column, reusing v's buffers.
+        // Returns the number of rows fetched, which is 0 once the results are exhausted.
+        size_t fetch_rows(size_t n, std::vector<column_vector>& v);
+        std::vector<column_vector> fetch_rows(size_t n);
+        // Passes the data of VARCHAR(MAX), NVARCHAR(MAX), VARBINARY(MAX), XML and UDT
+        // columns to handler as it arrives, rather than keeping it in the row - the
+        // handler is called with an empty span once a value is complete, and not at
+        // all for NULLs. Construct with deferred, so it's set before any rows arrive.
+        void set_plp_handler(const plp_chunk_handler& handler);
+
+        task<void> start();
+        task<bool> next_row();
+        // Moves on to the next result set, discarding any rows left in this one. Returns
+        // false once there are no more. fetch_row returns false at the end of each set.
+        bool next_result();
+        task<bool> next_result_async();
 
         int32_t return_status = 0;
         std::vector<column> cols;
+        // For a SELECT, the rows in the current result set. If there's no result set, the
+        // rows affected by the last statement, such as an INSERT or UPDATE. Not set if the
+        // server didn't send a count, e.g. with SET NOCOUNT ON.
+        std::optional<uint64_t> row_count;
 
     private:
         template<typename T, typename... Args>
@@ -1495,24 +2112,126 @@ namespace tds {
                 params.emplace_back(v.value());
         }
 
-        void do_rpc(tds& conn, std::u16string_view name);
-        void do_rpc(tds& conn, std::string_view name);
-        void do_rpc(session& sess, std::u16string_view name);
-        void do_rpc(session& sess, std::string_view name);
+        template<typename T> requires std::is_same_v<std::remove_cvref_t<T>, plp_source>
+        void add_param(T&& src) {
+            params.emplace_back("");
+            params.back().type = src.type;
+            params.back().coll = src.coll;
+
+            plp_params.emplace((unsigned int)(params.size() - 1), src);
+        }
+
+        template<typename T> requires std::is_same_v<std::remove_cvref_t<T>, tvp>
+        void add_param(T&& t) {
+            params.emplace_back("");
+            params.back().type = sql_type::TVP;
+
+            tvp_params.emplace((unsigned int)(params.size() - 1), t);
+        }
+
+        void do_rpc(tds& conn, std::u16string_view name, bool wait = true);
+        void do_rpc(tds& conn, std::string_view name, bool wait = true);
+        void do_rpc(session& sess, std::u16string_view name, bool wait = true);
+        void do_rpc(session& sess, std::string_view name, bool wait = true);
         void wait_for_packet();
+        task<void> wait_for_packet_async();
 
         tds& conn;
         std::vector<value> params;
         std::map<unsigned int, value*> output_params;
-        bool finished = false, received_attn = false;
-        std::list<std::vector<std::pair<value_data_t, bool>>> rows;
-        std::list<std::vector<uint8_t>> tokens;
+        std::map<unsigned int, plp_source> plp_params;
+        std::map<unsigned int, tvp> tvp_params;
+        bool finished = false, received_attn = false, started = true;
+        row_arena rows;
+        std::list<result_set> results;
+        std::vector<std::span<const uint8_t>> tokens;
+        plp_chunk_handler plp_cb;
+        plp_stream plp;
         std::vector<uint8_t> buf;
         std::vector<column> buf_columns;
         std::u16string name;
         std::optional<std::reference_wrapper<smp_session>> sess;
     };
 
+    // Sends several RPCs in one message, so that between them they only cost one
+    // round-trip. execute() reads all the results, which are then in calls, in the
+    // order the RPCs were added.
+
+    class TDSCPP rpc_pipeline {
+    public:
+        struct call {
+            std::u16string name;
+            std::vector<value> params;
+            std::map<unsigned int, value*> output_params;
+            int32_t return_status = 0;
+            // rows affected by the call's last statement
+            std::optional<uint64_t> row_count;
+            std::vector<result_set> results;
+        };
+
+        rpc_pipeline(tds& tds) : conn(tds) { }
+        rpc_pipeline(session& sess);
+
+        template<typename... Args>
+        void add(std::u16string_view rpc_name, Args&&... args) {
+            auto& c = calls.emplace_back();
+
+            c.name = rpc_name;
+            c.params.reserve(sizeof...(args));
+
+            if constexpr (sizeof...(args) > 0)
+                add_param(c, args...);
+        }
+
+        template<typename... Args>
+        void add(std::string_view rpc_name, Args&&... args) {
+            add(utf8_to_utf16(rpc_name), args...);
+        }
+
+        void execute();
+
+        std::vector<call> calls;
+
+    private:
+        template<typename T, typename... Args>
+        void add_param(call& c, T&& t, Args&&... args) {
+            add_param(c, t);
+            add_param(c, args...);
+        }
+
+        template<typename T>
+        void add_param(call& c, T&& t) {
+            c.params.emplace_back(t);
+        }
+
+        template<typename T>
+        void add_param(call& c, output_param<T>& t) {
+            c.params.emplace_back(static_cast<value>(t));
+            c.params.back().is_output = true;
+
+            c.output_params[(unsigned int)(c.params.size() - 1)] = static_cast<value*>(&t);
+        }
+
+        template<typename T> requires (std::ranges::input_range<T> && !byte_list<T> && !is_string<T> && !is_u16string<T> && !is_u8string<T>)
+        void add_param(call& c, T&& v) {
+            for (const auto& t : v) {
+                c.params.emplace_back(t);
+            }
+        }
+
+        template<typename T>
+        void add_param(call& c, const std::optional<T>& v) {
+            if (!v.has_value()) {
+                c.params.emplace_back("");
+                c.params.back().is_null = true;
+            } else
+                c.params.emplace_back(v.value());
+        }
+
+        tds& conn;
+        std::optional<std::reference_wrapper<smp_session>> sess;
+    };
+
     class TDSCPP query {
     public:
         query(tds& tds, std::type_identity_t<checker<char, 0>> q) : conn(tds) {
@@ -1641,6 +2360,36 @@ namespace tds {
                 do_query(sess, q.sv);
         }
 
+        template<typename T, typename... Args>
+        query(deferred_t, tds& tds, no_check<T> q, Args&&... args) : conn(tds) {
+            params.reserve(sizeof...(args));
+
+            if constexpr (sizeof...(args) > 0)
+                add_param(args...);
+
+            if constexpr (std::is_same_v<T, char>)
+                do_query(conn, cp_to_utf16(q.sv, tds.codepage), false);
+            else if constexpr (std::is_same_v<T, char8_t>)
+                do_query(conn, utf8_to_utf16(q.sv), false);
+            else
+                do_query(conn, q.sv, false);
+        }
+
+        template<typename T, typename... Args>
+        query(deferred_t, session& sess, no_check<T> q, Args&&... args) : conn(sess.conn) {
+            params.reserve(sizeof...(args));
+
+            if constexpr (sizeof...(args) > 0)
+                add_param(args...);
+
+            if constexpr (std::is_same_v<T, char>)
+                do_query(sess, cp_to_utf16(q.sv, sess.conn.codepage), false);
+            else if constexpr (std::is_same_v<T, char8_t>)
+                do_query(sess, utf8_to_utf16(q.sv), false);
+            else
+                do_query(sess, q.sv, false);
+        }
+
         query(const query&) = delete;
 
         ~query();
@@ -1652,10 +2401,36 @@ namespace tds {
 
         bool fetch_row();
         bool fetch_row_no_wait();
+        // Returns the next row without copying it out of the receive buffer. The
+        // view is only valid until the next call to fetch_row or fetch_row_view.
+        std::optional<row_view> fetch_row_view();
+        // Decodes up to n rows into one column_vector per column, reusing v's buffers.
+        // Returns the number of rows fetched, which is 0 once the results are exhausted.
+        size_t fetch_rows(size_t n, std::vector<column_vector>& v);
+        std::vector<column_vector> fetch_rows(size_t n);
+        // Passes the data of VARCHAR(MAX), NVARCHAR(MAX), VARBINARY(MAX), XML and UDT
+        // columns to handler as it arrives, rather than keeping it in the row - the
+        // handler is called with an empty span once a value is complete, and not at
+        // all for NULLs. Construct with deferred, so it's set before any rows arrive.
+        void set_plp_handler(const plp_chunk_handler& handler);
+
+        task<void> start();
+        task<bool> next_row();
+        // Moves on to the next result set, discarding any rows left in this one. Returns
+        // false once there are no more. fetch_row returns false at the end of each set.
+        bool next_result();
+        task<bool> next_result_async();
+        // For a SELECT, the rows in the current result set. If there's no result set, the
+        // rows affected by the last statement, such as an INSERT or UPDATE. nullopt if the
+        // server didn't send a count, e.g. with SET NOCOUNT ON.
+        std::optional<uint64_t> row_count() const;
 
     private:
-        void do_query(tds& conn, std::u16string_view q);
-        void do_query(session& sess, std::u16string_view q);
+        void do_query(tds& conn, std::u16string_view q, bool wait = true);
+        void do_query(session& sess, std::u16string_view q, bool wait = true);
+        void prepared(bool wait);
+        bool from_cache(std::u16string_view q, std::u16string_view params_string);
+        void take_metadata();
 
         template<typename T, typename... Args>
         void add_param(T&& t, Args&&... args) {
@@ -1703,43 +2478,219 @@ namespace tds {
         tds& conn;
         std::vector<value> params;
         std::vector<column> cols;
-        std::unique_ptr<rpc> r2;
+        std::unique_ptr<rpc> r1, r2;
+        plp_chunk_handler plp_cb;
         output_param<int32_t> handle;
         std::optional<std::reference_wrapper<session>> sess;
+        std::u16string cache_key;
+        uint64_t cache_gen = 0;
+        bool exec_metadata = false;
     };
 
     template<typename... Args>
     void tds::run(std::type_identity_t<checker<char, sizeof...(Args)>> s, Args&&... args) {
         query q(*this, no_check(s.sv), args...);
 
-        while (q.fetch_row()) {
-        }
+        do {
+            while (q.fetch_row()) {
+            }
+        } while (q.next_result());
     }
 
     template<typename... Args>
     void tds::run(std::type_identity_t<checker<char16_t, sizeof...(Args)>> s, Args&&... args) {
         query q(*this, no_check(s.sv), args...);
 
-        while (q.fetch_row()) {
-        }
+        do {
+            while (q.fetch_row()) {
+            }
+        } while (q.next_result());
     }
 
     template<typename... Args>
     void tds::run(std::type_identity_t<checker<char8_t, sizeof...(Args)>> s, Args&&... args) {
         query q(*this, no_check(s.sv), args...);
 
-        while (q.fetch_row()) {
-        }
+        do {
+            while (q.fetch_row()) {
+            }
+        } while (q.next_result());
     }
 
     template<typename T, typename... Args>
     void tds::run(no_check<T> s, Args&&... args) {
         query q(*this, s, args...);
 
-        while (q.fetch_row()) {
+        do {
+            while (q.fetch_row()) {
+            }
+        } while (q.next_result());
+    }
+
+    template<typename T>
+    std::vector<uint64_t> tds::run_many(no_check<T> s, const std::ranges::input_range auto& rows) {
+        std::vector<std::vector<value>> v;
+
+        for (const auto& r : rows) {
+            auto& p = v.emplace_back();
+
+            if constexpr (requires { std::tuple_size<std::remove_cvref_t<decltype(r)>>::value; }) {
+                std::apply([&p](const auto&... args) {
+                    (p.emplace_back(args), ...);
+                }, r);
+            } else {
+                for (const auto& t : r) {
+                    p.emplace_back(t);
+                }
+            }
         }
+
+        if constexpr (std::is_same_v<T, char>)
+            return run_many(cp_to_utf16(s.sv, codepage), v);
+        else if constexpr (std::is_same_v<T, char8_t>)
+            return run_many(utf8_to_utf16(s.sv), v);
+        else
+            return run_many(s.sv, v);
     }
 
+    template<typename T>
+    using typed_decoder = T (*)(std::span<const uint8_t> d, const column& col);
+
+    // Returns a function which converts a column's data to T, chosen once from the
+    // column's metadata. Throws if the column can't be converted.
+
+    template<typename T>
+    typed_decoder<T> get_decoder(const column& col);
+
+    template<> TDSCPP typed_decoder<int64_t> get_decoder<int64_t>(const column& col);
+    template<> TDSCPP typed_decoder<double> get_decoder<double>(const column& col);
+    template<> TDSCPP typed_decoder<std::string> get_decoder<std::string>(const column& col);
+    template<> TDSCPP typed_decoder<std::u8string> get_decoder<std::u8string>(const column& col);
+    template<> TDSCPP typed_decoder<std::u16string> get_decoder<std::u16string>(const column& col);
+    template<> TDSCPP typed_decoder<std::string_view> get_decoder<std::string_view>(const column& col);
+    template<> TDSCPP typed_decoder<std::u16string_view> get_decoder<std::u16string_view>(const column& col);
+    template<> TDSCPP typed_decoder<std::chrono::year_month_day> get_decoder<std::chrono::year_month_day>(const column& col);
+    template<> TDSCPP typed_decoder<time_t> get_decoder<time_t>(const column& col);
+    template<> TDSCPP typed_decoder<datetime> get_decoder<datetime>(const column& col);
+    template<> TDSCPP typed_decoder<datetimeoffset> get_decoder<datetimeoffset>(const column& col);
+
+    template<typename T>
+    struct typed_column {
+        using base = T;
+
+        static constexpr bool nullable = false;
+
+        static T convert(base&& b) {
+            return std::move(b);
+        }
+    };
+
+    template<typename T>
+    requires std::is_integral_v<T>
+    struct typed_column<T> {
+        using base = int64_t;
+
+        static constexpr bool nullable = false;
+
+        static T convert(base b) {
+            return static_cast<T>(b);
+        }
+    };
+
+    template<typename T>
+    requires std::is_floating_point_v<T>
+    struct typed_column<T> {
+        using base = double;
+
+        static constexpr bool nullable = false;
+
+        static T convert(base b) {
+            return static_cast<T>(b);
+        }
+    };
+
+    template<typename T>
+    struct typed_column<std::optional<T>> {
+        using base = typename typed_column<T>::base;
+
+        static constexpr bool nullable = true;
+
+        static std::optional<T> convert(base&& b) {
+            return typed_column<T>::convert(std::move(b));
+        }
+    };
+
+    // A query whose rows are returned as a tuple of Ts. The column metadata is checked
+    // against Ts once, and each column then has its own decoder, rather than going
+    // through value. Use std::optional<T> for nullable columns. Views (std::string_view,
+    // std::u16string_view) point into the receive buffer, and are only valid until the
+    // next call to fetch_row. VARCHAR columns can only be bound to std::string_view if
+    // their collation is UTF-8, as anything else would need converting.
+
+    template<typename... Ts>
+    class typed_query : public query {
+    public:
+        using query::query;
+
+        std::optional<std::tuple<Ts...>> fetch_row() {
+            auto r = fetch_row_view();
+
+            if (!r)
+                return std::nullopt;
+
+            if (!bound)
+                bind(*r, std::index_sequence_for<Ts...>{});
+
+            return decode(*r, std::index_sequence_for<Ts...>{});
+        }
+
+        // the next result set has its own metadata, so has to be checked again
+        bool next_result() {
+            bound = false;
+
+            return query::next_result();
+        }
+
+        task<bool> next_result_async() {
+            bound = false;
+
+            return query::next_result_async();
+        }
+
+    private:
+        template<size_t... I>
+        void bind(const row_view& r, std::index_sequence<I...>) {
+            if (r.num_columns() != sizeof...(Ts))
+                throw std::runtime_error("Query returned " + std::to_string(r.num_columns()) + " columns, expected " + std::to_string(sizeof...(Ts)) + ".");
+
+            ((std::get<I>(decoders) = get_decoder<typename typed_column<Ts>::base>(r.col(I))), ...);
+
+            bound = true;
+        }
+
+        template<size_t I>
+        auto decode_col(const row_view& r) {
+            using tc = typed_column<std::tuple_element_t<I, std::tuple<Ts...>>>;
+
+            if (r.is_null(I)) {
+                if constexpr (tc::nullable)
+                    return std::tuple_element_t<I, std::tuple<Ts...>>{};
+                else
+                    throw std::runtime_error("Column " + std::to_string(I) + " is NULL.");
+            }
+
+            return tc::convert(std::get<I>(decoders)(r.data(I), r.col(I)));
+        }
+
+        template<size_t... I>
+        std::tuple<Ts...> decode(const row_view& r, std::index_sequence<I...>) {
+            return std::tuple<Ts...>{decode_col<I>(r)...};
+        }
+
+        std::tuple<typed_decoder<typename typed_column<Ts>::base>...> decoders;
+        bool bound = false;
+    };
+
     class batch_impl;
 
     class TDSCPP batch {
@@ -1788,16 +2739,59 @@ namespace tds {
                 do_batch(sess, q.sv);
         }
 
+        template<typename T>
+        batch(deferred_t, tds& conn, no_check<T> q) {
+            if constexpr (std::is_same_v<T, char>)
+                do_batch(conn, cp_to_utf16(q.sv, conn.codepage), false);
+            else if constexpr (std::is_same_v<T, char8_t>)
+                do_batch(conn, utf8_to_utf16(q.sv), false);
+            else
+                do_batch(conn, q.sv, false);
+        }
+
+        template<typename T>
+        batch(deferred_t, session& sess, no_check<T> q) {
+            if constexpr (std::is_same_v<T, char>)
+                do_batch(sess, cp_to_utf16(q.sv, sess.conn.codepage), false);
+            else if constexpr (std::is_same_v<T, char8_t>)
+                do_batch(sess, utf8_to_utf16(q.sv), false);
+            else
+                do_batch(sess, q.sv, false);
+        }
+
         ~batch();
 
         uint16_t num_columns() const;
         const column& operator[](uint16_t i) const;
         column& operator[](uint16_t i);
         bool fetch_row();
+        // Returns the next row without copying it out of the receive buffer. The
+        // view is only valid until the next call to fetch_row or fetch_row_view.
+        std::optional<row_view> fetch_row_view();
+        // Decodes up to n rows into one column_vector per column, reusing v's buffers.
+        // Returns the number of rows fetched, which is 0 once the results are exhausted.
+        size_t fetch_rows(size_t n, std::vector<column_vector>& v);
+        std::vector<column_vector> fetch_rows(size_t n);
+        // Passes the data of VARCHAR(MAX), NVARCHAR(MAX), VARBINARY(MAX), XML and UDT
+        // columns to handler as it arrives, rather than keeping it in the row - the
+        // handler is called with an empty span once a value is complete, and not at
+        // all for NULLs. Construct with deferred, so it's set before any rows arrive.
+        void set_plp_handler(const plp_chunk_handler& handler);
+
+        task<void> start();
+        task<bool> next_row();
+        // Moves on to the next result set, discarding any rows left in this one. Returns
+        // false once there are no more. fetch_row returns false at the end of each set.
+        bool next_result();
+        task<bool> next_result_async();
+        // For a SELECT, the rows in the current result set. If there's no result set, the
+        // rows affected by the last statement, such as an INSERT or UPDATE. nullopt if the
+        // server didn't send a count, e.g. with SET NOCOUNT ON.
+        std::optional<uint64_t> row_count() const;
 
     private:
-        void do_batch(tds& conn, std::u16string_view q);
-        void do_batch(session& sess, std::u16string_view q);
+        void do_batch(tds& conn, std::u16string_view q, bool wait = true);
+        void do_batch(session& sess, std::u16string_view q, bool wait = true);
 
         batch_impl* impl;
     };
@@ -1805,74 +2799,256 @@ namespace tds {
     void __inline tds::run(std::type_identity_t<checker<char, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     void __inline tds::run(std::type_identity_t<checker<char16_t, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     void __inline tds::run(std::type_identity_t<checker<char8_t, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     template<typename T>
     void tds::run(no_check<T> s) {
         batch b(*this, s);
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     template<typename... Args>
     void tds::run_rpc(const string_or_u16string auto& rpc_name, Args&&... args) {
         rpc r(*this, rpc_name, args...);
 
-        while (r.fetch_row()) {
-        }
+        do {
+            while (r.fetch_row()) {
+            }
+        } while (r.next_result());
     }
 
     void tds::run_rpc(const string_or_u16string auto& rpc_name) {
         rpc r(*this, rpc_name);
 
-        while (r.fetch_row()) {
-        }
+        do {
+            while (r.fetch_row()) {
+            }
+        } while (r.next_result());
     }
 
     void __inline session::run(std::type_identity_t<checker<char, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     void __inline session::run(std::type_identity_t<checker<char16_t, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     void __inline session::run(std::type_identity_t<checker<char8_t, 0>> s) {
         batch b(*this, no_check(s.sv));
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
     }
 
     template<typename T>
     void session::run(no_check<T> s) {
         batch b(*this, s);
 
-        while (b.fetch_row()) {
-        }
+        do {
+            while (b.fetch_row()) {
+            }
+        } while (b.next_result());
+    }
+
+    // The async_ functions send the request and complete once the first packet of
+    // the response has arrived, without blocking the calling thread. Arguments
+    // are taken by reference, so co_await the result straight away. Coroutines are
+    // never resumed on the socket thread, so they're free to use the blocking API.
+    // An executor mustn't resume them inline either, for the same reason.
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(tds& conn, std::type_identity_t<checker<char, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, conn, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(tds& conn, std::type_identity_t<checker<char16_t, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, conn, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(tds& conn, std::type_identity_t<checker<char8_t, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, conn, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename T, typename... Args>
+    task<std::unique_ptr<query>> async_query(tds& conn, no_check<T> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, conn, q, args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(session& sess, std::type_identity_t<checker<char, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, sess, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(session& sess, std::type_identity_t<checker<char16_t, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, sess, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<query>> async_query(session& sess, std::type_identity_t<checker<char8_t, sizeof...(Args)>> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, sess, no_check(q.sv), args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename T, typename... Args>
+    task<std::unique_ptr<query>> async_query(session& sess, no_check<T> q, Args&&... args) {
+        auto ret = std::make_unique<query>(deferred, sess, q, args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<rpc>> async_rpc(tds& conn, const string_or_u16string auto& rpc_name, Args&&... args) {
+        auto ret = std::make_unique<rpc>(deferred, conn, rpc_name, args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename... Args>
+    task<std::unique_ptr<rpc>> async_rpc(session& sess, const string_or_u16string auto& rpc_name, Args&&... args) {
+        auto ret = std::make_unique<rpc>(deferred, sess, rpc_name, args...);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(tds& conn, std::type_identity_t<checker<char, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, conn, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(tds& conn, std::type_identity_t<checker<char16_t, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, conn, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(tds& conn, std::type_identity_t<checker<char8_t, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, conn, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename T>
+    task<std::unique_ptr<batch>> async_batch(tds& conn, no_check<T> q) {
+        auto ret = std::make_unique<batch>(deferred, conn, q);
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(session& sess, std::type_identity_t<checker<char, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, sess, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(session& sess, std::type_identity_t<checker<char16_t, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, sess, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    inline task<std::unique_ptr<batch>> async_batch(session& sess, std::type_identity_t<checker<char8_t, 0>> q) {
+        auto ret = std::make_unique<batch>(deferred, sess, no_check(q.sv));
+
+        co_await ret->start();
+
+        co_return ret;
+    }
+
+    template<typename T>
+    task<std::unique_ptr<batch>> async_batch(session& sess, no_check<T> q) {
+        auto ret = std::make_unique<batch>(deferred, sess, q);
+
+        co_await ret->start();
+
+        co_return ret;
     }
 
     class TDSCPP trans {
@@ -1886,6 +3062,17 @@ namespace tds {
         bool committed = false;
     };
 
+    // Converts a block of rows from fetch_rows into an Arrow struct array, with one child
+    // per column. Buffers are moved out of v where the layout allows it. The caller owns
+    // schema and array, and must call their release functions.
+    void TDSCPP to_arrow(std::vector<column_vector>&& v, ArrowSchema* schema, ArrowArray* array);
+
+    // Fetches up to n rows as an Arrow record batch. Returns the number of rows, which is
+    // 0 once the results are exhausted - schema and array are filled in either way.
+    size_t TDSCPP fetch_arrow(rpc& r, size_t n, ArrowSchema* schema, ArrowArray* array);
+    size_t TDSCPP fetch_arrow(query& q, size_t n, ArrowSchema* schema, ArrowArray* array);
+    size_t TDSCPP fetch_arrow(batch& b, size_t n, ArrowSchema* schema, ArrowArray* array);
+
     void TDSCPP to_json(nlohmann::json& j, const value& v);
 
     static void __inline to_json(nlohmann::json& j, const column& c) {
@@ -2414,6 +3601,9 @@ struct fmt::formatter<enum tds::sql_type> {
             case tds::sql_type::XML:
                 return fmt::format_to(ctx.out(), "XML");
 
+            case tds::sql_type::TVP:
+                return fmt::format_to(ctx.out(), "TVP");
+
             case tds::sql_type::SQL_NULL:
                 return fmt::format_to(ctx.out(), "NULL");
 
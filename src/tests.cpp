@@ -1,4 +1,5 @@
 #include "tdscpp.h"
+#include "tdscpp-private.h"
 
 using namespace std;
 
@@ -139,3 +140,75 @@ static_assert(value_test(tds::value{false}, tds::sql_type::BITN, false, { 0x00 }
 static_assert(value_test(tds::value{optional<bool>{true}}, tds::sql_type::BITN, false, { 0x01 })); // bool
 static_assert(value_test(tds::value{optional<bool>{false}}, tds::sql_type::BITN, false, { 0x01 })); // bool
 static_assert(value_test(tds::value{optional<bool>{nullopt}}, tds::sql_type::BITN, true, { })); // bool
+
+template<typename F>
+constexpr bool arrow_test(F func, const vector<uint8_t>& in, const array<uint8_t, 16>& exp) {
+    array<uint8_t, 16> out = { };
+
+    func(out, in);
+
+    return out == exp;
+}
+
+static_assert(arrow_test(tds::write_decimal128, { 0x01, 0x39, 0x30, 0x00, 0x00 }, { 0x39, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 })); // DECIMAL 12345
+static_assert(arrow_test(tds::write_decimal128, { 0x00, 0x39, 0x30, 0x00, 0x00 }, { 0xc7, 0xcf, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff })); // DECIMAL -12345
+static_assert(arrow_test(tds::write_decimal128, { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 })); // DECIMAL -0
+static_assert(arrow_test(tds::write_decimal128, { 0x01, 0xff, 0xff, 0xff, 0xff, 0x3f, 0x22, 0x8a, 0x09, 0x7a, 0xc4, 0x86, 0x5a, 0xa8, 0x4c, 0x3b, 0x4b }, { 0xff, 0xff, 0xff, 0xff, 0x3f, 0x22, 0x8a, 0x09, 0x7a, 0xc4, 0x86, 0x5a, 0xa8, 0x4c, 0x3b, 0x4b })); // DECIMAL(38) 10^38 - 1
+static_assert(arrow_test(tds::write_decimal128, { 0x00, 0xff, 0xff, 0xff, 0xff, 0x3f, 0x22, 0x8a, 0x09, 0x7a, 0xc4, 0x86, 0x5a, 0xa8, 0x4c, 0x3b, 0x4b }, { 0x01, 0x00, 0x00, 0x00, 0xc0, 0xdd, 0x75, 0xf6, 0x85, 0x3b, 0x79, 0xa5, 0x57, 0xb3, 0xc4, 0xb4 })); // DECIMAL(38) -(10^38 - 1)
+
+static_assert(arrow_test(tds::write_money128, { 0x00, 0x00, 0x00, 0x00, 0x10, 0x27, 0x00, 0x00 }, { 0x10, 0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 })); // MONEY 1.0000
+static_assert(arrow_test(tds::write_money128, { 0x01, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00 }, { 0x05, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 })); // MONEY 429496.7301
+static_assert(arrow_test(tds::write_money128, { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff })); // MONEY -0.0001
+static_assert(arrow_test(tds::write_money128, { 0xf0, 0xd8, 0xff, 0xff }, { 0xf0, 0xd8, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff })); // SMALLMONEY -1.0000
+static_assert(arrow_test(tds::write_money128, { 0x10, 0x27, 0x00, 0x00 }, { 0x10, 0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 })); // SMALLMONEY 1.0000
+
+static_assert(arrow_test(tds::write_uuid, { 0xff, 0x19, 0x96, 0x6f, 0x86, 0x8b, 0x11, 0xd0, 0xb4, 0x2d, 0x00, 0xc0, 0x4f, 0xc9, 0x64, 0xff }, { 0x6f, 0x96, 0x19, 0xff, 0x8b, 0x86, 0xd0, 0x11, 0xb4, 0x2d, 0x00, 0xc0, 0x4f, 0xc9, 0x64, 0xff })); // 6F9619FF-8B86-D011-B42D-00C04FC964FF
+
+constexpr void arena_add(tds::row_arena& rows, const vector<uint8_t>& v, bool null) {
+    rows.cells.push_back({rows.data.size(), v.size()});
+    rows.data.insert(rows.data.end(), v.begin(), v.end());
+    rows.nulls.push_back(null);
+}
+
+constexpr bool row_arena_test() {
+    tds::row_arena rows;
+
+    if (!rows.empty())
+        return false;
+
+    rows.start_row();
+    arena_add(rows, { 0x01, 0x02 }, false);
+    arena_add(rows, { }, true);
+    rows.start_row();
+    arena_add(rows, { 0x03 }, false);
+    arena_add(rows, { 0x04, 0x05, 0x06 }, false);
+
+    if (rows.available() != 2 || rows.num_columns(0) != 2 || rows.num_columns(1) != 2)
+        return false;
+
+    if (rows.pop() != 0 || rows.value(0, 0).size() != 2 || rows.value(0, 0)[1] != 0x02 || !rows.is_null(0, 1))
+        return false;
+
+    if (rows.pop() != 1 || !rows.empty() || rows.value(1, 1).size() != 3 || rows.value(1, 1)[2] != 0x06)
+        return false;
+
+    // popped rows can still be viewed until the next one arrives, which reuses the space
+
+    rows.start_row();
+    arena_add(rows, { 0x07 }, false);
+
+    if (rows.next != 0 || rows.available() != 1 || rows.data.size() != 1 || rows.value(0, 0)[0] != 0x07)
+        return false;
+
+    // ... but not while there's rows still waiting to be fetched
+
+    rows.start_row();
+    arena_add(rows, { 0x08 }, false);
+
+    if (rows.available() != 2 || rows.data.size() != 2 || rows.value(1, 0)[0] != 0x08)
+        return false;
+
+    return true;
+}
+
+static_assert(row_arena_test());
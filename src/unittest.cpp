@@ -0,0 +1,491 @@
+// Tests of the parts which don't need a server, but can't be checked at compile
+// time like those in tests.cpp. This is built from the library's objects, so that
+// it can get at internal functions.
+
+#include "tdscpp.h"
+#include "tdscpp-private.h"
+
+using namespace std;
+
+static void add_u16(vector<uint8_t>& v, uint16_t n) {
+    v.push_back((uint8_t)n);
+    v.push_back((uint8_t)(n >> 8));
+}
+
+static void add_u32(vector<uint8_t>& v, uint32_t n) {
+    for (unsigned int i = 0; i < sizeof(uint32_t); i++) {
+        v.push_back((uint8_t)(n >> (i * 8)));
+    }
+}
+
+static void add_u64(vector<uint8_t>& v, uint64_t n) {
+    for (unsigned int i = 0; i < sizeof(uint64_t); i++) {
+        v.push_back((uint8_t)(n >> (i * 8)));
+    }
+}
+
+static vector<uint8_t> blob(size_t len) {
+    vector<uint8_t> v;
+
+    for (size_t i = 0; i < len; i++) {
+        v.push_back((uint8_t)(i * 7));
+    }
+
+    return v;
+}
+
+// INT NULL, VARBINARY(MAX) NULL
+
+static vector<uint8_t> test_colmetadata() {
+    vector<uint8_t> v{(uint8_t)tds::token::COLMETADATA};
+
+    add_u16(v, 2);
+
+    add_u32(v, 0); // user type
+    add_u16(v, 9); // flags
+    v.push_back((uint8_t)tds::sql_type::INTN);
+    v.push_back(4); // max length
+    v.push_back(1);
+    add_u16(v, u'a');
+
+    add_u32(v, 0);
+    add_u16(v, 9);
+    v.push_back((uint8_t)tds::sql_type::VARBINARY);
+    add_u16(v, 0xffff);
+    v.push_back(1);
+    add_u16(v, u'b');
+
+    return v;
+}
+
+static vector<tds::column> test_columns() {
+    vector<tds::column> cols(2);
+
+    cols[0].type = tds::sql_type::INTN;
+    cols[0].max_length = 4;
+    cols[0].nullable = true;
+    cols[1].type = tds::sql_type::VARBINARY;
+    cols[1].max_length = 0xffff;
+    cols[1].nullable = true;
+
+    return cols;
+}
+
+// the contents of a ROW token, without the token type - a null blob is written as a
+// PLP NULL, and the blob is split into chunks of chunk_size
+
+static vector<uint8_t> test_row(int32_t n, const optional<vector<uint8_t>>& b, size_t chunk_size) {
+    vector<uint8_t> v;
+
+    v.push_back(sizeof(int32_t));
+    add_u32(v, (uint32_t)n);
+
+    if (!b) {
+        add_u64(v, 0xffffffffffffffff);
+        return v;
+    }
+
+    add_u64(v, b->size());
+
+    for (size_t i = 0; i < b->size(); i += chunk_size) {
+        auto len = min(chunk_size, b->size() - i);
+
+        add_u32(v, (uint32_t)len);
+        v.insert(v.end(), b->begin() + (ptrdiff_t)i, b->begin() + (ptrdiff_t)(i + len));
+    }
+
+    add_u32(v, 0);
+
+    return v;
+}
+
+static vector<uint8_t> test_done() {
+    vector<uint8_t> v{(uint8_t)tds::token::DONE};
+
+    add_u16(v, 0x10); // status
+    add_u16(v, 0xc1); // curcmd
+    add_u64(v, 2); // row count
+
+    return v;
+}
+
+// A stream split at every possible point should give the same tokens as if it
+// arrived whole, with the incomplete token carried over each time.
+
+static bool parse_tokens_split_test() {
+    vector<uint8_t> stream = test_colmetadata();
+
+    for (auto t : { test_row(1, blob(100), 30), test_row(2, nullopt, 30) }) {
+        stream.push_back((uint8_t)tds::token::ROW);
+        stream.insert(stream.end(), t.begin(), t.end());
+    }
+
+    auto done = test_done();
+
+    stream.insert(stream.end(), done.begin(), done.end());
+
+    vector<vector<uint8_t>> expected;
+
+    {
+        vector<span<const uint8_t>> tokens;
+        vector<tds::column> buf_columns;
+
+        auto rest = parse_tokens(stream, tokens, buf_columns);
+
+        if (!rest.empty() || tokens.size() != 4 || buf_columns.size() != 2)
+            return false;
+
+        for (auto t : tokens) {
+            expected.emplace_back(t.begin(), t.end());
+        }
+    }
+
+    for (size_t split = 0; split <= stream.size(); split++) {
+        vector<span<const uint8_t>> tokens;
+        vector<tds::column> buf_columns;
+        vector<vector<uint8_t>> got;
+
+        auto rest = parse_tokens(span(stream).subspan(0, split), tokens, buf_columns);
+
+        for (auto t : tokens) {
+            got.emplace_back(t.begin(), t.end());
+        }
+
+        vector<uint8_t> carry{rest.begin(), rest.end()};
+
+        carry.insert(carry.end(), stream.begin() + (ptrdiff_t)split, stream.end());
+
+        tokens.clear();
+
+        rest = parse_tokens(carry, tokens, buf_columns);
+
+        for (auto t : tokens) {
+            got.emplace_back(t.begin(), t.end());
+        }
+
+        if (!rest.empty() || got != expected)
+            return false;
+    }
+
+    return true;
+}
+
+// Feeding a row in pieces of every size should pass the same data to the handler,
+// and leave the same row behind, however the pieces line up with the chunks.
+
+static bool plp_stream_feed_test(const optional<vector<uint8_t>>& b, bool nbc) {
+    auto cols = test_columns();
+    auto row = test_row(42, b, 30);
+
+    if (nbc) {
+        if (!b) {
+            // the NULL blob is in the bitmap instead
+            row.resize(1 + sizeof(int32_t));
+            row.insert(row.begin(), 0x02);
+        } else
+            row.insert(row.begin(), 0x00);
+    }
+
+    for (size_t piece = 1; piece <= row.size(); piece++) {
+        tds::plp_stream plp;
+        vector<uint8_t> received;
+        bool received_end = false;
+        bool done = false;
+
+        plp.start(nbc);
+
+        span<const uint8_t> sp = row;
+
+        while (!sp.empty()) {
+            auto sp2 = sp.subspan(0, min(piece, sp.size()));
+
+            if (done)
+                return false;
+
+            done = plp.feed(sp2, cols, [&](uint16_t col, span<const uint8_t> chunk) {
+                if (col != 1 || received_end)
+                    throw runtime_error("Unexpected chunk.");
+
+                if (chunk.empty())
+                    received_end = true;
+                else
+                    received.insert(received.end(), chunk.begin(), chunk.end());
+            });
+
+            // anything short of the whole row should be taken in
+            if (!done && !sp2.empty())
+                return false;
+
+            sp = sp.subspan(min(piece, sp.size()) - sp2.size());
+        }
+
+        if (!done || plp.active)
+            return false;
+
+        if (b) {
+            if (!received_end || received != *b)
+                return false;
+        } else if (received_end || !received.empty())
+            return false;
+
+        tds::row_arena rows;
+
+        handle_plp_row(plp, cols, rows);
+
+        if (rows.available() != 1 || rows.is_null(0, 0) || rows.value(0, 0).size() != sizeof(int32_t))
+            return false;
+
+        if (*(int32_t*)rows.value(0, 0).data() != 42)
+            return false;
+
+        // the handler has had the data, so the row is left with an empty value
+
+        if (rows.is_null(0, 1) != !b || !rows.value(0, 1).empty())
+            return false;
+    }
+
+    return true;
+}
+
+// Sending the queue in writes of every size up to a few buffers should send exactly
+// what was queued - resuming part-way through the front buffer, or at the start
+// of the next one when a write ends on a boundary - however many are waiting.
+
+static bool send_queue_test() {
+    vector<uint8_t> expected;
+    vector<vector<uint8_t>> queued;
+
+    // more than the 64 spans that the socket thread gathers at once
+
+    for (size_t i = 0; i < 100; i++) {
+        auto& v = queued.emplace_back();
+
+        for (size_t j = 0; j < 1 + (i % 7); j++) {
+            v.push_back((uint8_t)(expected.size() + j));
+        }
+
+        expected.insert(expected.end(), v.begin(), v.end());
+    }
+
+    for (size_t write_size = 1; write_size <= 20; write_size++) {
+        send_queue q;
+        vector<uint8_t> sent;
+
+        for (const auto& v : queued) {
+            q.push(span<const uint8_t>(v));
+        }
+
+        while (!q.empty()) {
+            array<span<const uint8_t>, 64> bufs;
+
+            auto num = q.gather(bufs);
+
+            if (num == 0 || num > bufs.size())
+                return false;
+
+            // simulate a short write, which may stop anywhere
+            size_t written = 0;
+
+            for (size_t i = 0; i < num && written < write_size; i++) {
+                auto sp = bufs[i].subspan(0, min(bufs[i].size(), write_size - written));
+
+                sent.insert(sent.end(), sp.begin(), sp.end());
+                written += sp.size();
+            }
+
+            q.consume(written);
+        }
+
+        if (sent != expected)
+            return false;
+    }
+
+    // a write which ends exactly on a buffer boundary
+
+    {
+        send_queue q;
+        array<span<const uint8_t>, 64> bufs;
+
+        q.push(vector<uint8_t>{ 1, 2, 3 });
+        q.push(vector<uint8_t>{ 4, 5 });
+
+        q.consume(3);
+
+        if (q.gather(bufs) != 1 || bufs[0].size() != 2 || bufs[0][0] != 4)
+            return false;
+
+        q.consume(1);
+
+        if (q.gather(bufs) != 1 || bufs[0].size() != 1 || bufs[0][0] != 5)
+            return false;
+
+        q.consume(1);
+
+        if (!q.empty())
+            return false;
+    }
+
+    return true;
+}
+
+// Messages pushed from another thread should come out in order, across many chunks
+// of slots, with the producer pausing now and then so that the consumer parks.
+
+static bool mess_queue_test() {
+    static const unsigned int count = 1000;
+    tds::mess_queue q;
+
+    jthread producer([&]() {
+        for (unsigned int i = 0; i < count; i++) {
+            tds::mess m;
+
+            m.type = tds_msg::tabular_result;
+            m.payload.resize(sizeof(uint32_t));
+            memcpy(m.payload.data(), &i, sizeof(uint32_t));
+            m.last_packet = i == count - 1;
+
+            q.push(move(m));
+
+            // bursts of more than a chunk, so that drained chunks get recycled
+            if (i % 100 == 99)
+                this_thread::sleep_for(chrono::milliseconds(5));
+        }
+
+        q.close();
+    });
+
+    unsigned int next = 0;
+
+    while (true) {
+        tds::mess m;
+
+        q.wait();
+
+        while (q.pop(m)) {
+            uint32_t n;
+
+            if (m.payload.size() != sizeof(uint32_t))
+                return false;
+
+            memcpy(&n, m.payload.data(), sizeof(uint32_t));
+
+            if (n != next || m.last_packet != (n == count - 1))
+                return false;
+
+            next++;
+        }
+
+        // close() comes after the last push, so nothing can be left once we've seen it
+        if (q.closed() && q.empty())
+            break;
+    }
+
+    if (next != count)
+        return false;
+
+    // close() should wake a consumer which has stopped spinning and parked
+
+    tds::mess_queue q2;
+
+    jthread consumer([&]() {
+        q2.wait();
+    });
+
+    this_thread::sleep_for(chrono::milliseconds(50));
+
+    q2.close();
+    consumer.join();
+
+    return q2.closed() && q2.empty();
+}
+
+// The least recently returned handle should be the one evicted, and clear() should
+// stop handles which were checked out at the time from going back in.
+
+static bool prepared_cache_test() {
+    tds::prepared_cache cache;
+    uint64_t gen;
+
+    cache.capacity = 2;
+
+    if (cache.take(u"a", gen).has_value())
+        return false;
+
+    if (cache.put({u"a", 1}, gen).has_value() || cache.put({u"b", 2}, gen).has_value())
+        return false;
+
+    // over capacity - a was returned first
+    if (cache.put({u"c", 3}, gen) != 1)
+        return false;
+
+    // taking b and putting it back makes it the most recent, so c goes next
+
+    auto e = cache.take(u"b", gen);
+
+    if (!e.has_value() || e->handle != 2)
+        return false;
+
+    if (cache.put(move(*e), gen).has_value())
+        return false;
+
+    if (cache.put({u"d", 4}, gen) != 3)
+        return false;
+
+    // the same SQL prepared twice - the newcomer is the one to unprepare
+    if (cache.put({u"d", 5}, gen) != 5)
+        return false;
+
+    // handles checked out before clear() aren't put back, as the server has dropped them
+
+    uint64_t old_gen;
+
+    e = cache.take(u"d", old_gen);
+
+    if (!e.has_value() || e->handle != 4)
+        return false;
+
+    cache.clear();
+
+    if (cache.take(u"b", gen).has_value())
+        return false;
+
+    if (cache.put(move(*e), old_gen).has_value() || cache.take(u"d", gen).has_value())
+        return false;
+
+    // ... but ones checked out afterwards are
+
+    if (cache.put({u"e", 6}, gen).has_value())
+        return false;
+
+    e = cache.take(u"e", gen);
+
+    return e.has_value() && e->handle == 6;
+}
+
+int main() {
+    unsigned int failed = 0;
+
+    auto check = [&](string_view name, bool ret) {
+        if (!ret) {
+            fmt::print(stderr, "{} failed\n", name);
+            failed++;
+        }
+    };
+
+    try {
+        check("parse_tokens_split_test", parse_tokens_split_test());
+        check("plp_stream_feed_test(ROW)", plp_stream_feed_test(blob(100), false));
+        check("plp_stream_feed_test(ROW, empty)", plp_stream_feed_test(vector<uint8_t>{}, false));
+        check("plp_stream_feed_test(ROW, NULL)", plp_stream_feed_test(nullopt, false));
+        check("plp_stream_feed_test(NBCROW)", plp_stream_feed_test(blob(100), true));
+        check("plp_stream_feed_test(NBCROW, NULL)", plp_stream_feed_test(nullopt, true));
+        check("send_queue_test", send_queue_test());
+        check("mess_queue_test", mess_queue_test());
+        check("prepared_cache_test", prepared_cache_test());
+    } catch (const exception& e) {
+        fmt::print(stderr, "Exception: {}\n", e.what());
+        return 1;
+    }
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+#include "tdscpp.h"
+#include "tdscpp-private.h"
+#include "uring.h"
+#include <atomic>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+// We talk to the kernel directly rather than depending on liburing, as we only
+// need a handful of operations.
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* p) noexcept {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) noexcept {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, const void* arg, unsigned int nr_args) noexcept {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring(unsigned int entries) {
+    memset(&params, 0, sizeof(params));
+
+    fd = io_uring_setup(entries, &params);
+
+    if (fd < 0)
+        throw formatted_error("io_uring_setup failed (error {})", errno_to_string(errno));
+
+    try {
+        sq_len = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+        cq_len = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_len = cq_len = max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            throw formatted_error("mmap failed (error {})", errno_to_string(errno));
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else {
+            cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+            if (cq_ptr == MAP_FAILED) {
+                cq_ptr = nullptr;
+                throw formatted_error("mmap failed (error {})", errno_to_string(errno));
+            }
+        }
+
+        sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        auto ptr = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+        if (ptr == MAP_FAILED)
+            throw formatted_error("mmap failed (error {})", errno_to_string(errno));
+
+        sqes = (struct io_uring_sqe*)ptr;
+    } catch (...) {
+        cleanup();
+        throw;
+    }
+
+    auto sq = (uint8_t*)sq_ptr;
+    auto cq = (uint8_t*)cq_ptr;
+
+    sq_head = (uint32_t*)(sq + params.sq_off.head);
+    sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    sq_array = (uint32_t*)(sq + params.sq_off.array);
+
+    cq_head = (uint32_t*)(cq + params.cq_off.head);
+    cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+uring::~uring() {
+    cleanup();
+}
+
+void uring::cleanup() noexcept {
+    if (sqes)
+        munmap(sqes, sqes_len);
+
+    if (cq_ptr && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_len);
+
+    if (sq_ptr)
+        munmap(sq_ptr, sq_len);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+bool uring::register_buffers(span<const struct iovec> bufs) noexcept {
+    return io_uring_register(fd, IORING_REGISTER_BUFFERS, bufs.data(), (unsigned int)bufs.size()) == 0;
+}
+
+struct io_uring_sqe* uring::get_sqe() {
+    auto head = atomic_ref(*sq_head).load(memory_order_acquire);
+    auto tail = *sq_tail;
+
+    if (tail - head >= params.sq_entries) {
+        submit();
+
+        head = atomic_ref(*sq_head).load(memory_order_acquire);
+
+        if (tail - head >= params.sq_entries)
+            throw runtime_error("io_uring submission queue full.");
+    }
+
+    auto idx = tail & sq_mask;
+    auto sqe = &sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[idx] = idx;
+
+    atomic_ref(*sq_tail).store(tail + 1, memory_order_release);
+    to_submit++;
+
+    return sqe;
+}
+
+void uring::submit(unsigned int wait_nr) {
+    do {
+        auto ret = io_uring_enter(fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw formatted_error("io_uring_enter failed (error {})", errno_to_string(errno));
+        }
+
+        to_submit -= min((unsigned int)ret, to_submit);
+
+        return;
+    } while (true);
+}
+
+bool uring::peek_cqe(struct io_uring_cqe& cqe) {
+    auto head = *cq_head;
+
+    if (head == atomic_ref(*cq_tail).load(memory_order_acquire))
+        return false;
+
+    cqe = cqes[head & cq_mask];
+
+    atomic_ref(*cq_head).store(head + 1, memory_order_release);
+
+    return true;
+}
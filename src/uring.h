@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <span>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+class uring {
+public:
+    uring(unsigned int entries);
+    ~uring();
+
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+
+    [[nodiscard]] bool register_buffers(std::span<const struct iovec> bufs) noexcept;
+    [[nodiscard]] struct io_uring_sqe* get_sqe();
+    void submit(unsigned int wait_nr = 0);
+    [[nodiscard]] bool peek_cqe(struct io_uring_cqe& cqe);
+
+private:
+    void cleanup() noexcept;
+
+    int fd = -1;
+    struct io_uring_params params;
+    void* sq_ptr = nullptr;
+    size_t sq_len = 0;
+    void* cq_ptr = nullptr;
+    size_t cq_len = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned int to_submit = 0;
+};
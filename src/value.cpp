@@ -1715,7 +1715,7 @@ namespace tds {
         return ret;
     }
 
-    value::operator string() const {
+    value_view::operator string() const {
         auto type2 = type;
         unsigned int max_length2 = max_length;
         uint8_t scale2 = scale;
@@ -2085,7 +2085,7 @@ namespace tds {
         }
     }
 
-    value::operator u8string() const {
+    value_view::operator u8string() const {
         if (type == sql_type::NVARCHAR || type == sql_type::NCHAR || type == sql_type::NTEXT || type == sql_type::XML) {
             auto sv = u16string_view((char16_t*)val.data(), val.size() / sizeof(char16_t));
             u8string ret(utf16_to_utf8_len(sv), 0);
@@ -2116,7 +2116,7 @@ namespace tds {
         }
     }
 
-    value::operator u16string() const {
+    value_view::operator u16string() const {
         if (type == sql_type::NVARCHAR || type == sql_type::NCHAR || type == sql_type::NTEXT || type == sql_type::XML)
             return u16string(u16string_view((char16_t*)val.data(), val.size() / sizeof(char16_t)));
         else if (type == sql_type::VARCHAR || type == sql_type::CHAR || type == sql_type::TEXT) {
@@ -2132,7 +2132,7 @@ namespace tds {
             return utf8_to_utf16(operator string());
     }
 
-    value::operator int64_t() const {
+    value_view::operator int64_t() const {
         auto type2 = type;
         span d = val;
 
@@ -2382,7 +2382,7 @@ namespace tds {
         }
     }
 
-    value::operator chrono::year_month_day() const {
+    value_view::operator chrono::year_month_day() const {
         auto type2 = type;
         span d = val;
 
@@ -2532,7 +2532,7 @@ namespace tds {
         }
     }
 
-    value::operator time_t() const {
+    value_view::operator time_t() const {
         auto type2 = type;
         unsigned int max_length2 = max_length;
         span d = val;
@@ -2713,7 +2713,7 @@ namespace tds {
         }
     }
 
-    value::operator datetime() const {
+    value_view::operator datetime() const {
         auto type2 = type;
         unsigned int max_length2 = max_length;
         span d = val;
@@ -2912,7 +2912,7 @@ namespace tds {
         }
     }
 
-    value::operator datetimeoffset() const {
+    value_view::operator datetimeoffset() const {
         auto type2 = type;
         unsigned int max_length2 = max_length;
         span d = val;
@@ -3119,7 +3119,7 @@ namespace tds {
         }
     }
 
-    value::operator double() const {
+    value_view::operator double() const {
         auto type2 = type;
         auto max_length2 = max_length;
         span d = val;
@@ -3343,6 +3343,353 @@ namespace tds {
         }
     }
 
+    static bool is_utf8_coll(const collation& coll) {
+        return coll.utf8 || (coll.lcid == 0 && coll.sort_id == 0);
+    }
+
+    value_view::operator string_view() const {
+        switch (type) {
+            case sql_type::VARCHAR:
+            case sql_type::CHAR:
+            case sql_type::TEXT:
+                // we can't convert from the code page without making a copy
+                if (!is_utf8_coll(coll))
+                    throw formatted_error("Cannot view {} with a non-UTF-8 collation as string_view", type);
+
+                return string_view{(char*)val.data(), val.size()};
+
+            case sql_type::VARBINARY:
+            case sql_type::BINARY:
+            case sql_type::IMAGE:
+                return string_view{(char*)val.data(), val.size()};
+
+            default:
+                throw formatted_error("Cannot view {} as string_view", type);
+        }
+    }
+
+    value_view::operator u16string_view() const {
+        switch (type) {
+            case sql_type::NVARCHAR:
+            case sql_type::NCHAR:
+            case sql_type::NTEXT:
+            case sql_type::XML:
+                return u16string_view((char16_t*)val.data(), val.size() / sizeof(char16_t));
+
+            default:
+                throw formatted_error("Cannot view {} as u16string_view", type);
+        }
+    }
+
+    value::operator string() const {
+        return static_cast<string>(value_view(*this));
+    }
+
+    value::operator u8string() const {
+        return static_cast<u8string>(value_view(*this));
+    }
+
+    value::operator u16string() const {
+        return static_cast<u16string>(value_view(*this));
+    }
+
+    value::operator int64_t() const {
+        return static_cast<int64_t>(value_view(*this));
+    }
+
+    value::operator double() const {
+        return static_cast<double>(value_view(*this));
+    }
+
+    value::operator chrono::year_month_day() const {
+        return static_cast<chrono::year_month_day>(value_view(*this));
+    }
+
+    value::operator datetime() const {
+        return static_cast<datetime>(value_view(*this));
+    }
+
+    value::operator datetimeoffset() const {
+        return static_cast<datetimeoffset>(value_view(*this));
+    }
+
+    value::operator time_t() const {
+        return static_cast<time_t>(value_view(*this));
+    }
+
+    template<typename T>
+    static T decode_generic(span<const uint8_t> d, const column& col) {
+        value_view v(col);
+
+        v.val = d;
+        v.is_null = false;
+
+        return static_cast<T>(v);
+    }
+
+    template<>
+    typed_decoder<int64_t> get_decoder<int64_t>(const column& col) {
+        switch (col.type) {
+            case sql_type::TINYINT:
+            case sql_type::BIT:
+                return [](span<const uint8_t> d, const column&) -> int64_t {
+                    return *(uint8_t*)d.data();
+                };
+
+            case sql_type::SMALLINT:
+                return [](span<const uint8_t> d, const column&) -> int64_t {
+                    return *(int16_t*)d.data();
+                };
+
+            case sql_type::INT:
+                return [](span<const uint8_t> d, const column&) -> int64_t {
+                    return *(int32_t*)d.data();
+                };
+
+            case sql_type::BIGINT:
+                return [](span<const uint8_t> d, const column&) -> int64_t {
+                    return *(int64_t*)d.data();
+                };
+
+            case sql_type::INTN:
+            case sql_type::BITN:
+                switch (col.max_length) {
+                    case 1:
+                        return [](span<const uint8_t> d, const column&) -> int64_t {
+                            return *(uint8_t*)d.data();
+                        };
+
+                    case 2:
+                        return [](span<const uint8_t> d, const column&) -> int64_t {
+                            return *(int16_t*)d.data();
+                        };
+
+                    case 4:
+                        return [](span<const uint8_t> d, const column&) -> int64_t {
+                            return *(int32_t*)d.data();
+                        };
+
+                    case 8:
+                        return [](span<const uint8_t> d, const column&) -> int64_t {
+                            return *(int64_t*)d.data();
+                        };
+
+                    default:
+                        return decode_generic<int64_t>;
+                }
+
+            default:
+                return decode_generic<int64_t>;
+        }
+    }
+
+    template<>
+    typed_decoder<double> get_decoder<double>(const column& col) {
+        switch (col.type) {
+            case sql_type::REAL:
+                return [](span<const uint8_t> d, const column&) -> double {
+                    return *(float*)d.data();
+                };
+
+            case sql_type::FLOAT:
+                return [](span<const uint8_t> d, const column&) -> double {
+                    return *(double*)d.data();
+                };
+
+            case sql_type::FLTN:
+                switch (col.max_length) {
+                    case sizeof(float):
+                        return [](span<const uint8_t> d, const column&) -> double {
+                            return *(float*)d.data();
+                        };
+
+                    case sizeof(double):
+                        return [](span<const uint8_t> d, const column&) -> double {
+                            return *(double*)d.data();
+                        };
+
+                    default:
+                        return decode_generic<double>;
+                }
+
+            default:
+                return decode_generic<double>;
+        }
+    }
+
+    template<>
+    typed_decoder<string> get_decoder<string>(const column& col) {
+        switch (col.type) {
+            case sql_type::VARCHAR:
+            case sql_type::CHAR:
+            case sql_type::TEXT:
+                if (!is_utf8_coll(col.coll))
+                    return decode_generic<string>;
+
+                return [](span<const uint8_t> d, const column&) {
+                    return string{(char*)d.data(), d.size()};
+                };
+
+            case sql_type::NVARCHAR:
+            case sql_type::NCHAR:
+            case sql_type::NTEXT:
+            case sql_type::XML:
+                return [](span<const uint8_t> d, const column&) {
+                    return utf16_to_utf8(u16string_view((char16_t*)d.data(), d.size() / sizeof(char16_t)));
+                };
+
+            default:
+                return decode_generic<string>;
+        }
+    }
+
+    template<>
+    typed_decoder<u8string> get_decoder<u8string>(const column& col) {
+        switch (col.type) {
+            case sql_type::VARCHAR:
+            case sql_type::CHAR:
+            case sql_type::TEXT:
+                if (!is_utf8_coll(col.coll))
+                    return decode_generic<u8string>;
+
+                return [](span<const uint8_t> d, const column&) {
+                    return u8string{(char8_t*)d.data(), d.size()};
+                };
+
+            case sql_type::NVARCHAR:
+            case sql_type::NCHAR:
+            case sql_type::NTEXT:
+            case sql_type::XML:
+                return [](span<const uint8_t> d, const column&) {
+                    auto sv = u16string_view((char16_t*)d.data(), d.size() / sizeof(char16_t));
+                    u8string ret(utf16_to_utf8_len(sv), 0);
+
+                    utf16_to_utf8_range(sv, ret);
+
+                    return ret;
+                };
+
+            default:
+                return decode_generic<u8string>;
+        }
+    }
+
+    template<>
+    typed_decoder<u16string> get_decoder<u16string>(const column& col) {
+        switch (col.type) {
+            case sql_type::NVARCHAR:
+            case sql_type::NCHAR:
+            case sql_type::NTEXT:
+            case sql_type::XML:
+                return [](span<const uint8_t> d, const column&) {
+                    return u16string((char16_t*)d.data(), d.size() / sizeof(char16_t));
+                };
+
+            default:
+                return decode_generic<u16string>;
+        }
+    }
+
+    template<>
+    typed_decoder<string_view> get_decoder<string_view>(const column& col) {
+        switch (col.type) {
+            case sql_type::VARCHAR:
+            case sql_type::CHAR:
+            case sql_type::TEXT:
+                if (!is_utf8_coll(col.coll))
+                    throw formatted_error("Cannot bind column {} of type {} with a non-UTF-8 collation to std::string_view.", utf16_to_utf8(col.name), col.type);
+
+                return [](span<const uint8_t> d, const column&) {
+                    return string_view{(char*)d.data(), d.size()};
+                };
+
+            case sql_type::VARBINARY:
+            case sql_type::BINARY:
+            case sql_type::IMAGE:
+                return [](span<const uint8_t> d, const column&) {
+                    return string_view{(char*)d.data(), d.size()};
+                };
+
+            default:
+                throw formatted_error("Cannot bind column {} of type {} to std::string_view.", utf16_to_utf8(col.name), col.type);
+        }
+    }
+
+    template<>
+    typed_decoder<u16string_view> get_decoder<u16string_view>(const column& col) {
+        switch (col.type) {
+            case sql_type::NVARCHAR:
+            case sql_type::NCHAR:
+            case sql_type::NTEXT:
+            case sql_type::XML:
+                return [](span<const uint8_t> d, const column&) {
+                    return u16string_view((char16_t*)d.data(), d.size() / sizeof(char16_t));
+                };
+
+            default:
+                throw formatted_error("Cannot bind column {} of type {} to std::u16string_view.", utf16_to_utf8(col.name), col.type);
+        }
+    }
+
+    template<>
+    typed_decoder<chrono::year_month_day> get_decoder<chrono::year_month_day>(const column& col) {
+        switch (col.type) {
+            case sql_type::DATE:
+                return [](span<const uint8_t> d, const column&) {
+                    uint32_t n = 0;
+
+                    memcpy(&n, d.data(), 3);
+
+                    return num_to_ymd(n - jan1900);
+                };
+
+            default:
+                return decode_generic<chrono::year_month_day>;
+        }
+    }
+
+    template<>
+    typed_decoder<time_t> get_decoder<time_t>(const column&) {
+        return decode_generic<time_t>;
+    }
+
+    template<>
+    typed_decoder<datetime> get_decoder<datetime>(const column& col) {
+        switch (col.type) {
+            case sql_type::DATETIME:
+                return [](span<const uint8_t> d, const column&) {
+                    auto v = *(int32_t*)d.data();
+                    auto t = *(uint32_t*)(d.data() + sizeof(int32_t));
+
+                    return datetime{num_to_ymd(v), chrono::duration<int64_t, ratio<1, 300>>(t)};
+                };
+
+            case sql_type::DATETIME2:
+                return [](span<const uint8_t> d, const column& col2) {
+                    uint32_t n = 0;
+                    uint64_t ticks = 0;
+
+                    memcpy(&n, d.data() + d.size() - 3, 3);
+
+                    memcpy(&ticks, d.data(), min(sizeof(uint64_t), d.size() - 3));
+
+                    for (unsigned int i = 0; i < 7 - col2.max_length; i++) {
+                        ticks *= 10;
+                    }
+
+                    return datetime{num_to_ymd((int32_t)n - jan1900), time_t(ticks)};
+                };
+
+            default:
+                return decode_generic<datetime>;
+        }
+    }
+
+    template<>
+    typed_decoder<datetimeoffset> get_decoder<datetimeoffset>(const column&) {
+        return decode_generic<datetimeoffset>;
+    }
+
     static string quote_string(string_view s) {
         string ret;
 